@@ -30,6 +30,7 @@
 #include <string.h>       /* C89 */
 #include <sys/time.h>     /* POSIX */
 #include <syslog.h>       /* XSI */
+#include <time.h>         /* C89 */
 #include <unistd.h>       /* POSIX */
 /*
  * Linux headers.
@@ -100,6 +101,11 @@
 #endif
 #define EVENTLIRCD_EVMAP_NULL 65535U
 
+/*
+ * The largest number of input events read from an input device at once.
+ */
+#define INPUT_DEVICE_EVENT_MAX 64
+
 /*
  * Macros for reading ioctl bit fields.
  */
@@ -149,8 +155,13 @@ struct input_device_evmap {
 struct input_device {
 	int fd;                             /* The input device's file descriptor. */
 	char *path;                         /* The input device's path in the device file system. */
+	char *evmap_file;                   /* The input device's event map file name (NULL for none). */
 	struct input_device_evmap *evmap;   /* The input device's event map table. */
 	size_t evmap_size;                  /* The input device's event map table size. */
+	struct {                            /* The event map table read by input_reload(). */
+		struct input_device_evmap *evmap;
+		size_t evmap_size;
+	} reload;
 	bool repeat_filter;                 /* The input device's repeat filter flag. */
 	uint32_t lock_state;                /* The input device's current lock key state. */
 	uint32_t modifier_state;            /* The input device's current modifier key state. */
@@ -162,6 +173,11 @@ struct input_device {
 		bool scrolllock;
 	} led;
 	char *remote;                       /* The remote control name used in lircd socket output. */
+	struct lircd_device *lircd;         /* The lircd message templates for the input device's keys. */
+	struct {                            /* The input device's synthetic key releases (eventlircd_release_timeout). */
+		struct timeval timeout;     /* The time without key events after which held keys are released (0 for never). */
+		struct timeval deadline;    /* The time at which the held keys are released (0 when no key is held). */
+	} release;
 	struct {                            /* The input device's mouse/joystick event output device. */
 		int fd;                     /* The output device's file descriptor. */
 		struct uinput_user_dev dev; /* The output device. */
@@ -187,9 +203,17 @@ struct {
 		struct udev_monitor *monitor;
 	} udev;
 	struct input_device *device_list;   /* The linked list of udev detected input devices. */
+	struct {                            /* The settings given to input_reload(). */
+		char *evmap_dir;
+		bool repeat_filter;
+	} reload;
 } eventlircd_input = {
 	.evmap_dir = NULL,
 	.repeat_filter = false,
+	.reload = {
+		.evmap_dir = NULL,
+		.repeat_filter = false
+	},
 	.udev = {
 		.fd = -1,
 		.monitor = NULL
@@ -325,6 +349,13 @@ static int input_device_evmap_exit(struct input_device *device)
 		return -1;
 	}
 
+	free(device->evmap_file);
+	device->evmap_file = NULL;
+
+	free(device->reload.evmap);
+	device->reload.evmap = NULL;
+	device->reload.evmap_size = 0;
+
 	device->evmap_size = 0;
 
 	if (device->evmap == NULL) {
@@ -337,7 +368,7 @@ static int input_device_evmap_exit(struct input_device *device)
 	return 0;
 }
 
-static int input_device_evmap_init(struct input_device *device, const char *evmap_dir, const char *evmap_file)
+static int input_evmap_read(struct input_device_evmap **evmap, size_t *evmap_size, const char *evmap_dir, const char *evmap_file)
 {
 	char evmap_path[PATH_MAX + 1];
 	FILE *fp;
@@ -353,13 +384,13 @@ static int input_device_evmap_init(struct input_device *device, const char *evma
 	bool evmap_valid;
 	size_t i;
 
-	if (device == NULL) {
+	if ((evmap == NULL) || (evmap_size == NULL)) {
 		errno = EINVAL;
 		return -1;
 	}
 
-	device->evmap = NULL;
-	device->evmap_size = 0;
+	*evmap = NULL;
+	*evmap_size = 0;
 
 	if (evmap_dir == NULL) {
 		errno = EINVAL;
@@ -424,23 +455,28 @@ static int input_device_evmap_init(struct input_device *device, const char *evma
 		return -1;
 	}
 
+	line = NULL;
 	line_len = 0;
 
 	evmap_index = 0;
 	for (evmap_index = 0 ; getline(&line, &line_len, fp) >= 0 ; evmap_index++);
-	device->evmap_size = evmap_index;
-	if (device->evmap_size == 0) {
+	*evmap_size = evmap_index;
+	if (*evmap_size == 0) {
+		free(line);
+		fclose(fp);
 		return 0;
 	}
 	/*
 	 * Allocate memory for the event map table.
 	 */
-	if ((device->evmap = (struct input_device_evmap *)malloc(device->evmap_size * sizeof(struct input_device_evmap))) == NULL) {
+	if ((*evmap = (struct input_device_evmap *)malloc(*evmap_size * sizeof(struct input_device_evmap))) == NULL) {
 		syslog(LOG_ERR,
 		       "failed to allocate memory for the input device map %s: %s\n",
 		       evmap_path,
 		       strerror(errno));
-		device->evmap_size = 0;
+		*evmap_size = 0;
+		free(line);
+		fclose(fp);
 		return -1;
 	}
 
@@ -448,9 +484,9 @@ static int input_device_evmap_init(struct input_device *device, const char *evma
 
 	line_number = 0;
 	evmap_index = 0;
-	while ((evmap_index < device->evmap_size) && (getline(&line, &line_len, fp) >= 0)) {
-		device->evmap[evmap_index].code_in  = 0;
-		device->evmap[evmap_index].code_out = 0;
+	while ((evmap_index < *evmap_size) && (getline(&line, &line_len, fp) >= 0)) {
+		(*evmap)[evmap_index].code_in  = 0;
+		(*evmap)[evmap_index].code_out = 0;
 
 		line_number++;
 
@@ -511,7 +547,7 @@ static int input_device_evmap_init(struct input_device *device, const char *evma
 		evmap_valid = true;
 		while (name_in_part) {
 			if (strcmp(name_in_part, "capslock") == 0) {
-				if (device->evmap[evmap_index].code_in & EVENTLIRCD_EVMAP_CODE_MASK) {
+				if ((*evmap)[evmap_index].code_in & EVENTLIRCD_EVMAP_CODE_MASK) {
 					syslog(LOG_WARNING,
 					       "%s:%u:<name-in>: the '%s' lock key token appeared after the base key name\n",
 					       evmap_path,
@@ -520,7 +556,7 @@ static int input_device_evmap_init(struct input_device *device, const char *evma
 					evmap_valid = false;
 					break;
 				}
-				if (device->evmap[evmap_index].code_in & EVENTLIRCD_EVMAP_LOCK_CAPS) {
+				if ((*evmap)[evmap_index].code_in & EVENTLIRCD_EVMAP_LOCK_CAPS) {
 					syslog(LOG_WARNING,
 					       "%s:%u:<name-in>: the '%s' lock key token appeared more than once\n",
 					       evmap_path,
@@ -529,9 +565,9 @@ static int input_device_evmap_init(struct input_device *device, const char *evma
 					evmap_valid = false;
 					break;
 				}
-				device->evmap[evmap_index].code_in |= EVENTLIRCD_EVMAP_LOCK_CAPS;
+				(*evmap)[evmap_index].code_in |= EVENTLIRCD_EVMAP_LOCK_CAPS;
 			} else if (strcmp(name_in_part, "numlock") == 0) {
-				if (device->evmap[evmap_index].code_in & EVENTLIRCD_EVMAP_CODE_MASK)
+				if ((*evmap)[evmap_index].code_in & EVENTLIRCD_EVMAP_CODE_MASK)
 				{
 					syslog(LOG_WARNING,
 					       "%s:%u:<name-in>: the '%s' lock key token appeared after the base key name\n",
@@ -541,7 +577,7 @@ static int input_device_evmap_init(struct input_device *device, const char *evma
 					evmap_valid = false;
 					break;
 				}
-				if (device->evmap[evmap_index].code_in & EVENTLIRCD_EVMAP_LOCK_NUM)
+				if ((*evmap)[evmap_index].code_in & EVENTLIRCD_EVMAP_LOCK_NUM)
 				{
 					syslog(LOG_WARNING,
 					       "%s:%u:<name-in>: the '%s' lock key token appeared more than once\n",
@@ -551,9 +587,9 @@ static int input_device_evmap_init(struct input_device *device, const char *evma
 					evmap_valid = false;
 					break;
 				}
-				device->evmap[evmap_index].code_in |= EVENTLIRCD_EVMAP_LOCK_NUM;
+				(*evmap)[evmap_index].code_in |= EVENTLIRCD_EVMAP_LOCK_NUM;
 			} else if (strcmp(name_in_part, "scrolllock") == 0) {
-				if (device->evmap[evmap_index].code_in & EVENTLIRCD_EVMAP_CODE_MASK) {
+				if ((*evmap)[evmap_index].code_in & EVENTLIRCD_EVMAP_CODE_MASK) {
 					syslog(LOG_WARNING,
 					       "%s:%u:<name-in>: the '%s' lock key token appeared after the base key name\n",
 					       evmap_path,
@@ -562,7 +598,7 @@ static int input_device_evmap_init(struct input_device *device, const char *evma
 					evmap_valid = false;
 					break;
 				}
-				if (device->evmap[evmap_index].code_in & EVENTLIRCD_EVMAP_LOCK_SCROLL) {
+				if ((*evmap)[evmap_index].code_in & EVENTLIRCD_EVMAP_LOCK_SCROLL) {
 					syslog(LOG_WARNING,
 					       "%s:%u:<name-in>: the '%s' lock key token appeared more than once\n",
 					       evmap_path,
@@ -571,9 +607,9 @@ static int input_device_evmap_init(struct input_device *device, const char *evma
 					evmap_valid = false;
 					break;
 				}
-				device->evmap[evmap_index].code_in |= EVENTLIRCD_EVMAP_LOCK_SCROLL;
+				(*evmap)[evmap_index].code_in |= EVENTLIRCD_EVMAP_LOCK_SCROLL;
 			} else if (strcmp(name_in_part, "ctrl") == 0) {
-				if (device->evmap[evmap_index].code_in & EVENTLIRCD_EVMAP_CODE_MASK) {
+				if ((*evmap)[evmap_index].code_in & EVENTLIRCD_EVMAP_CODE_MASK) {
 					syslog(LOG_WARNING,
 					       "%s:%u:<name-in>: the '%s' modifier key token appeared after the base key name\n",
 					       evmap_path,
@@ -582,7 +618,7 @@ static int input_device_evmap_init(struct input_device *device, const char *evma
 					evmap_valid = false;
 					break;
 				}
-				if (device->evmap[evmap_index].code_in & EVENTLIRCD_EVMAP_MOD_CTRL) {
+				if ((*evmap)[evmap_index].code_in & EVENTLIRCD_EVMAP_MOD_CTRL) {
 					syslog(LOG_WARNING,
 					       "%s:%u:<name-in>: the '%s' modifier key token appeared more than once\n",
 					       evmap_path,
@@ -591,9 +627,9 @@ static int input_device_evmap_init(struct input_device *device, const char *evma
 					evmap_valid = false;
 					break;
 				}
-				device->evmap[evmap_index].code_in |= EVENTLIRCD_EVMAP_MOD_CTRL;
+				(*evmap)[evmap_index].code_in |= EVENTLIRCD_EVMAP_MOD_CTRL;
 			} else if (strcmp(name_in_part, "shift") == 0) {
-				if (device->evmap[evmap_index].code_in & EVENTLIRCD_EVMAP_CODE_MASK) {
+				if ((*evmap)[evmap_index].code_in & EVENTLIRCD_EVMAP_CODE_MASK) {
 					syslog(LOG_WARNING,
 					       "%s:%u:<name-in>: the '%s' modifier key token appeared after the base key name\n",
 					       evmap_path,
@@ -602,7 +638,7 @@ static int input_device_evmap_init(struct input_device *device, const char *evma
 					evmap_valid = false;
 					break;
 				}
-				if (device->evmap[evmap_index].code_in & EVENTLIRCD_EVMAP_MOD_SHIFT) {
+				if ((*evmap)[evmap_index].code_in & EVENTLIRCD_EVMAP_MOD_SHIFT) {
 					syslog(LOG_WARNING,
 					       "%s:%u:<name-in>: the '%s' modifier key token appeared more than once\n",
 					       evmap_path,
@@ -611,9 +647,9 @@ static int input_device_evmap_init(struct input_device *device, const char *evma
 					evmap_valid = false;
 					break;
 				}
-				device->evmap[evmap_index].code_in |= EVENTLIRCD_EVMAP_MOD_SHIFT;
+				(*evmap)[evmap_index].code_in |= EVENTLIRCD_EVMAP_MOD_SHIFT;
 			} else if (strcmp(name_in_part, "alt") == 0) {
-				if (device->evmap[evmap_index].code_in & EVENTLIRCD_EVMAP_CODE_MASK) {
+				if ((*evmap)[evmap_index].code_in & EVENTLIRCD_EVMAP_CODE_MASK) {
 					syslog(LOG_WARNING,
 					       "%s:%u:<name-in>: the '%s' modifier key token appeared after the base key name\n",
 					       evmap_path,
@@ -622,7 +658,7 @@ static int input_device_evmap_init(struct input_device *device, const char *evma
 					evmap_valid = false;
 					break;
 				}
-				if (device->evmap[evmap_index].code_in & EVENTLIRCD_EVMAP_MOD_ALT) {
+				if ((*evmap)[evmap_index].code_in & EVENTLIRCD_EVMAP_MOD_ALT) {
 					syslog(LOG_WARNING,
 					       "%s:%u:<name-in>: the '%s' modifier key token appeared more than once\n",
 					       evmap_path,
@@ -631,9 +667,9 @@ static int input_device_evmap_init(struct input_device *device, const char *evma
 					evmap_valid = false;
 					break;
 				}
-				device->evmap[evmap_index].code_in |= EVENTLIRCD_EVMAP_MOD_ALT;
+				(*evmap)[evmap_index].code_in |= EVENTLIRCD_EVMAP_MOD_ALT;
 			} else if (strcmp(name_in_part, "meta") == 0) {
-				if (device->evmap[evmap_index].code_in & EVENTLIRCD_EVMAP_CODE_MASK) {
+				if ((*evmap)[evmap_index].code_in & EVENTLIRCD_EVMAP_CODE_MASK) {
 					syslog(LOG_WARNING,
 					       "%s:%u:<name-in>: the '%s' modifier key token appeared after the base key name\n",
 					       evmap_path,
@@ -642,7 +678,7 @@ static int input_device_evmap_init(struct input_device *device, const char *evma
 					evmap_valid = false;
 					break;
 				}
-				if (device->evmap[evmap_index].code_in & EVENTLIRCD_EVMAP_MOD_META) {
+				if ((*evmap)[evmap_index].code_in & EVENTLIRCD_EVMAP_MOD_META) {
 					syslog(LOG_WARNING,
 					       "%s:%u:<name-in>: the '%s' modifier key token appeared more than once\n",
 					       evmap_path,
@@ -651,9 +687,9 @@ static int input_device_evmap_init(struct input_device *device, const char *evma
 					evmap_valid = false;
 					break;
 				}
-				device->evmap[evmap_index].code_in |= EVENTLIRCD_EVMAP_MOD_META;
+				(*evmap)[evmap_index].code_in |= EVENTLIRCD_EVMAP_MOD_META;
 			} else {
-				if (device->evmap[evmap_index].code_in & EVENTLIRCD_EVMAP_CODE_MASK) {
+				if ((*evmap)[evmap_index].code_in & EVENTLIRCD_EVMAP_CODE_MASK) {
 					evmap_valid = false;
 					break;
 				}
@@ -692,7 +728,7 @@ static int input_device_evmap_init(struct input_device *device, const char *evma
 				}
 				if ((strncmp(name_in_part, "KEY_", strlen("KEY_")) != 0) &&
 				    (strncmp(name_in_part, "BTN_", strlen("BTN_")) != 0)) {
-					if (device->evmap[evmap_index].code_in & EVENTLIRCD_EVMAP_LOCK_MASK) {
+					if ((*evmap)[evmap_index].code_in & EVENTLIRCD_EVMAP_LOCK_MASK) {
 						syslog(LOG_WARNING,
 						       "%s:%u:<name-in>: '%s' lock key applied to non-key event.\n",
 						       evmap_path,
@@ -700,7 +736,7 @@ static int input_device_evmap_init(struct input_device *device, const char *evma
 						       name_in_part);
 						evmap_valid = false;
 					}
-					if (device->evmap[evmap_index].code_in & EVENTLIRCD_EVMAP_MOD_MASK) {
+					if ((*evmap)[evmap_index].code_in & EVENTLIRCD_EVMAP_MOD_MASK) {
 						syslog(LOG_WARNING,
 						       "%s:%u:<name-in>: '%s' modifier key applied to non-key event.\n",
 						       evmap_path,
@@ -717,15 +753,15 @@ static int input_device_evmap_init(struct input_device *device, const char *evma
 						evmap_valid = false;
 					}
 				}
-				device->evmap[evmap_index].code_in |= ((uint32_t)(event_name_to_code[i].type)) << EVENTLIRCD_EVMAP_TYPE_OFFSET;
-				device->evmap[evmap_index].code_in |= ((uint32_t)(event_name_to_code[i].code)) << EVENTLIRCD_EVMAP_CODE_OFFSET;
+				(*evmap)[evmap_index].code_in |= ((uint32_t)(event_name_to_code[i].type)) << EVENTLIRCD_EVMAP_TYPE_OFFSET;
+				(*evmap)[evmap_index].code_in |= ((uint32_t)(event_name_to_code[i].code)) << EVENTLIRCD_EVMAP_CODE_OFFSET;
 			}
 			name_in_part = strtok_r(NULL, "+", &name_in_part_state);
 		}
 		if (evmap_valid == false) {
 			continue;
 		}
-		if ((device->evmap[evmap_index].code_in & EVENTLIRCD_EVMAP_CODE_MASK) == 0) {
+		if (((*evmap)[evmap_index].code_in & EVENTLIRCD_EVMAP_CODE_MASK) == 0) {
 			syslog(LOG_WARNING,
 			       "%s:%u:<name-in>: no key in keyboard shortcut.\n",
 			       evmap_path,
@@ -734,7 +770,7 @@ static int input_device_evmap_init(struct input_device *device, const char *evma
 			continue;
 		}
 		for (i = 0 ; i < evmap_index ; i++) {
-			if (device->evmap[evmap_index].code_in == device->evmap[i].code_in) {
+			if ((*evmap)[evmap_index].code_in == (*evmap)[i].code_in) {
 				syslog(LOG_WARNING,
 				       "%s:%u:<name-in>: duplicate keyboard shortcut.\n",
 				       evmap_path,
@@ -747,7 +783,7 @@ static int input_device_evmap_init(struct input_device *device, const char *evma
 			continue;
 		}
 		if (strcmp(name_out, "NULL") == 0) {
-			device->evmap[evmap_index].code_out = EVENTLIRCD_EVMAP_NULL;
+			(*evmap)[evmap_index].code_out = EVENTLIRCD_EVMAP_NULL;
 		}
 		else {
 			if ((strncmp(name_out, "KEY_", strlen("KEY_")) != 0) &&
@@ -770,21 +806,21 @@ static int input_device_evmap_init(struct input_device *device, const char *evma
 				evmap_valid = false;
 				continue;
 			}
-			device->evmap[evmap_index].code_out = event_name_to_code[i].code;
+			(*evmap)[evmap_index].code_out = event_name_to_code[i].code;
 		}
 		evmap_index++;
 	}
-	device->evmap_size = evmap_index;
+	*evmap_size = evmap_index;
 
 	syslog(LOG_DEBUG,
 	       "%s: using %u valid keyboard shortcut mappings\n",
 	       evmap_path,
-	       (unsigned int)device->evmap_size);
+	       (unsigned int)*evmap_size);
 
 	/*
 	 * Sort the event map so that later look-ups can be done with a binary search.
 	 */
-	qsort(device->evmap, device->evmap_size, sizeof(struct input_device_evmap), input_device_evmap_compare);
+	qsort(*evmap, *evmap_size, sizeof(struct input_device_evmap), input_device_evmap_compare);
 
 	free(line);
 	fclose(fp);
@@ -792,6 +828,38 @@ static int input_device_evmap_init(struct input_device *device, const char *evma
 	return 0;
 }
 
+/*
+ * Read the input device's event map file, and remember its name so that the
+ * event map can be read again when the configuration is reloaded.
+ */
+static int input_device_evmap_init(struct input_device *device, const char *evmap_dir, const char *evmap_file)
+{
+	if (device == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	device->evmap_file = NULL;
+	device->reload.evmap = NULL;
+	device->reload.evmap_size = 0;
+
+	if ((evmap_file != NULL) && ((device->evmap_file = strndup(evmap_file, PATH_MAX + 1)) == NULL)) {
+		syslog(LOG_ERR,
+		       "failed to allocate memory for the input device event map file name %s: %s\n",
+		       evmap_file,
+		       strerror(errno));
+		return -1;
+	}
+
+	if (input_evmap_read(&(device->evmap), &(device->evmap_size), evmap_dir, evmap_file) != 0) {
+		free(device->evmap_file);
+		device->evmap_file = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
 static int input_device_evmap_run(struct input_device *device)
 {
 	struct input_device_evmap search;
@@ -1163,33 +1231,32 @@ static bool input_device_event_is_key(struct input_device *device)
 	return true;
 }
 
-static int input_device_handler(void *id, int UNUSED(ready), struct timeval* UNUSED(now))
+static int input_device_event_handle(struct input_device *device, const struct input_event *event)
 {
-	struct input_device *device;
-	struct input_event event;
+	input_device_event_update(device, event);
 
-	if (id == NULL) {
-		errno = EINVAL;
-		return -1;
-	}
-
-	device = (struct input_device *)id;
-
-	if (read(device->fd, &event, sizeof(event)) != sizeof(event)) {
-		return 0;
+	/*
+	 * The end of an input event frame, so send the lircd messages produced
+	 * by the frame.
+	 */
+	if ((event->type == EV_SYN) && (event->code == SYN_REPORT)) {
+		if (lircd_flush() != 0) {
+			return -1;
+		}
 	}
 
-	input_device_event_update(device, &event);
 	if (device->current.event_out.type == EVENTLIRCD_EV_NULL) {
 		return 0;
 	}
 
+	lircd_event(device->lircd, &device->current.event_in, &device->current.event_out, device->current.repeat_count);
+
 	/* 
 	 * Send keys to lircd and send all other events to the output device
 	 * (assuming it exists).
 	 */
 	if (input_device_event_is_key(device) == true) {
-		if (lircd_send(&device->current.event_out, evkey_code_to_name[device->current.event_out.code], device->current.repeat_count, device->remote) != 0)
+		if (lircd_send(device->lircd, &device->current.event_in, &device->current.event_out, evkey_code_to_name[device->current.event_out.code], device->current.repeat_count) != 0)
 		{
 			return -1;
 		}
@@ -1203,6 +1270,123 @@ static int input_device_handler(void *id, int UNUSED(ready), struct timeval* UNU
 	return 0;
 }
 
+/*
+ * Release the held keys of a device with a release timeout, which is set for
+ * devices that do not send reliable key releases, once no key press or key
+ * repeat has arrived for the timeout. The key releases, followed by a
+ * synchronization report, go through the same path as the device's own
+ * events. 'key' is true when key presses or key repeats have just arrived.
+ */
+static int input_device_release_check(struct input_device *device, bool key, struct timeval *now)
+{
+	struct input_event event;
+	struct timeval remaining;
+	struct timespec time;
+	int return_code;
+
+	if (device->previous_list == NULL) {
+		timerclear(&(device->release.deadline));
+		return 0;
+	}
+
+	if ((key == true) || !timerisset(&(device->release.deadline))) {
+		timeradd(now, &(device->release.timeout), &(device->release.deadline));
+	}
+
+	if (timercmp(now, &(device->release.deadline), <)) {
+		timersub(&(device->release.deadline), now, &remaining);
+		monitor_timeout(device->fd, &remaining);
+		return 0;
+	}
+
+	return_code = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	memset(&event, 0, sizeof(event));
+	event.input_event_sec = time.tv_sec;
+	event.input_event_usec = time.tv_nsec / 1000;
+
+	while (device->previous_list != NULL) {
+		event.type = EV_KEY;
+		event.code = device->previous_list->event_in.code;
+		event.value = 0;
+		syslog(LOG_DEBUG,
+		       "input device %s: key %u release timeout\n",
+		       device->path,
+		       event.code);
+		if (input_device_event_handle(device, &event) != 0) {
+			return_code = -1;
+		}
+		/*
+		 * Make sure that the key is released even when the release
+		 * did not map to it.
+		 */
+		input_device_previous_pop(device);
+	}
+	event.type = EV_SYN;
+	event.code = SYN_REPORT;
+	event.value = 0;
+	if (input_device_event_handle(device, &event) != 0) {
+		return_code = -1;
+	}
+
+	timerclear(&(device->release.deadline));
+
+	return return_code;
+}
+
+static int input_device_handler(void *id, int ready, struct timeval* now)
+{
+	struct input_device *device;
+	struct input_event event[INPUT_DEVICE_EVENT_MAX];
+	ssize_t n;
+	size_t i;
+	bool key;
+	int return_code;
+
+	if (id == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	device = (struct input_device *)id;
+
+	return_code = 0;
+	key = false;
+
+	/*
+	 * Read all of the events that are waiting with one read(). The handler
+	 * is also called without input when the device's release timer runs out.
+	 */
+	if ((ready & MONITOR_READ) != 0) {
+		n = read(device->fd, event, sizeof(event));
+		for (i = 0 ; (n > 0) && (i < (size_t)n / sizeof(event[0])) ; i++) {
+			if (input_device_event_handle(device, &event[i]) != 0) {
+				return_code = -1;
+			}
+			if ((event[i].type == EV_KEY) && (event[i].value != 0)) {
+				key = true;
+			}
+		}
+	}
+
+	if (timerisset(&(device->release.timeout))) {
+		if (input_device_release_check(device, key, now) != 0) {
+			return_code = -1;
+		}
+	}
+
+	/*
+	 * Send any lircd messages from an input event frame that has not ended
+	 * yet rather than holding them until the rest of the frame arrives.
+	 */
+	if (lircd_flush() != 0) {
+		return_code = -1;
+	}
+
+	return return_code;
+}
+
 static int input_device_close(struct input_device *device)
 {
 	int return_code;
@@ -1229,6 +1413,8 @@ static int input_device_close(struct input_device *device)
 	if (device->remote == NULL) {
 		free(device->remote);
 	}
+	lircd_device_free(device->lircd);
+	device->lircd = NULL;
 	input_device_evmap_exit(device);
 	if (device->fd != -1) {
 		close(device->fd);
@@ -1318,6 +1504,8 @@ static int input_device_add(struct udev_device *udev_device)
 	const char* enable;
 	const char* evmap_file;
 	const char* remote;
+	const char* release_timeout;
+	const char* output;
 	struct input_device *device;
 	unsigned long bit[BITFIELD_LONGS_PER_ARRAY(EV_MAX)];
 	unsigned long bit_key[BITFIELD_LONGS_PER_ARRAY(KEY_MAX)];
@@ -1333,6 +1521,9 @@ static int input_device_add(struct udev_device *udev_device)
 	__u16 j;
 	size_t z;
 	bool output_active;
+	int clock_id;
+	unsigned long timeout;
+	char *end;
 	__u16 type;
 	__u16 code;
 	uint32_t code_in;
@@ -1371,6 +1562,10 @@ static int input_device_add(struct udev_device *udev_device)
 		remote = "devinput";
 	}
 
+	release_timeout = udev_device_get_property_value(udev_device, "eventlircd_release_timeout");
+
+	output = udev_device_get_property_value(udev_device, "eventlircd_output");
+
 	if ((device = calloc(1, sizeof(struct input_device))) == NULL) {
 		syslog(LOG_ERR,
 		       "input device %s: memory allocation failed: %s\n",
@@ -1383,6 +1578,7 @@ static int input_device_add(struct udev_device *udev_device)
 	device->fd = -1;
 	device->evmap = NULL;
 	device->remote = NULL;
+	device->lircd = NULL;
 	device->output.fd = -1;
 
 	if ((device->path = strndup(path, PATH_MAX)) == NULL) {
@@ -1412,6 +1608,20 @@ static int input_device_add(struct udev_device *udev_device)
 		free(device);
 		return -1;
 	}
+	/*
+	 * Now that the device is grabbed, and so delivers its events only to
+	 * eventlircd, have the kernel time stamp them with the monotonic clock.
+	 * lircd uses that clock for the dispatch time of time stamped messages,
+	 * and it does not jump when the wall clock is set. The clock belongs to
+	 * this open file, so other readers of the device are not affected.
+	 */
+	clock_id = CLOCK_MONOTONIC;
+	if (ioctl(device->fd, EVIOCSCLOCKID, &clock_id) < 0) {
+		syslog(LOG_WARNING,
+		       "input device %s: failed to set the event clock: %s\n",
+		       device->path,
+		       strerror(errno));
+	}
 
 	if (input_device_evmap_init(device, eventlircd_input.evmap_dir, evmap_file) != 0) {
 		close(device->fd);
@@ -1421,6 +1631,23 @@ static int input_device_add(struct udev_device *udev_device)
 	}
 
         device->repeat_filter = eventlircd_input.repeat_filter;
+
+	/*
+	 * The release timeout is in milliseconds.
+	 */
+	if (release_timeout != NULL) {
+		errno = 0;
+		timeout = strtoul(release_timeout, &end, 10);
+		if ((errno != 0) || (end == release_timeout) || (*end != '\0')) {
+			syslog(LOG_WARNING,
+			       "input device %s: invalid eventlircd_release_timeout '%s'\n",
+			       device->path,
+			       release_timeout);
+		} else {
+			device->release.timeout.tv_sec = (time_t)(timeout / 1000);
+			device->release.timeout.tv_usec = (suseconds_t)((timeout % 1000) * 1000);
+		}
+	}
 	
 	if ((device->remote = strndup(remote, PATH_MAX)) == NULL) {
 		syslog(LOG_ERR,
@@ -1434,6 +1661,15 @@ static int input_device_add(struct udev_device *udev_device)
 		return -1;
 	}
 
+	if ((device->lircd = lircd_device_new(output, device->remote)) == NULL) {
+		free(device->remote);
+		input_device_evmap_exit(device);
+		close(device->fd);
+		free(device->path);
+		free(device);
+		return -1;
+	}
+
 	/*
 	 * Query the input device for event types and codes that it supports.
 	 */
@@ -1636,6 +1872,7 @@ static int input_device_add(struct udev_device *udev_device)
 		       "input device %s: unable to open event device: %s\n",
 		       device->path,
 		       strerror(errno));
+		lircd_device_free(device->lircd);
 		free(device->remote);
 		input_device_evmap_exit(device);
 		close(device->fd);
@@ -1666,6 +1903,7 @@ static int input_device_add(struct udev_device *udev_device)
 		       "input device %s: unable to set UI_SET_PHYS for output event device: %s\n",
 		       device->path,
 		       strerror(errno));
+		lircd_device_free(device->lircd);
 		free(device->remote);
 		close(device->output.fd);
 		input_device_evmap_exit(device);
@@ -1726,6 +1964,13 @@ static int input_device_add(struct udev_device *udev_device)
 						if (code == EVENTLIRCD_EVMAP_NULL) {
 							continue;
 						}
+						/*
+						 * The mapped key code is a key, so create its lircd
+						 * message template.
+						 */
+						if (evkey_type[code] == EVENTLIRCD_EVKEY_TYPE_KEY) {
+							lircd_device_add_code(device->lircd, code, evkey_code_to_name[code]);
+						}
 						/*
 						 * The mapped key code is a button, so mark it as
 						 * supported by the mouse/joystick device.
@@ -1904,6 +2149,12 @@ static int input_device_add(struct udev_device *udev_device)
 			if (BITFIELD_TEST(code_in & EVENTLIRCD_EVMAP_CODE_MASK, bit_key) == 0) {
 				continue;
 			}
+			/*
+			 * The output is a key so create its lircd message template.
+			 */
+			if (evkey_type[code_out] == EVENTLIRCD_EVKEY_TYPE_KEY) {
+				lircd_device_add_code(device->lircd, code_out, evkey_code_to_name[code_out]);
+			}
 			/*
 			 * The output is a button so add it to mouse/joystick device.
 			 */
@@ -1935,6 +2186,7 @@ static int input_device_add(struct udev_device *udev_device)
 			       device->path,
 			       strerror(errno));
 			close(device->output.fd);
+			lircd_device_free(device->lircd);
 			free(device->remote);
 			input_device_evmap_exit(device);
 			close(device->fd);
@@ -1948,6 +2200,7 @@ static int input_device_add(struct udev_device *udev_device)
 			       device->path,
 			       strerror(errno));
 			close(device->output.fd);
+			lircd_device_free(device->lircd);
 			free(device->remote);
 			input_device_evmap_exit(device);
 			close(device->fd);
@@ -1965,6 +2218,7 @@ static int input_device_add(struct udev_device *udev_device)
 	 */
 	if (monitor_client_add(device->fd, &input_device_handler, device) != 0) {
 		close(device->output.fd);
+		lircd_device_free(device->lircd);
 		free(device->remote);
 		input_device_evmap_exit(device);
 		close(device->fd);
@@ -2198,3 +2452,73 @@ int input_init(const char *evmap_dir, const bool repeat_filter)
 
 	return 0;
 }
+
+/*
+ * Read the event map file of every input device from the new event map
+ * directory, without using the new event maps yet. The devices stay open and
+ * grabbed. The new event maps replace the old ones when input_reload_finish()
+ * commits the reload. Buttons, relative axes and absolute axes that a new
+ * event map adds to a device's mouse/joystick output device are only added
+ * when the device is added again.
+ */
+int input_reload(const char *evmap_dir, const bool repeat_filter)
+{
+	struct input_device *device;
+
+	if (evmap_dir == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((eventlircd_input.reload.evmap_dir = strndup(evmap_dir, PATH_MAX + 1)) == NULL) {
+		syslog(LOG_ERR,
+		       "failed to allocate memory for the input device event map directory name %s: %s\n",
+		       evmap_dir,
+		       strerror(errno));
+		return -1;
+	}
+	eventlircd_input.reload.repeat_filter = repeat_filter;
+
+	for (device = eventlircd_input.device_list ; device != NULL ; device = device->next) {
+		if (input_evmap_read(&(device->reload.evmap), &(device->reload.evmap_size), evmap_dir, device->evmap_file) != 0) {
+			syslog(LOG_ERR,
+			       "input device %s: failed to read the event map\n",
+			       device->path);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Switch every input device to the event map read by input_reload() when
+ * 'commit' is true, or drop the new event maps when it is false. Keys that
+ * are held keep the output key that they were pressed with.
+ */
+void input_reload_finish(bool commit)
+{
+	struct input_device *device;
+
+	for (device = eventlircd_input.device_list ; device != NULL ; device = device->next) {
+		if (commit == true) {
+			free(device->evmap);
+			device->evmap = device->reload.evmap;
+			device->evmap_size = device->reload.evmap_size;
+			device->repeat_filter = eventlircd_input.reload.repeat_filter;
+		} else {
+			free(device->reload.evmap);
+		}
+		device->reload.evmap = NULL;
+		device->reload.evmap_size = 0;
+	}
+
+	if (commit == true) {
+		free(eventlircd_input.evmap_dir);
+		eventlircd_input.evmap_dir = eventlircd_input.reload.evmap_dir;
+		eventlircd_input.repeat_filter = eventlircd_input.reload.repeat_filter;
+	} else {
+		free(eventlircd_input.reload.evmap_dir);
+	}
+	eventlircd_input.reload.evmap_dir = NULL;
+}
@@ -21,5 +21,7 @@
 
 int input_init(const char* evmap_dir, const bool repeat_filter);
 int input_exit();
+int input_reload(const char *evmap_dir, const bool repeat_filter);
+void input_reload_finish(bool commit);
 
 #endif
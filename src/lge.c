@@ -1,4 +1,3 @@
-
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -8,12 +7,19 @@
 #include <termios.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <sys/timerfd.h>  /* Linux */
 #include <sys/un.h>       /* XSI */
 #include <syslog.h>       /* XSI */
 
 #include "monitor.h"
 #include "lge.h"
 
+/*
+ * lge_proto_default, the LG tv protocol used when no protocol description
+ * file is given. It is generated from etc/lge.protocol.
+ */
+#include "lge_protocol.h"
+
 #ifdef UNUSED
 # error cannot define UNUSED because it is already defined
 #endif
@@ -23,119 +29,647 @@
 # define UNUSED(x) x
 #endif
 
-#define LGE_RX_START_TIMEOUT	6000000
-#define LGE_RX_TIMEOUT		1000000
 #define LGE_QUEUE_SIZE		128
+#define LGE_RETRY_MAX		2
+#define LGE_NUM_CMDS		256
+#define LGE_NAME_MAX		8
+#define LGE_TEMPLATE_MAX	32
+
+/*
+ * Reply timeouts are derived from the measured reply times of each command:
+ * twice the 99th percentile, once there are enough replies, between the
+ * minimum and the timeout of the protocol description. Until a command has
+ * enough replies of its own, the replies to all commands of the port are
+ * used, so that a freshly started daemon adapts after a few replies.
+ */
+#define LGE_HIST_BUCKETS	16	/* Bucket i counts reply times below 2^i ms. */
+#define LGE_HIST_MIN		16	/* The replies needed before a command uses its own. */
+#define LGE_HIST_PORT_MIN	4	/* The replies to the port needed before adapting. */
+#define LGE_TIMEOUT_MIN		100000
 
-static int devfd = -1;
+/*
+ * The serial port is opened in the background: every 100 ms for the number of
+ * times given to lge_init(), then every second until it appears.
+ */
+#define LGE_OPEN_INTERVAL	100000
+#define LGE_OPEN_INTERVAL_SLOW	1000000
 
-static int lge_rx_state;
-static int lge_cmd_ok;
-static struct timeval lge_timeout;
-static unsigned int lge_cmd, lge_pause, lge_rx_value, lge_tx_value;
-static unsigned int lge_queue_in, lge_queue_out;
-static unsigned int lge_queue[LGE_QUEUE_SIZE];
+/*
+ * The tokens of the telegram and reply templates of a protocol description.
+ */
+#define LGE_TOKEN_CHAR		0	/* A literal character. */
+#define LGE_TOKEN_ANY		1	/* Any character (replies only). */
+#define LGE_TOKEN_NAME		2	/* The command name. */
+#define LGE_TOKEN_NAME1		3	/* The first character of the command name. */
+#define LGE_TOKEN_NAME2		4	/* The second character of the command name. */
+#define LGE_TOKEN_HEX		5	/* The value as two hex digits. */
+#define LGE_TOKEN_DEC		6	/* The value as three decimal digits. */
+#define LGE_TOKEN_STATUS	7	/* The ok or error string (replies only). */
+
+/*
+ * Command flags.
+ */
+#define LGE_FLAG_POWER		0x01	/* Read before set, goes ahead of queued commands. */
+#define LGE_FLAG_KEY		0x02	/* A remote key, not a setting. */
+#define LGE_FLAG_VOLUME		0x04	/* The setting changed by the volume keys. */
+#define LGE_FLAG_POLL		0x08	/* Read when idle (--lge-poll). */
+
+typedef struct {
+	unsigned char type;
+	char c;
+} lge_token_t;
 
 typedef struct {
-	char cmd1;
-	char cmd2;
-	unsigned int pause;
+	char name[LGE_NAME_MAX];	/* Empty for an undefined command. */
+	unsigned int flags;
+	unsigned int pause;		/* The time to wait after the command (us). */
+	unsigned int timeout;		/* The time to wait for the reply (us). */
+	unsigned int max;		/* The largest value of a relative command. */
 } lge_cmd_t;
 
-#define LGE_NUM_CMDS	30
-static lge_cmd_t lge_cmd_tab[LGE_NUM_CMDS] = {
-    { 0,0,0 },
-    { 'K', 'A', 7500000 },
-    { 'K', 'C', 0 },
-    { 'K', 'D', 0 },
-    { 'K', 'E', 0 },
-    { 'K', 'F', 0 },
-    { 'K', 'G', 0 },
-    { 'K', 'H', 0 },
-    { 'K', 'I', 0 },
-    { 'K', 'J', 0 },
-    { 'K', 'K', 0 },
-    { 'K', 'L', 0 },
-    { 'K', 'M', 0 },
-    { 'K', 'N', 0 },
-    { 'K', 'Q', 0 },
-    { 'K', 'T', 0 },
-    { 'K', 'U', 0 },
-    { 'K', 'V', 0 },
-    { 'K', 'W', 0 },
-    { 'K', '$', 0 },
-    { 'K', 'Z', 0 },
-    { 0,0,0 },
-    { 0,0,0 },
-    { 0,0,0 },
-    { 0,0,0 },
-    { 0,0,0 },
-    { 0,0,0 },
-    { 'M', 'C', 0 },
-    { 'X', 'B', 0 },
-    { 'X', 'Y', 0 }
-};
+/*
+ * A serial protocol, compiled from its description (see etc/lge.protocol).
+ * Commands are indexed by the high byte of their codes.
+ */
+typedef struct {
+	speed_t speed;
+	lge_token_t send[LGE_TEMPLATE_MAX];
+	unsigned int send_len;
+	lge_token_t reply[LGE_TEMPLATE_MAX];
+	unsigned int reply_len;
+	char ok[LGE_NAME_MAX];
+	char error[LGE_NAME_MAX];
+	unsigned int timeout;		/* The time to wait for a reply to start (us). */
+	unsigned int char_timeout;	/* The time to wait for the rest of a reply (us). */
+	unsigned int query;		/* The value that reads a setting. */
+	unsigned int max;		/* The default largest value of a relative command. */
+	unsigned int power, volume;	/* The power and volume commands, 0 for none. */
+	unsigned int volume_up, volume_down;	/* The volume key codes, 0 for none. */
+	lge_cmd_t cmd[LGE_NUM_CMDS];
+} lge_proto_t;
 
-int lge_exit(void) {
-	if (devfd != -1) {
-		if (monitor_client_remove(devfd) != 0)
+
+/*
+ * A queued command. The code is the command table index shifted left by 8
+ * bits or'ed with the value, and 0 stops eventlircd. A relative command
+ * changes a setting by delta and is sent as an absolute set. Volume up and
+ * down keys are queued as relative volume commands, so that the steps of a
+ * held key are merged and sent as one volume set.
+ */
+typedef struct {
+	unsigned int code;
+	int relative;
+	int delta;
+	unsigned int batch;	/* The lge_send() call that queued the command. */
+} lge_entry_t;
+
+/*
+ * The reply time histogram and counters of a command.
+ */
+typedef struct {
+	unsigned long count[LGE_HIST_BUCKETS];
+	unsigned long replies;
+	unsigned long timeouts;
+	unsigned long failures;
+} lge_hist_t;
+
+/*
+ * A serial port and the device on it, such as a tv, a projector or an AV
+ * receiver. Every port has its own protocol, queue, state and timers, so a
+ * slow device does not hold up the commands to the others.
+ */
+typedef struct lge_port {
+	char *name;
+	char *devname;
+	char *on, *off;			/* The codes sent at start-up and shutdown. */
+	int devfd;
+	int timerfd;			/* The timer that retries opening the serial port. */
+	int open_retry;			/* The fast open retries left. */
+
+	lge_proto_t proto;
+	lge_hist_t hist[LGE_NUM_CMDS];
+	lge_hist_t port_hist;		/* The replies to all commands but power commands. */
+	struct timeval tx_time;
+
+	int rx_state;			/* 1 + the reply token being matched, 0 when idle. */
+	unsigned int rx_pos;		/* The characters of the token matched so far. */
+	int rx_ok, rx_error;
+	int cmd_ok;
+	struct timeval timeout;
+	unsigned int cmd, pause, rx_value, tx_value;
+	lge_entry_t queue[LGE_QUEUE_SIZE];
+	unsigned int queue_len;
+	unsigned int batch;
+	lge_entry_t current;
+	unsigned int retries;
+	int query;			/* The setting of a relative command is being read. */
+	unsigned int poll;
+	struct timeval poll_time;
+
+	/*
+	 * The value of each setting as last reported by the device, or -1 when
+	 * it is not known. Every reply updates it, so a set command that would
+	 * not change the setting is skipped, and the settings that are polled
+	 * are kept up to date when the device is changed with its own remote.
+	 */
+	int state[LGE_NUM_CMDS];
+
+	struct lge_port *next;
+} lge_port_t;
+
+/* The ports in the order they were added, the first one is the default. */
+static lge_port_t *lge_port_list;
+
+/* The ports given to lge_reload(), in order, until the reload is finished. */
+static lge_port_t *lge_reload_list;
+
+/* The ports that have not yet reached the end of their off codes. */
+static unsigned int lge_stopping;
+
+/* Set once lge_send() has dropped a code sequence because no port exists. */
+static int lge_unused_logged;
+
+static void clear_lge_state(lge_port_t *port)
+{
+	unsigned int i;
+
+	for (i = 0; i < LGE_NUM_CMDS; ++i)
+		port->state[i] = -1;
+}
+
+static int lge_hex_digit(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'A' && c <= 'F')
+		return c + 10 - 'A';
+	return -1;
+}
+
+/*
+ * Compile a telegram or reply template. '%' introduces a token (%c, %1 and
+ * %2 for the command name or one of its characters, %x and %d for the value,
+ * %s for the status and %% for '%'), '.' matches any character of a reply
+ * and '\' escapes the next character (\r, \n, \t, \. and \\).
+ */
+static int parse_lge_template(const char *s, lge_token_t *token, unsigned int *len, int reply)
+{
+	unsigned int n = 0;
+
+	for (; *s != '\0'; ++s) {
+		if (n == LGE_TEMPLATE_MAX)
 			return -1;
+		token[n].type = LGE_TOKEN_CHAR;
+		token[n].c = *s;
+		if (*s == '%') {
+			switch (*++s) {
+			case 'c': token[n].type = LGE_TOKEN_NAME; break;
+			case '1': token[n].type = LGE_TOKEN_NAME1; break;
+			case '2': token[n].type = LGE_TOKEN_NAME2; break;
+			case 'x': token[n].type = LGE_TOKEN_HEX; break;
+			case 'd': token[n].type = LGE_TOKEN_DEC; break;
+			case 's':
+				if (!reply)
+					return -1;
+				token[n].type = LGE_TOKEN_STATUS;
+				break;
+			case '%': break;
+			default: return -1;
+			}
+		} else if (*s == '\\') {
+			switch (*++s) {
+			case 'r': token[n].c = '\r'; break;
+			case 'n': token[n].c = '\n'; break;
+			case 't': token[n].c = '\t'; break;
+			case '.':
+			case '\\': token[n].c = *s; break;
+			default: return -1;
+			}
+		} else if (*s == '.' && reply) {
+			token[n].type = LGE_TOKEN_ANY;
+		}
+		++n;
+	}
+	*len = n;
+	return (n > 0) ? 0 : -1;
+}
 
-		if (close(devfd) == -1) {
-			syslog(LOG_ERR, "closing serial port failed: %s\n", strerror(errno));
+/*
+ * Parse the words after the name of a command: the flags power, key, volume
+ * and poll, and pause=<ms>, timeout=<ms> and max=<hex>.
+ */
+static int parse_lge_command(lge_proto_t *proto, unsigned int i, char *words)
+{
+	lge_cmd_t *cmd = &proto->cmd[i];
+	char *word, *p;
+
+	word = strtok_r(words, " \t", &p);
+	if (word == NULL || strlen(word) >= LGE_NAME_MAX)
+		return -1;
+	strcpy(cmd->name, word);
+	cmd->max = proto->max;
+
+	while ((word = strtok_r(NULL, " \t", &p)) != NULL) {
+		if (strcmp(word, "power") == 0) {
+			cmd->flags |= LGE_FLAG_POWER;
+			proto->power = i;
+		} else if (strcmp(word, "key") == 0) {
+			cmd->flags |= LGE_FLAG_KEY;
+		} else if (strcmp(word, "volume") == 0) {
+			cmd->flags |= LGE_FLAG_VOLUME;
+			proto->volume = i;
+		} else if (strcmp(word, "poll") == 0) {
+			cmd->flags |= LGE_FLAG_POLL;
+		} else if (sscanf(word, "pause=%u", &cmd->pause) == 1) {
+			cmd->pause *= 1000;
+		} else if (sscanf(word, "timeout=%u", &cmd->timeout) == 1) {
+			cmd->timeout *= 1000;
+		} else if (sscanf(word, "max=%x", &cmd->max) != 1) {
 			return -1;
 		}
-		devfd = -1;
 	}
 	return 0;
 }
 
-static void set_lge_timeout(struct timeval *now, unsigned int pause) {
+static speed_t lge_speed(unsigned int baud)
+{
+	switch (baud) {
+	case 1200: return B1200;
+	case 2400: return B2400;
+	case 4800: return B4800;
+	case 9600: return B9600;
+	case 19200: return B19200;
+	case 38400: return B38400;
+	case 57600: return B57600;
+	case 115200: return B115200;
+	}
+	return B0;
+}
+
+/*
+ * Read a protocol description: lines of <key> = <value>, with '#' starting a
+ * comment. Command lines are command <hex index> = <name> [<flag> ...].
+ */
+static int read_lge_protocol(lge_proto_t *proto, FILE *fp, const char *path)
+{
+	char *line = NULL;
+	size_t line_len = 0;
+	unsigned int line_number = 0;
+	char key[32], *value, *end, *comment;
+	unsigned int baud, i = 0;
+	int n, rc = 0;
+
+	memset(proto, 0, sizeof(*proto));
+	proto->speed = B9600;
+	proto->query = 0x0FF;
+	proto->max = 0x0FE;
+	proto->timeout = 6000000;
+	proto->char_timeout = 1000000;
+
+	while (rc == 0 && getline(&line, &line_len, fp) >= 0) {
+		line_number++;
+
+		if ((comment = strchr(line, '#')) != NULL)
+			*comment = '\0';
+		if (sscanf(line, " %31[a-z0-9-] %n", key, &n) != 1)
+			continue;
+		value = line + n;
+		if (strcmp(key, "command") == 0) {
+			i = (unsigned int)strtoul(value, &end, 16);
+			if (end == value || i == 0 || i >= LGE_NUM_CMDS)
+				rc = -1;
+			value = end;
+		}
+		while (isspace((unsigned char)*value))
+			++value;
+		if (rc == 0 && *value != '=')
+			rc = -1;
+		if (rc != 0)
+			break;
+		for (++value; isspace((unsigned char)*value); ++value);
+		for (end = value + strlen(value); end > value && isspace((unsigned char)end[-1]); --end);
+		*end = '\0';
+
+		if (strcmp(key, "command") == 0)
+			rc = parse_lge_command(proto, i, value);
+		else if (strcmp(key, "speed") == 0)
+			rc = (sscanf(value, "%u", &baud) == 1 && (proto->speed = lge_speed(baud)) != B0) ? 0 : -1;
+		else if (strcmp(key, "send") == 0)
+			rc = parse_lge_template(value, proto->send, &proto->send_len, 0);
+		else if (strcmp(key, "reply") == 0)
+			rc = parse_lge_template(value, proto->reply, &proto->reply_len, 1);
+		else if (strcmp(key, "ok") == 0 && strlen(value) < LGE_NAME_MAX)
+			strcpy(proto->ok, value);
+		else if (strcmp(key, "error") == 0 && strlen(value) < LGE_NAME_MAX)
+			strcpy(proto->error, value);
+		else if (strcmp(key, "query") == 0)
+			rc = (sscanf(value, "%x", &proto->query) == 1) ? 0 : -1;
+		else if (strcmp(key, "max") == 0)
+			rc = (sscanf(value, "%x", &proto->max) == 1) ? 0 : -1;
+		else if (strcmp(key, "timeout") == 0 && sscanf(value, "%u", &proto->timeout) == 1)
+			proto->timeout *= 1000;
+		else if (strcmp(key, "char-timeout") == 0 && sscanf(value, "%u", &proto->char_timeout) == 1)
+			proto->char_timeout *= 1000;
+		else if (strcmp(key, "volume-up") == 0)
+			rc = (sscanf(value, "%x", &proto->volume_up) == 1) ? 0 : -1;
+		else if (strcmp(key, "volume-down") == 0)
+			rc = (sscanf(value, "%x", &proto->volume_down) == 1) ? 0 : -1;
+		else
+			rc = -1;
+	}
+	free(line);
+
+	if (rc != 0) {
+		syslog(LOG_ERR, "%s:%u: invalid protocol description line\n", path, line_number);
+		return -1;
+	}
+	if (proto->send_len == 0 || proto->reply_len == 0) {
+		syslog(LOG_ERR, "%s: the send and reply templates are required\n", path);
+		return -1;
+	}
+	if (proto->ok[0] == '\0' || proto->error[0] == '\0') {
+		syslog(LOG_ERR, "%s: the ok and error strings are required\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+static int lge_protocol_init(lge_proto_t *proto, const char *path)
+{
+	FILE *fp;
+	int rc;
+
+	if (path == NULL) {
+		path = "built-in lge protocol";
+		fp = fmemopen(lge_proto_default, sizeof(lge_proto_default) - 1, "r");
+	} else {
+		fp = fopen(path, "r");
+	}
+	if (fp == NULL) {
+		syslog(LOG_ERR, "failed to open protocol description %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	rc = read_lge_protocol(proto, fp, path);
+	fclose(fp);
+	return rc;
+}
+
+static void close_lge_port(lge_port_t *port) {
+	if (port->timerfd != -1) {
+		monitor_client_remove(port->timerfd);
+		close(port->timerfd);
+	}
+
+	if (port->devfd != -1) {
+		monitor_client_remove(port->devfd);
+		if (close(port->devfd) == -1)
+			syslog(LOG_ERR, "closing serial port %s failed: %s\n", port->devname, strerror(errno));
+	}
+
+	free(port->name);
+	free(port->devname);
+	free(port->on);
+	free(port->off);
+	free(port);
+}
+
+int lge_exit(void) {
+	lge_port_t *port;
+
+	while ((port = lge_port_list) != NULL) {
+		lge_port_list = port->next;
+		close_lge_port(port);
+	}
+	lge_stopping = 0;
+	return 0;
+}
+
+static lge_port_t *find_lge_port(const char *name) {
+	lge_port_t *port;
+
+	if (name == NULL)
+		return lge_port_list;
+	for (port = lge_port_list; port != NULL; port = port->next) {
+		if (strcmp(port->name, name) == 0)
+			return port;
+	}
+	return NULL;
+}
+
+static void set_lge_open_timer(lge_port_t *port, unsigned int usec) {
+	struct itimerspec t;
+
+	memset(&t, 0, sizeof(t));
+	t.it_value.tv_sec = usec / 1000000;
+	t.it_value.tv_nsec = (usec % 1000000) * 1000;
+	if (timerfd_settime(port->timerfd, 0, &t, NULL) == -1)
+		syslog(LOG_ERR, "setting serial port open timer failed: %s\n", strerror(errno));
+}
+
+/*
+ * Close a serial port that went away, such as an unplugged USB serial adapter,
+ * and start opening it again. A command that did not get its reply is sent
+ * again once the port is back, and the queued commands are held until then.
+ */
+static void detach_lge_port(lge_port_t *port, int resend) {
+	monitor_client_remove(port->devfd);
+	close(port->devfd);
+	port->devfd = -1;
+
+	if (resend && port->queue_len < LGE_QUEUE_SIZE) {
+		memmove(&port->queue[1], &port->queue[0], port->queue_len * sizeof(lge_entry_t));
+		port->queue[0] = port->current;
+		++port->queue_len;
+	}
+	port->rx_state = 0;
+	port->pause = 0;
+	port->query = 0;
+	clear_lge_state(port);
+	timerclear(&port->poll_time);
+}
+
+static void lost_lge_port(lge_port_t *port, int resend) {
+	syslog(LOG_ERR, "lge %s: serial port %s went away: %s\n", port->name, port->devname, strerror(errno));
+	detach_lge_port(port, resend);
+	set_lge_open_timer(port, LGE_OPEN_INTERVAL);
+}
+
+/*
+ * Return the reply time below which the given percentage of the replies to a
+ * command arrived, rounded up to a histogram bucket, in us.
+ */
+static unsigned int lge_hist_percentile(const lge_hist_t *hist, unsigned int percent)
+{
+	unsigned long sum = 0, target;
+	unsigned int i;
+
+	target = (hist->replies * percent + 99) / 100;
+	for (i = 0; i < LGE_HIST_BUCKETS - 1; ++i) {
+		sum += hist->count[i];
+		if (sum >= target)
+			break;
+	}
+	return (1u << i) * 1000;
+}
+
+static void lge_hist_add(lge_hist_t *hist, const struct timeval *sent, struct timeval *now)
+{
+	struct timeval t;
+	unsigned long ms;
+	unsigned int i;
+
+	timersub(now, sent, &t);
+	ms = t.tv_sec * 1000 + t.tv_usec / 1000;
+	for (i = 0; i < LGE_HIST_BUCKETS - 1 && ms >= (1ul << i); ++i);
+	++hist->count[i];
+	++hist->replies;
+}
+
+/*
+ * The time to wait for the reply to a command. Commands with their own
+ * timeout and power commands, which can take seconds while the tv starts,
+ * always get the full time. Each retry doubles the time, so that a slow but
+ * alive device still gets through.
+ */
+static unsigned int lge_reply_timeout(const lge_port_t *port, unsigned int i, unsigned int retries)
+{
+	const lge_cmd_t *cmd = &port->proto.cmd[i];
+	const lge_hist_t *hist = &port->hist[i];
+	unsigned int timeout;
+
+	if (cmd->timeout > 0)
+		return cmd->timeout;
+	if (cmd->flags & LGE_FLAG_POWER)
+		return port->proto.timeout;
+	if (hist->replies < LGE_HIST_MIN)
+		hist = &port->port_hist;
+	if (hist->replies < LGE_HIST_PORT_MIN)
+		return port->proto.timeout;
+
+	timeout = 2 * lge_hist_percentile(hist, 99);
+	if (timeout < LGE_TIMEOUT_MIN)
+		timeout = LGE_TIMEOUT_MIN;
+	timeout <<= retries;
+	if (timeout > port->proto.timeout)
+		timeout = port->proto.timeout;
+	return timeout;
+}
+
+static void lge_stats(void)
+{
+	const lge_port_t *port;
+	const lge_hist_t *hist;
+	unsigned int i;
+
+	for (port = lge_port_list; port != NULL; port = port->next) {
+		syslog(LOG_INFO, "lge %s: %s, %u commands queued, replies %lu, p50 < %u ms, p99 < %u ms\n",
+		       port->name, (port->devfd != -1) ? "open" : "not open", port->queue_len,
+		       port->port_hist.replies,
+		       lge_hist_percentile(&port->port_hist, 50) / 1000,
+		       lge_hist_percentile(&port->port_hist, 99) / 1000);
+		for (i = 0; i < LGE_NUM_CMDS; ++i) {
+			hist = &port->hist[i];
+			if (hist->replies == 0 && hist->timeouts == 0)
+				continue;
+			syslog(LOG_INFO,
+			       "lge %s command %02X (%s): replies %lu, failed %lu, timeouts %lu, p50 < %u ms, p99 < %u ms, timeout %u ms\n",
+			       port->name,
+			       i,
+			       port->proto.cmd[i].name,
+			       hist->replies,
+			       hist->failures,
+			       hist->timeouts,
+			       lge_hist_percentile(hist, 50) / 1000,
+			       lge_hist_percentile(hist, 99) / 1000,
+			       lge_reply_timeout(port, i, 0) / 1000);
+		}
+	}
+}
+
+static void set_lge_timeout(lge_port_t *port, struct timeval *now, unsigned int pause) {
 	struct timeval p;
 	p.tv_sec = pause / 1000000;
 	p.tv_usec = pause % 1000000;
-	timeradd(now, &p, &lge_timeout);
-	monitor_timeout(devfd, &p);
+	timeradd(now, &p, &port->timeout);
+	monitor_timeout(port->devfd, &p);
     	syslog(LOG_DEBUG, "set lge timeout: %d\n", pause);
 }
 
-static int send_lge_telegram(struct timeval *now, unsigned int value)
+static int send_lge_telegram(lge_port_t *port, struct timeval *now, unsigned int value)
 {
-	char msg[12];
-	snprintf(msg, sizeof(msg), "%c%c 00 %02X\r", lge_cmd_tab[lge_cmd].cmd1, lge_cmd_tab[lge_cmd].cmd2, value);
-	if (write(devfd, msg, 9) == (ssize_t)-1) {
-    		syslog(LOG_ERR, "writing data to serial port failed: %s\n", strerror(errno));
-    		return -1;
+	const char *name = port->proto.cmd[port->cmd].name;
+	char msg[LGE_TEMPLATE_MAX * LGE_NAME_MAX + 1];
+	size_t len = 0;
+	unsigned int i;
+
+	for (i = 0; i < port->proto.send_len; ++i) {
+		switch (port->proto.send[i].type) {
+		case LGE_TOKEN_NAME:
+			len += sprintf(msg + len, "%s", name);
+			break;
+		case LGE_TOKEN_NAME1:
+			msg[len++] = name[0];
+			break;
+		case LGE_TOKEN_NAME2:
+			msg[len++] = name[1];
+			break;
+		case LGE_TOKEN_HEX:
+			len += sprintf(msg + len, "%02X", value & 0x0FF);
+			break;
+		case LGE_TOKEN_DEC:
+			len += sprintf(msg + len, "%03u", value % 1000);
+			break;
+		default:
+			msg[len++] = port->proto.send[i].c;
+			break;
+		}
+	}
+	msg[len] = '\0';
+
+	if (write(port->devfd, msg, len) == (ssize_t)-1) {
+		if (errno == EAGAIN || errno == EINTR) {
+    			syslog(LOG_ERR, "writing data to serial port failed: %s\n", strerror(errno));
+    			return -1;
+		}
+		lost_lge_port(port, 1);
+		return 0;
 	}
     	syslog(LOG_DEBUG, "send lge data: '%s'\n", msg);
 
 		// Prepare receiver for reply telegram
-	lge_rx_state = 1;
-	lge_cmd_ok = 0;
-	set_lge_timeout(now, LGE_RX_START_TIMEOUT);
+	port->rx_state = 1;
+	port->rx_pos = 0;
+	port->rx_value = value;
+	port->cmd_ok = 0;
+	port->tx_time = *now;
+	set_lge_timeout(port, now, lge_reply_timeout(port, port->cmd, port->retries));
 
 	return 0;
 }
 
-static int send_lge_cmd(struct timeval *now)
+static int lge_target(lge_port_t *port, int delta)
 {
-	unsigned int code;
-	struct timeval t;
+	int value = port->state[port->cmd] + delta;
 
-	if (lge_rx_state != 0 || lge_queue_in == lge_queue_out)
+	if (value < 0)
 		return 0;
+	if (value > (int)port->proto.cmd[port->cmd].max)
+		return port->proto.cmd[port->cmd].max;
+	return value;
+}
 
-	code = lge_queue[lge_queue_out];
-	lge_queue_out = (lge_queue_out + 1) % LGE_QUEUE_SIZE;
-
-	if (code == 0) {
-		monitor_sigterm_handler(0);
-		return 0;
-	}
+static int send_lge_cmd(lge_port_t *port, struct timeval *now);
+static int push_lge_code(lge_port_t *port, unsigned int code);
 
-	lge_cmd = code >> 8;
-	lge_tx_value = code & 0x0FF;
-	lge_pause = lge_cmd_tab[lge_cmd].pause;
+/*
+ * Send the current command. A relative command is sent as an absolute set,
+ * after reading the setting from the tv when it is not known. A set command
+ * that would not change the setting is not sent at all.
+ */
+static int send_lge_current(lge_port_t *port, struct timeval *now)
+{
+	struct timeval t;
+	unsigned int flags;
 
 	if (now == NULL) {
 		now = &t;
@@ -143,211 +677,743 @@ static int send_lge_cmd(struct timeval *now)
 			return -1;
 	}
 
-	return send_lge_telegram(now, (lge_pause > 0) ? 0x0FF : lge_tx_value);
+	port->cmd = port->current.code >> 8;
+	port->tx_value = port->current.code & 0x0FF;
+	flags = port->proto.cmd[port->cmd].flags;
+
+	if (port->current.relative) {
+		if (port->current.delta == 0)
+			return send_lge_cmd(port, now);
+		if (port->state[port->cmd] < 0) {
+			port->query = 1;
+			port->pause = port->proto.cmd[port->cmd].pause;
+			return send_lge_telegram(port, now, port->proto.query);
+		}
+		port->tx_value = lge_target(port, port->current.delta);
+	}
+
+	if (!(flags & (LGE_FLAG_POWER | LGE_FLAG_KEY)) && port->state[port->cmd] == (int)port->tx_value) {
+		syslog(LOG_DEBUG, "lge command skipped, the tv is already set: %02X %02X\n", port->cmd, port->tx_value);
+		return send_lge_cmd(port, now);
+	}
+
+	port->pause = port->proto.cmd[port->cmd].pause;
+	return send_lge_telegram(port, now, (flags & LGE_FLAG_POWER) ? port->proto.query : port->tx_value);
 }
 
-static void process_lge_reply(char c)
+/*
+ * Read the polled settings from the tv, unless it is known to be off.
+ */
+static int poll_lge_state(lge_port_t *port, struct timeval *now)
 {
-	int state = lge_rx_state;
-
-	if (state == 1) {
-		if (c == lge_cmd_tab[lge_cmd].cmd2)
-			state = 2;	// Start of telegram
-	} else if (state == 6) {
-		if (c == 'N' || c == 'O')
-			state = 7;
-		else
-			state = 1;
-	} else if (state == 7) {
-		if (c == 'G') {
-			lge_cmd_ok = 0;
-			state = 8;
-		} else if (c == 'K') {
-			lge_cmd_ok = 1;
-			state = 8;
-		} else
-			state = 1;
-	} else if (state == 8) {
-		if (c >= '0' && c <= '9') {
-			lge_rx_value = (c - '0') << 4;
-			state = 9;
-		} else if (c >= 'A' && c <= 'F') {
-			lge_rx_value = (c + 10 - 'A') << 4;
-			state = 9;
-		} else
-			state = 1;
-	} else if (state == 9) {
-		if (c >= '0' && c <= '9') {
-			lge_rx_value |= (c - '0');
-			state = 10;
-		} else if (c >= 'A' && c <= 'F') {
-			lge_rx_value |= (c + 10 - 'A');
-			state = 10;
-		} else
-			state = 1;
-	} else if (state == 12) {
-		state = 0;	// end of telegram
-	} else if (state) {
-		++state;
-	}
-
-	lge_rx_state = state;
-}
-
-static int lge_handler(void* UNUSED(id), int ready, struct timeval *now) {
+	unsigned int i;
+
+	timerclear(&port->poll_time);
+	if (port->proto.power != 0 && port->state[port->proto.power] == 0)
+		return 0;
+
+	syslog(LOG_DEBUG, "polling lge state\n");
+	++port->batch;
+	for (i = 0; i < LGE_NUM_CMDS; ++i) {
+		if (!(port->proto.cmd[i].flags & LGE_FLAG_POLL))
+			continue;
+		if (push_lge_code(port, (i << 8) | port->proto.query) < 0)
+			return -1;
+	}
+	return send_lge_cmd(port, now);
+}
+
+static int send_lge_cmd(lge_port_t *port, struct timeval *now)
+{
+	struct timeval t;
+
+	if (port->devfd == -1 || port->rx_state != 0 || port->pause > 0)
+		return 0;
+
+	if (port->queue_len == 0) {
+		if (port->poll > 0) {
+			if (now == NULL) {
+				now = &t;
+				if (monitor_now(now) < 0)
+					return -1;
+			}
+			t.tv_sec = port->poll;
+			t.tv_usec = 0;
+			timeradd(now, &t, &port->poll_time);
+			monitor_timeout(port->devfd, &t);
+		}
+		return 0;
+	}
+
+	port->current = port->queue[0];
+	memmove(&port->queue[0], &port->queue[1], (port->queue_len - 1) * sizeof(lge_entry_t));
+	--port->queue_len;
+	port->retries = 0;
+
+	if (port->current.code == 0) {
+		if (lge_stopping > 0 && --lge_stopping == 0)
+			monitor_sigterm_handler(0);
+		return 0;
+	}
+
+	return send_lge_current(port, now);
+}
+
+/*
+ * Send the current command again after it failed, or give up on it and go on
+ * with the next queued command.
+ */
+static int retry_lge_cmd(lge_port_t *port, struct timeval *now)
+{
+	port->rx_state = 0;
+	port->pause = 0;
+	port->query = 0;
+	clear_lge_state(port);
+
+	if (port->retries < LGE_RETRY_MAX && !(port->current.relative == 0 && (port->current.code & 0x0FF) == port->proto.query)) {
+		++port->retries;
+		syslog(LOG_DEBUG, "retrying lge command: %02X\n", port->cmd);
+		return send_lge_current(port, now);
+	}
+
+	syslog(LOG_ERR, "dropping lge command: %02X\n", port->cmd);
+	return send_lge_cmd(port, now);
+}
+
+/*
+ * Match a received character against the reply template. Characters before
+ * the first token matches are skipped, and a character that does not match
+ * starts the reply over. port->rx_state is 0 once the whole reply matched.
+ */
+static void process_lge_reply(lge_port_t *port, char c)
+{
+	const lge_token_t *token = &port->proto.reply[port->rx_state - 1];
+	const char *name = port->proto.cmd[port->cmd].name;
+	int match = 0, done = 1, digit;
+
+	switch (token->type) {
+	case LGE_TOKEN_ANY:
+		match = 1;
+		break;
+	case LGE_TOKEN_NAME:
+		match = (c == name[port->rx_pos]);
+		done = (name[port->rx_pos + 1] == '\0');
+		break;
+	case LGE_TOKEN_NAME1:
+		match = (c == name[0]);
+		break;
+	case LGE_TOKEN_NAME2:
+		match = (c == name[1]);
+		break;
+	case LGE_TOKEN_HEX:
+	case LGE_TOKEN_DEC:
+		digit = lge_hex_digit(c);
+		if (token->type == LGE_TOKEN_DEC && digit > 9)
+			digit = -1;
+		match = (digit >= 0);
+		if (port->rx_pos == 0)
+			port->rx_value = 0;
+		port->rx_value = port->rx_value * ((token->type == LGE_TOKEN_HEX) ? 16 : 10) + digit;
+		done = (port->rx_pos + 1 == ((token->type == LGE_TOKEN_HEX) ? 2u : 3u));
+		break;
+	case LGE_TOKEN_STATUS:
+		if (port->rx_pos == 0)
+			port->rx_ok = port->rx_error = 1;
+		port->rx_ok = port->rx_ok && (c == port->proto.ok[port->rx_pos]);
+		port->rx_error = port->rx_error && (c == port->proto.error[port->rx_pos]);
+		match = port->rx_ok || port->rx_error;
+		port->cmd_ok = port->rx_ok && port->proto.ok[port->rx_pos + 1] == '\0';
+		done = port->cmd_ok || (port->rx_error && port->proto.error[port->rx_pos + 1] == '\0');
+		break;
+	default:
+		match = (c == token->c);
+		break;
+	}
+
+	if (!match) {
+		port->rx_pos = 0;
+		if (port->rx_state > 1) {
+			port->rx_state = 1;
+			process_lge_reply(port, c);
+		}
+		return;
+	}
+	if (!done) {
+		++port->rx_pos;
+		return;
+	}
+	port->rx_pos = 0;
+	port->rx_state = ((unsigned int)port->rx_state == port->proto.reply_len) ? 0 : port->rx_state + 1;
+}
+
+static int lge_handler(void *id, int ready, struct timeval *now) {
+	lge_port_t *port = id;
 	char msg[100];
 	ssize_t n, i;
 	struct timeval pause;
 
 	if (ready) {
-		n = read(devfd, &msg, sizeof(msg)-1);
-		if (n == (ssize_t)-1) {
-    			syslog(LOG_ERR, "reading data from serial port failed: %s\n", strerror(errno));
-    			return -1;
+		n = read(port->devfd, &msg, sizeof(msg)-1);
+		if (n == (ssize_t)-1 && (errno == EAGAIN || errno == EINTR))
+			return 0;
+		if (n <= 0) {
+			if (n == 0)
+				errno = ENODEV;
+			lost_lge_port(port, port->rx_state > 0);
+			return 0;
 		}
 		msg[n] = 0;
     		syslog(LOG_DEBUG, "read lge data: '%s'\n", msg);
 
-		for (i = 0; i < n; ++i)
-			process_lge_reply(msg[i]);
+		for (i = 0; i < n && port->rx_state > 0; ++i)
+			process_lge_reply(port, msg[i]);
 
-		if (lge_rx_state > 0) {
-			set_lge_timeout(now, LGE_RX_TIMEOUT);
+		if (port->rx_state > 0) {
+			set_lge_timeout(port, now, port->proto.char_timeout);
 			return 0;
 		}
 
-		if (!lge_cmd_ok) {
-    			syslog(LOG_ERR, "lge command failed: %02X\n", lge_cmd);
-			lge_queue_in = lge_queue_out = 0;
-			return 0;
+		lge_hist_add(&port->hist[port->cmd], &port->tx_time, now);
+		if (!(port->proto.cmd[port->cmd].flags & LGE_FLAG_POWER))
+			lge_hist_add(&port->port_hist, &port->tx_time, now);
+
+		if (!port->cmd_ok) {
+			++port->hist[port->cmd].failures;
+    			syslog(LOG_ERR, "lge command failed: %02X\n", port->cmd);
+			return retry_lge_cmd(port, now);
 		}
 
-    		syslog(LOG_DEBUG, "lge rx value: %02X\n", lge_rx_value);
+    		syslog(LOG_DEBUG, "lge rx value: %02X\n", port->rx_value);
 
-		if (lge_pause > 0) {
-			if (lge_tx_value != lge_rx_value) {
-				return send_lge_telegram(now, lge_tx_value);
-			}
-			set_lge_timeout(now, lge_pause);
+		if (!(port->proto.cmd[port->cmd].flags & LGE_FLAG_KEY)) {
+			/* The other settings cannot be relied on after the tv is switched. */
+			if ((port->proto.cmd[port->cmd].flags & LGE_FLAG_POWER) && port->state[port->cmd] != (int)port->rx_value)
+				clear_lge_state(port);
+			port->state[port->cmd] = port->rx_value;
+		}
+
+		if (port->query) {
+			port->query = 0;
+			port->tx_value = lge_target(port, port->current.delta);
+			if (port->state[port->cmd] != (int)port->tx_value)
+				return send_lge_telegram(port, now, port->tx_value);
+		} else if ((port->proto.cmd[port->cmd].flags & LGE_FLAG_POWER) && port->tx_value != port->rx_value) {
+			return send_lge_telegram(port, now, port->tx_value);
+		}
+
+		if (port->pause > 0) {
+			set_lge_timeout(port, now, port->pause);
 			return 0;
 		}
 
-		return send_lge_cmd(now);
+		return send_lge_cmd(port, now);
 	}
 
-	if (lge_rx_state > 0 || lge_pause > 0) {
-		if (!timercmp(now, &lge_timeout, <)) {
-			if (lge_rx_state > 0) {
-    				syslog(LOG_ERR, "lge command timeout: %02X\n", lge_cmd);
-				lge_rx_state = 0;
-				lge_pause = 0;
-				lge_queue_in = lge_queue_out = 0;
-				return 0;
+	if (port->rx_state > 0 || port->pause > 0) {
+		if (!timercmp(now, &port->timeout, <)) {
+			if (port->rx_state > 0) {
+    				syslog(LOG_ERR, "lge command timeout: %02X\n", port->cmd);
+				++port->hist[port->cmd].timeouts;
+				return retry_lge_cmd(port, now);
 			}
-			lge_pause = 0;
-			return send_lge_cmd(now);
+			port->pause = 0;
+			return send_lge_cmd(port, now);
 		}
-		timersub(&lge_timeout, now, &pause);
-		monitor_timeout(devfd, &pause);
+		timersub(&port->timeout, now, &pause);
+		monitor_timeout(port->devfd, &pause);
+	} else if (timerisset(&port->poll_time)) {
+		if (!timercmp(now, &port->poll_time, <))
+			return poll_lge_state(port, now);
+		timersub(&port->poll_time, now, &pause);
+		monitor_timeout(port->devfd, &pause);
 	}
 
 	return 0;
 }
 
-int lge_push(unsigned int code) {
-	unsigned int i;
+/*
+ * Queue a command. A command is merged with a queued command of the same
+ * kind: a relative command with a queued relative command for the same
+ * setting and a set command with a queued set of the same setting, which
+ * takes the new value. Remote keys and queries are not merged, and nothing is
+ * merged past a queued stop. A power command goes ahead of the commands
+ * queued by earlier lge_send() calls.
+ */
+static int push_lge_entry(lge_port_t *port, const lge_entry_t *entry) {
+	lge_entry_t *queued;
+	unsigned int cmd, value, i, j;
 
-	i = (lge_queue_in + 1) % LGE_QUEUE_SIZE;
-	if (i == lge_queue_out) {
+	cmd = entry->code >> 8;
+	value = entry->code & 0x0FF;
+
+	if (entry->code != 0 && !(port->proto.cmd[cmd].flags & LGE_FLAG_KEY) && (entry->relative || value != port->proto.query)) {
+		for (i = port->queue_len; i-- > 0;) {
+			queued = &port->queue[i];
+			if (queued->code == 0)
+				break;
+			if ((queued->code >> 8) != cmd)
+				continue;
+			if (queued->relative != entry->relative)
+				break;
+			if (entry->relative) {
+				queued->delta += entry->delta;
+				return 0;
+			}
+			if ((queued->code & 0x0FF) == port->proto.query)
+				break;
+			queued->code = entry->code;
+			return 0;
+		}
+	}
+
+	if (port->queue_len == LGE_QUEUE_SIZE) {
     		syslog(LOG_ERR, "lge command queue overflow\n");
     		return -1;
 	}
 
-	if (code == 0 && lge_rx_state == 0) {
-    		syslog(LOG_ERR, "illegal empty lge off command sequence\n");
-    		return -1;
+	i = port->queue_len;
+	if (port->proto.cmd[cmd].flags & LGE_FLAG_POWER) {
+		for (i = 0; i < port->queue_len && (port->proto.cmd[port->queue[i].code >> 8].flags & LGE_FLAG_POWER); ++i);
+		for (j = i; j < port->queue_len; ++j) {
+			if (port->queue[j].code == 0 || port->queue[j].batch == port->batch) {
+				i = port->queue_len;
+				break;
+			}
+		}
 	}
 
-	lge_queue[lge_queue_in] = code;
-	lge_queue_in = i;
+	memmove(&port->queue[i + 1], &port->queue[i], (port->queue_len - i) * sizeof(lge_entry_t));
+	port->queue[i] = *entry;
+	++port->queue_len;
 
 	return 0;
 }
 
-int lge_send(const char *seq, struct timeval *now) {
+static int push_lge_code(lge_port_t *port, unsigned int code) {
+	lge_entry_t entry;
+
+	entry.code = code;
+	entry.relative = 0;
+	entry.delta = 0;
+	entry.batch = port->batch;
+	if (port->proto.volume != 0 && code != 0 && (code == port->proto.volume_up || code == port->proto.volume_down)) {
+		entry.code = port->proto.volume << 8;
+		entry.relative = 1;
+		entry.delta = (code == port->proto.volume_up) ? 1 : -1;
+	}
+
+	return push_lge_entry(port, &entry);
+}
+
+/*
+ * Queue a sequence of codes separated by spaces or commas. A code is either
+ * a command and a value (for example 0510 sets the volume to 0x10), or a
+ * command and a signed decimal change of its setting (for example 05+3).
+ */
+static int send_lge_codes(lge_port_t *port, const char *seq, struct timeval *now) {
 	char *s, *p;
 	char buf[100];
 	unsigned int code, i;
+	lge_entry_t entry;
+	int n, rc;
 
-	if (seq != NULL && devfd != -1) {
+	if (seq != NULL) {
+		++port->batch;
 		s = strtok_r(strncpy(buf, seq, sizeof(buf)), " ,", &p);
 		while (s != NULL) {
-			if (sscanf(s, "%x", &code) != 1) {
-    				syslog(LOG_ERR, "illegal lge code: %s\n", s);
+			if (sscanf(s, "%x%n", &code, &n) != 1) {
+    				syslog(LOG_ERR, "lge %s: illegal code: %s\n", port->name, s);
     				return -1;
 			}
 
-			i = code >> 8;
-			if (i >= LGE_NUM_CMDS || lge_cmd_tab[i].cmd1 == 0) {
-    				syslog(LOG_ERR, "illegal lge command: %s\n", s);
-    				return -1;
+			if (s[n] == '+' || s[n] == '-') {
+				i = code;
+				if (i >= LGE_NUM_CMDS || port->proto.cmd[i].name[0] == '\0' ||
+				    (port->proto.cmd[i].flags & (LGE_FLAG_POWER | LGE_FLAG_KEY)) ||
+				    sscanf(s + n, "%d", &entry.delta) != 1) {
+    					syslog(LOG_ERR, "lge %s: illegal command: %s\n", port->name, s);
+    					return -1;
+				}
+				entry.code = i << 8;
+				entry.relative = 1;
+				entry.batch = port->batch;
+				rc = push_lge_entry(port, &entry);
+			} else {
+				i = code >> 8;
+				if (i >= LGE_NUM_CMDS || port->proto.cmd[i].name[0] == '\0') {
+    					syslog(LOG_ERR, "lge %s: illegal command: %s\n", port->name, s);
+    					return -1;
+				}
+				rc = push_lge_code(port, code);
 			}
-
-			if (lge_push(code) < 0)
+			if (rc < 0)
 				return -1;
 
 			s = strtok_r(NULL, " ,", &p);
 		}
 	}
-	return send_lge_cmd(now);
+	return send_lge_cmd(port, now);
 }
 
-int lge_init(const char *devname, int retry) {
-	struct termios tio;
-	int flags;
+/*
+ * Queue a code sequence for the named port, or for the first port when name
+ * is NULL. Without any port the sequence is dropped and 0 is returned, so that
+ * a shared lircrc with prog = lge entries still works on a host without a tv.
+ */
+int lge_send(const char *name, const char *seq, struct timeval *now) {
+	lge_port_t *port;
+
+	if (name == NULL && lge_port_list == NULL) {
+		if (!lge_unused_logged) {
+			syslog(LOG_INFO, "no lge port, lge codes are dropped\n");
+			lge_unused_logged = 1;
+		}
+		return 0;
+	}
+	if ((port = find_lge_port(name)) == NULL) {
+		syslog(LOG_ERR, "no lge port named '%s'\n", (name != NULL) ? name : "");
+		return -1;
+	}
+	return send_lge_codes(port, seq, now);
+}
 
-	lge_rx_state = 0;
-	lge_pause = 0;
-	lge_queue_in = lge_queue_out = 0;
-	timerclear(&lge_timeout);
+/*
+ * Queue the on codes of every port.
+ */
+int lge_on(void) {
+	lge_port_t *port;
 
-	for (;;) {
-		devfd = open(devname, O_RDWR|O_NOCTTY);
-		if (devfd != -1 || retry <= 0)
-			break;
-		if (usleep(100000) == -1)
+	for (port = lge_port_list; port != NULL; port = port->next) {
+		if (port->on != NULL && send_lge_codes(port, port->on, NULL) != 0)
 			return -1;
-		--retry;
 	}
-	if (devfd == -1) {
-		syslog(LOG_ERR, "could not open serial port device %s: %s\n", devname, strerror(errno));
-		return -1;
+	return 0;
+}
+
+/*
+ * Queue the off codes of every port that has them, each followed by a stop.
+ * Returns the number of ports still sending them; once the last one is done
+ * the monitor is stopped. A port that is not open cannot be switched off.
+ */
+int lge_off(void) {
+	lge_port_t *port;
+	lge_entry_t entry;
+
+	memset(&entry, 0, sizeof(entry));
+	lge_stopping = 0;
+	for (port = lge_port_list; port != NULL; port = port->next) {
+		if (port->off == NULL)
+			continue;
+		if (port->devfd == -1) {
+    			syslog(LOG_ERR, "lge %s: serial port %s is not open, off codes dropped\n", port->name, port->devname);
+			continue;
+		}
+		if (send_lge_codes(port, port->off, NULL) != 0)
+			return -1;
+		entry.batch = port->batch;
+		if (push_lge_entry(port, &entry) != 0)
+			return -1;
+		++lge_stopping;
+		if (send_lge_cmd(port, NULL) != 0)
+			return -1;
 	}
+	return (int)lge_stopping;
+}
+
+/*
+ * Open and configure the serial port.
+ */
+static int open_lge_port(lge_port_t *port) {
+	struct termios tio;
+
+	port->devfd = open(port->devname, O_RDWR|O_NOCTTY|O_NONBLOCK|O_CLOEXEC);
+	if (port->devfd == -1)
+		return -1;
 
-	if (tcgetattr(devfd, &tio) == -1) {
-		syslog(LOG_ERR, "getting configuration of serial port failed: %s\n", strerror(errno));
-		lge_exit();
+	if (tcgetattr(port->devfd, &tio) == -1) {
+		syslog(LOG_ERR, "lge %s: getting configuration of serial port failed: %s\n", port->name, strerror(errno));
+		close(port->devfd);
+		port->devfd = -1;
 		return -1;
 	}
 	cfmakeraw(&tio);
 	tio.c_cflag |= (CS8 | CLOCAL | CREAD);
-	cfsetspeed(&tio, B9600);
+	cfsetspeed(&tio, port->proto.speed);
 	tio.c_cc[VMIN] = 1;
 	tio.c_cc[VTIME] = 0;
-	if (tcsetattr(devfd, TCSANOW, &tio) == -1) {
-		syslog(LOG_ERR, "setting configuration of serial port failed: %s\n", strerror(errno));
-		lge_exit();
+	if (tcsetattr(port->devfd, TCSANOW, &tio) == -1) {
+		syslog(LOG_ERR, "lge %s: setting configuration of serial port failed: %s\n", port->name, strerror(errno));
+		close(port->devfd);
+		port->devfd = -1;
 		return -1;
 	}
 
-	tcflush(devfd, TCIOFLUSH);
+	tcflush(port->devfd, TCIOFLUSH);
 
-	flags = fcntl(devfd, F_GETFL);
-	fcntl(devfd, F_SETFL, flags | O_NONBLOCK);
+	if (monitor_client_add(port->devfd, &lge_handler, port) != 0) {
+		close(port->devfd);
+		port->devfd = -1;
+		return -1;
+	}
+
+	syslog(LOG_INFO, "lge %s: serial port %s opened\n", port->name, port->devname);
+	return 0;
+}
+
+/*
+ * Try to open the serial port when the open timer expires, and send the
+ * commands that were queued while it was missing once it is open.
+ */
+static int lge_open_handler(void *id, int ready, struct timeval *now) {
+	lge_port_t *port = id;
+	uint64_t expirations;
+
+	if (!(ready & MONITOR_READ) || read(port->timerfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return 0;
+	if (port->devfd != -1)
+		return 0;
+
+	if (open_lge_port(port) != 0) {
+		if (port->open_retry > 0) {
+			--port->open_retry;
+			set_lge_open_timer(port, LGE_OPEN_INTERVAL);
+		} else {
+			set_lge_open_timer(port, LGE_OPEN_INTERVAL_SLOW);
+		}
+		return 0;
+	}
+
+	return send_lge_cmd(port, now);
+}
+
+static char *lge_strdup(const char *s) {
+	char *copy;
+
+	if ((copy = strdup(s)) == NULL)
+		syslog(LOG_ERR, "failed to allocate memory for the lge port: %s\n", strerror(errno));
+	return copy;
+}
+
+/*
+ * Add a named serial port with its own protocol description (NULL for the
+ * built-in LG protocol) and the codes to send at start-up and shutdown (NULL
+ * for none, an empty off sequence just waits for the queue to drain).
+ */
+int lge_add(const char *name, const char *devname, int retry, unsigned int poll, const char *protocol,
+            const char *on, const char *off) {
+	lge_port_t *port, **tail;
+
+	if (lge_port_list != NULL && find_lge_port(name) != NULL) {
+		syslog(LOG_ERR, "lge port %s is given more than once\n", name);
+		return -1;
+	}
+
+	if ((port = calloc(1, sizeof(*port))) == NULL) {
+		syslog(LOG_ERR, "failed to allocate memory for the lge port: %s\n", strerror(errno));
+		return -1;
+	}
+	port->devfd = -1;
+	port->timerfd = -1;
+	port->poll = poll;
+	port->open_retry = retry;
+	clear_lge_state(port);
+
+	if ((port->name = lge_strdup(name)) == NULL || (port->devname = lge_strdup(devname)) == NULL ||
+	    (on != NULL && (port->on = lge_strdup(on)) == NULL) ||
+	    (off != NULL && (port->off = lge_strdup(off)) == NULL) ||
+	    lge_protocol_init(&port->proto, protocol) != 0) {
+		close_lge_port(port);
+		return -1;
+	}
+
+	/*
+	 * Without retries a missing port is an error, as it always was. Otherwise
+	 * the daemon starts without it and the port is opened once it appears.
+	 */
+	if (open_lge_port(port) != 0) {
+		syslog((retry > 0) ? LOG_WARNING : LOG_ERR, "lge %s: could not open serial port device %s: %s\n", name, devname, strerror(errno));
+		if (retry <= 0) {
+			close_lge_port(port);
+			return -1;
+		}
+	}
+
+	if ((port->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+		syslog(LOG_ERR, "lge %s: creating serial port open timer failed: %s\n", name, strerror(errno));
+		close_lge_port(port);
+		return -1;
+	}
+	if (monitor_client_add(port->timerfd, &lge_open_handler, port) != 0) {
+		close_lge_port(port);
+		return -1;
+	}
+	if (port->devfd == -1)
+		set_lge_open_timer(port, LGE_OPEN_INTERVAL);
+
+	for (tail = &lge_port_list; *tail != NULL; tail = &(*tail)->next);
+	*tail = port;
+
+	if (monitor_stats_add(&lge_stats) != 0)
+		return -1;
 
-	if (monitor_client_add(devfd, &lge_handler, NULL) != 0)
+	return 0;
+}
+
+/*
+ * Get ready to replace the ports with a new set of them, given one call per
+ * port in the new order. The protocol descriptions are read and new ports get
+ * their open timer now, so that committing cannot fail.
+ */
+int lge_reload(const char *name, const char *devname, int retry, unsigned int poll, const char *protocol,
+               const char *on, const char *off) {
+	lge_port_t *port, **tail;
+
+	for (tail = &lge_reload_list; *tail != NULL; tail = &(*tail)->next) {
+		if (strcmp((*tail)->name, name) == 0) {
+			syslog(LOG_ERR, "lge port %s is given more than once\n", name);
+			return -1;
+		}
+	}
+
+	if ((port = calloc(1, sizeof(*port))) == NULL) {
+		syslog(LOG_ERR, "failed to allocate memory for the lge port: %s\n", strerror(errno));
+		return -1;
+	}
+	port->devfd = -1;
+	port->timerfd = -1;
+	port->poll = poll;
+	port->open_retry = retry;
+	clear_lge_state(port);
+	*tail = port;
+
+	if ((port->name = lge_strdup(name)) == NULL || (port->devname = lge_strdup(devname)) == NULL ||
+	    (on != NULL && (port->on = lge_strdup(on)) == NULL) ||
+	    (off != NULL && (port->off = lge_strdup(off)) == NULL) ||
+	    lge_protocol_init(&port->proto, protocol) != 0)
 		return -1;
 
+	if (find_lge_port(name) != NULL)
+		return 0;
+
+	if (monitor_stats_add(&lge_stats) != 0)
+		return -1;
+	if ((port->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+		syslog(LOG_ERR, "lge %s: creating serial port open timer failed: %s\n", name, strerror(errno));
+		return -1;
+	}
+	if (monitor_client_add(port->timerfd, &lge_open_handler, port) != 0) {
+		close(port->timerfd);
+		port->timerfd = -1;
+		return -1;
+	}
 	return 0;
 }
 
+/*
+ * Drop the queued commands that the new protocol of a port does not have, and
+ * move the queued reads to its query value.
+ */
+static void filter_lge_queue(lge_port_t *port, unsigned int query) {
+	lge_entry_t *entry;
+	unsigned int cmd, i, n = 0;
+
+	for (i = 0; i < port->queue_len; ++i) {
+		entry = &port->queue[i];
+		cmd = entry->code >> 8;
+		if (entry->code != 0 && (port->proto.cmd[cmd].name[0] == '\0' ||
+		    (entry->relative && (port->proto.cmd[cmd].flags & (LGE_FLAG_POWER | LGE_FLAG_KEY))))) {
+			syslog(LOG_WARNING, "lge %s: command %02X is not in the new protocol, dropped\n", port->name, cmd);
+			continue;
+		}
+		if (entry->code != 0 && !entry->relative && (entry->code & 0x0FF) == query)
+			entry->code = (cmd << 8) | port->proto.query;
+		port->queue[n++] = *entry;
+	}
+	port->queue_len = n;
+}
+
+/*
+ * Move the settings of a reloaded port into the running one. The queue, the
+ * device state and the reply statistics are kept. The port is opened again
+ * when its device or protocol changed, and a command waiting for its reply is
+ * sent again there. A new protocol also starts the device state and the
+ * reply statistics over, since both are indexed by its commands.
+ */
+static void update_lge_port(lge_port_t *port, lge_port_t *new) {
+	int proto = memcmp(&port->proto, &new->proto, sizeof(port->proto)) != 0;
+	int reopen = proto || strcmp(port->devname, new->devname) != 0;
+	unsigned int query = port->proto.query;
+	char *s;
+
+	if (reopen && port->devfd != -1) {
+		syslog(LOG_INFO, "lge %s: reopening serial port %s as %s%s\n", port->name, port->devname, new->devname,
+		       proto ? " with a new protocol" : "");
+		detach_lge_port(port, port->rx_state > 0);
+	}
+
+	s = port->devname; port->devname = new->devname; new->devname = s;
+	s = port->on; port->on = new->on; new->on = s;
+	s = port->off; port->off = new->off; new->off = s;
+	port->poll = new->poll;
+
+	if (proto) {
+		port->proto = new->proto;
+		port->rx_state = 0;
+		port->rx_pos = 0;
+		port->pause = 0;
+		port->query = 0;
+		clear_lge_state(port);
+		memset(port->hist, 0, sizeof(port->hist));
+		memset(&port->port_hist, 0, sizeof(port->port_hist));
+		filter_lge_queue(port, query);
+	}
+
+	if (reopen) {
+		port->open_retry = new->open_retry;
+		set_lge_open_timer(port, 1);
+	}
+}
+
+/*
+ * Switch to the ports given to lge_reload() when commit is set. Ports that
+ * are kept are updated in place, new ones are opened in the background, and
+ * ports that are gone are closed with whatever is still queued for them.
+ * Otherwise the new ports are dropped and nothing changes.
+ */
+void lge_reload_finish(int commit) {
+	lge_port_t *list = NULL, **tail = &list;
+	lge_port_t *port, *new, **p;
+
+	while ((new = lge_reload_list) != NULL) {
+		lge_reload_list = new->next;
+		new->next = NULL;
+		if (!commit) {
+			close_lge_port(new);
+			continue;
+		}
+
+		for (p = &lge_port_list; *p != NULL && strcmp((*p)->name, new->name) != 0; p = &(*p)->next);
+		if ((port = *p) != NULL) {
+			*p = port->next;
+			port->next = NULL;
+			update_lge_port(port, new);
+			close_lge_port(new);
+		} else {
+			port = new;
+			syslog(LOG_INFO, "lge %s: added serial port %s\n", port->name, port->devname);
+			set_lge_open_timer(port, 1);
+		}
+		*tail = port;
+		tail = &port->next;
+	}
+	if (!commit)
+		return;
+
+	while ((port = lge_port_list) != NULL) {
+		lge_port_list = port->next;
+		syslog(LOG_INFO, "lge %s: removed serial port %s, %u queued command(s) dropped\n",
+		       port->name, port->devname, port->queue_len);
+		close_lge_port(port);
+	}
+	lge_port_list = list;
+}
@@ -3,9 +3,18 @@
 
 #include <sys/time.h>
 
+/* The name of the port given with --lge-port and the --lge-* options. */
+#define LGE_NAME_DEFAULT "tv"
+#define LGE_PORT_MAX 8
+
 int lge_exit(void);
-int lge_init(const char *devname, int retry);
-int lge_push(unsigned int code);
-int lge_send(const char *seq, struct timeval *now);
+int lge_add(const char *name, const char *devname, int retry, unsigned int poll, const char *protocol,
+            const char *on, const char *off);
+int lge_on(void);
+int lge_off(void);
+int lge_send(const char *name, const char *seq, struct timeval *now);
+int lge_reload(const char *name, const char *devname, int retry, unsigned int poll, const char *protocol,
+               const char *on, const char *off);
+void lge_reload_finish(int commit);
 
 #endif
@@ -17,18 +17,34 @@
  * along with eventlircd.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+/*
+ * accept4() and struct ucred are GNU extensions.
+ */
+#define _GNU_SOURCE 1
+
 /*
  * Single Unix Specification Version 3 headers.
  */
 #include <errno.h>        /* C89 */
 #include <fcntl.h>        /* POSIX */
+#include <fnmatch.h>      /* POSIX */
+#include <limits.h>       /* C89 */
+#include <netdb.h>        /* POSIX */
+#include <netinet/in.h>   /* POSIX */
+#include <netinet/tcp.h>  /* POSIX */
+#include <stdbool.h>      /* C99 */
+#include <stdint.h>       /* POSIX */
 #include <stdio.h>        /* C89 */
 #include <stdlib.h>       /* C89 */
+#include <string.h>       /* C89 */
+#include <sys/eventfd.h>  /* Linux */
 #include <sys/socket.h>   /* POSIX */
 #include <sys/stat.h>     /* POSIX */
 #include <sys/types.h>    /* POSIX */
+#include <sys/uio.h>      /* XSI */
 #include <sys/un.h>       /* XSI */
 #include <syslog.h>       /* XSI */
+#include <time.h>         /* C89 */
 #include <unistd.h>       /* POSIX */
 /*
  * Linux header files.
@@ -36,15 +52,18 @@
 #include <linux/input.h>  /* */
 #include <linux/limits.h> /* */
 
-#include <lirc_client.h>
 
 /*
  * eventlircd headers.
  */
 #include "lircd.h"
+#include "lircrc.h"
 #include "monitor.h"
+#include "ring.h"
+#include "sh.h"
 #include "lge.h"
 #include "txir.h"
+#include "macro.h"
 
 /*
  * The lircd_handler does not use the id parameter, so we need to let gcc's
@@ -59,346 +78,2682 @@
 # define UNUSED(x) x
 #endif
 
+/*
+ * The number of client records allocated at once. Client records, together
+ * with their queue rings, are allocated in slabs and reused through a free
+ * list, so that a burst of connecting clients does not need an allocation
+ * per client.
+ */
+#define LIRCD_CLIENT_SLAB 16
+
+/*
+ * The first file descriptor passed by a service manager that uses the socket
+ * activation protocol.
+ */
+#define LIRCD_LISTEN_FDS_START 3
+
+/*
+ * The longest lircd message that will be sent. Messages are built from
+ * templates, so the limit is checked once when a template is created rather
+ * than each time a message is sent.
+ */
+#define LIRCD_MESSAGE_MAX 1024
+
+/*
+ * The size of the frame buffer in which the messages produced by one input
+ * event frame are assembled.
+ */
+#define LIRCD_FRAME_SIZE (4 * LIRCD_MESSAGE_MAX)
+
+/*
+ * The most messages assembled in one frame buffer. It is the width of the mask
+ * of a frame's messages that pass a client's subscription filter.
+ */
+#define LIRCD_FRAME_MESSAGE_MAX 64
+
+/*
+ * The largest number of queued buffers written to a client with one writev().
+ */
+#define LIRCD_CLIENT_IOV_MAX 64
+
+/*
+ * The longest command line a client can send.
+ */
+#define LIRCD_COMMAND_MAX 256
+
+/*
+ * The largest time stamp suffix " <event time> <dispatch time>\n" appended to
+ * the messages sent to clients that asked for time stamps.
+ */
+#define LIRCD_TIME_MAX 64
+
+/*
+ * The formats in which a client gets the messages.
+ */
+#define LIRCD_FORMAT_TEXT   0
+#define LIRCD_FORMAT_TIME   1
+#define LIRCD_FORMAT_BINARY 2
+
+/*
+ * The key of a buffer whose messages are all for the same key, made of the
+ * remote id and the key code, so that queued key repeats of the key can be
+ * recognized. LIRCD_KEY_NONE is the key of any other buffer.
+ */
+#define LIRCD_KEY(remote_id, code) ((((unsigned long)(remote_id)) << 16) | (unsigned long)(code))
+#define LIRCD_KEY_NONE ((unsigned long)-1)
+
+/*
+ * The 'lircd_message' structure holds the precomputed lircd message template
+ * for one output key code of one input device. The template text is stored as
+ * "<code> " followed by the key press tail " <name> <remote>\n" and the key
+ * release tail " <name><suffix> <remote>\n", so that sending a message only
+ * requires copying the prefix, formatting the repeat count and copying the
+ * tail.
+ */
+struct lircd_message {
+	size_t prefix_len;                  /* The length of the "<code> " prefix. */
+	size_t press_len;                   /* The length of the key press tail. */
+	size_t release_len;                 /* The length of the key release tail (0 when releases are not sent). */
+	size_t name_len;                    /* The length of the key name. */
+	struct lircrc_key *lircrc[2];       /* The compiled lircrc key for the key press and key release names. */
+	struct lircrc_key *reload[2];       /* The keys compiled from the lircrc file being reloaded. */
+	char text[];                        /* The prefix, the key press tail and the key release tail. */
+};
+
+/*
+ * The 'lircd_device' structure holds the lircd state associated with one input
+ * device: its output, the remote name and the table of message templates
+ * indexed by output key code.
+ */
+struct lircd_device {
+	struct lircd_output *output;        /* The output to which the device's keys are sent. */
+	char *remote;
+	unsigned int remote_id;             /* The remote's index in the list of remote names. */
+	unsigned int id;                    /* The device's id in binary records. */
+	struct lircd_message *message[KEY_CNT];
+	struct lircd_device *next;
+};
+
+/*
+ * The 'lircd_buffer' structure holds the lircd messages produced by one input
+ * event frame (the events up to and including a SYN_REPORT). The messages are
+ * assembled once and the same buffer is written to every client. It is
+ * reference counted so that every client whose queue holds the buffer shares
+ * the same copy.
+ */
+struct lircd_buffer {
+	unsigned int refcount;              /* The number of references to the buffer. */
+	int kind;                           /* The most important message kind in the buffer (LIRCD_MESSAGE_*). */
+	unsigned long key;                  /* The key of the buffer's messages (LIRCD_KEY_NONE when they are not all for one key). */
+	unsigned int count;                 /* The number of messages in the buffer. */
+	size_t len;                         /* The length of the messages in the buffer. */
+	size_t size;                        /* The size of the buffer. */
+	char data[];                        /* The messages. */
+};
+
+/*
+ * The 'lircd_frame_message' structure describes one message of the current
+ * frame, so that the messages a client has subscribed to can be picked out of
+ * the frame without parsing them.
+ */
+struct lircd_frame_message {
+	size_t offset;                      /* The message's offset in the frame buffer. */
+	size_t len;                         /* The message's length. */
+	size_t time_offset;                 /* The message's offset in the time stamped frame buffer. */
+	size_t time_len;                    /* The time stamped message's length. */
+	unsigned int remote_id;             /* The remote's index in the list of remote names. */
+	__u16 code;                         /* The key code. */
+	int kind;                           /* The message kind (LIRCD_MESSAGE_*). */
+	const struct lircd_message *message;/* The message's template. */
+};
+
+/*
+ * The 'lircd_filter' structure holds a client's subscription. Remotes are
+ * matched with a bit mask indexed by remote id, and the key names are matched
+ * against the button globs once per key code, the first time the key code is
+ * sent, and the result is kept in a bit mask indexed by key code.
+ */
+struct lircd_filter {
+	uint64_t *remote;                   /* The subscribed remote ids (NULL for all remotes). */
+	size_t remote_words;                /* The number of words in the remote mask. */
+	char **remote_name;                 /* The subscribed remote names that have no id in the mask yet. */
+	size_t remote_name_count;           /* The number of remote names that have no id in the mask yet. */
+	char **button;                      /* The button globs. */
+	size_t button_count;                /* The number of button globs (0 for all buttons). */
+	uint64_t known[(KEY_CNT + 63) / 64];/* The key codes whose names have been matched. */
+	uint64_t match[(KEY_CNT + 63) / 64];/* The key codes whose names match a glob. */
+	unsigned int kind;                  /* The subscribed message kinds (1 << LIRCD_MESSAGE_*). */
+};
+
 /*
  * The 'lircd' structure contains the information associated with the lircd
  * socket. In particular, it contains a linked list of 'lircd_client'
  * structures, each of which contains information associated with one connected
- * lirc client.
+ * lirc client. Each client has a bounded queue of messages that could not be
+ * written without blocking. The queue is flushed when monitor reports that the
+ * client is ready for writing.
  */
 struct lircd_client {
 	int fd;
+	struct lircd_output *output;        /* The output whose socket the client connected to. */
+	bool binary;                        /* The client is connected to the binary event socket. */
+	bool tcp;                           /* The client is connected to the TCP socket. */
+	bool timestamps;                    /* The client gets time stamped messages (OPTION timestamps=on). */
+	struct ucred cred;                  /* The client's process, user and group (SO_PEERCRED). */
+	struct {                            /* The client's output queue. */
+		struct lircd_buffer **ring; /* The ring of queued buffers. */
+		size_t head;                /* The index of the oldest queued buffer. */
+		size_t count;               /* The number of queued buffers. */
+		size_t offset;              /* The number of bytes of the oldest buffer already written. */
+	} queue;
+	struct {                            /* The client's counters. */
+		unsigned long sent;         /* The number of messages written. */
+		unsigned long queued;       /* The number of messages queued. */
+		unsigned long dropped;      /* The number of messages dropped. */
+		unsigned long coalesced;    /* The number of queued key repeats replaced by a newer one. */
+		size_t queue_max;           /* The largest number of buffers queued at once. */
+	} stats;
+	struct {                            /* The command line being read from the client. */
+		char data[LIRCD_COMMAND_MAX];
+		size_t len;
+		bool discard;               /* The line is too long and is being discarded. */
+	} command;
+	struct lircd_filter *filter;        /* The client's subscription (NULL for all messages). */
+	int ring_fd;                        /* The eventfd that wakes the client up for the event ring (-1 for none). */
 	struct lircd_client *next;
 };
 
-struct {
+struct lircd_client_slab {
+	struct lircd_client client[LIRCD_CLIENT_SLAB];
+	struct lircd_client_slab *next;
+	struct lircd_buffer *ring[];        /* The queue rings of the slab's clients. */
+};
+
+/*
+ * The 'lircd_output' structure holds one lircd socket: its clients, its key
+ * release suffix and lircrc file, and the frames being assembled for its
+ * clients. The first output is the default output, which gets the input
+ * devices that udev does not route to a named output.
+ */
+struct lircd_output {
+	char *name;
 	int fd;
+	bool inherited;                     /* The socket was passed by a service manager. */
 	char *path;
 	mode_t mode;
 	char *release_suffix;
+	int binary_fd;                      /* The binary event socket. */
+	char *binary_path;
+	int tcp_fd;                         /* The TCP socket. */
 	struct lircd_client *client_list;
-	struct lirc_config *lirc_client_config;
+	struct lircd_buffer *frame;         /* The buffer in which the current frame's messages are assembled. */
+	struct lircd_frame_message frame_message[LIRCD_FRAME_MESSAGE_MAX];
+	struct lircd_buffer *binary_frame;  /* The buffer in which the current frame's binary records are assembled. */
+	struct lircd_buffer *time_frame;    /* The buffer in which the current frame's time stamped messages are assembled. */
+	unsigned int time_client_count;     /* The number of clients that get time stamped messages. */
+	struct lircrc *lircrc;
+	bool reload;                        /* The output's lircrc file is being reloaded. */
+	struct lircrc *reload_lircrc;       /* The reloaded lircrc file (NULL for none). */
+	struct lircd_output *next;
+};
+
+struct {
+	struct lircd_output *output_list;   /* The outputs, starting with the default output. */
+	struct lircd_device *device_list;   /* The input devices' lircd state, for reloading lircrc files. */
+	size_t client_queue_size;
+	int backlog;
+	struct lircd_client *client_free_list;
+	struct lircd_client_slab *client_slab_list;
+	unsigned int device_id;             /* The id of the next lircd device. */
+	char **remote;                      /* The remote names, indexed by remote id. */
+	unsigned int remote_count;
 } eventlircd_lircd = {
-	.fd = -1,
-	.path = NULL,
-	.mode = 0,
-	.release_suffix = NULL,
-	.client_list = NULL,
-	.lirc_client_config = NULL
+	.output_list = NULL,
+	.device_list = NULL,
+	.client_queue_size = LIRCD_CLIENT_QUEUE_DEFAULT,
+	.backlog = LIRCD_BACKLOG_DEFAULT,
+	.client_free_list = NULL,
+	.client_slab_list = NULL,
+	.device_id = 0,
+	.remote = NULL,
+	.remote_count = 0
 };
 
-static int lircd_client_add()
+static struct lircd_buffer *lircd_buffer_new(size_t size)
 {
-	struct lircd_client *client;
-	int flags;
-
-	if (eventlircd_lircd.fd == -1) {
-		return -1;
-	}
-
-	if ((client = (struct lircd_client *)malloc(sizeof(struct lircd_client))) == NULL) {
-		syslog(LOG_ERR,
-		       "failed to allocate memory for lircd client: %s\n",
-		       strerror(errno));
-		return -1;
-	}
-
-	client->fd = accept(eventlircd_lircd.fd, NULL, NULL);
+	struct lircd_buffer *buffer;
 
-	if  (client->fd < 0) {
+	if ((buffer = malloc(sizeof(struct lircd_buffer) + size)) == NULL) {
 		syslog(LOG_ERR,
-		       "error during accept(): %s",
+		       "failed to allocate memory for lircd messages: %s\n",
 		       strerror(errno));
-		free(client);
-		return -1;
+		return NULL;
 	}
 
-	flags = fcntl(client->fd, F_GETFL);
-	fcntl(client->fd, F_SETFL, flags | O_NONBLOCK);
-
-	client->next = eventlircd_lircd.client_list;
-	eventlircd_lircd.client_list = client;
+	buffer->refcount = 1;
+	buffer->kind = LIRCD_MESSAGE_REPEAT;
+	buffer->key = LIRCD_KEY_NONE;
+	buffer->count = 0;
+	buffer->len = 0;
+	buffer->size = size;
 
-	return 0;
+	return buffer;
 }
 
-static int lircd_handler(void* UNUSED(id), int UNUSED(ready), struct timeval* UNUSED(now))
+static void lircd_buffer_unref(struct lircd_buffer *buffer)
 {
-	if (lircd_client_add() != 0) {
-		return -1;
+	if (buffer == NULL) {
+		return;
 	}
 
-	return 0;
+	buffer->refcount--;
+	if (buffer->refcount == 0) {
+		free(buffer);
+	}
 }
 
-static int lircd_client_close(struct lircd_client *client)
+static struct lircd_buffer **lircd_client_queue_at(struct lircd_client *client, size_t index)
 {
-	if (client == NULL) {
-		return -1;
-	}
-
-	if (client->fd >= 0) {
-		shutdown(client->fd, 2);
-		close(client->fd);
-		client->fd = -1;
-	}
-
-	return 0;
+	return &(client->queue.ring[(client->queue.head + index) % eventlircd_lircd.client_queue_size]);
 }
 
-static int lircd_client_purge()
+/*
+ * Remove the queued buffer at 'index' (0 is the oldest) by moving the newer
+ * buffers down one place.
+ */
+static void lircd_client_queue_remove(struct lircd_client *client, size_t index)
 {
-	struct lircd_client **client_ptr;
-	struct lircd_client *client;
-	int return_code;
+	size_t i;
 
-	return_code = 0;
-
-	client_ptr = &(eventlircd_lircd.client_list);
-	while (*client_ptr != NULL) {
-		client = *client_ptr;
-		if (client->fd == -1) {
-			*client_ptr = client->next;
-			if (lircd_client_close(client) != 0) {
-				return_code = -1;
-			}
-			free(client);
-		} else {
-			client_ptr = &((*client_ptr)->next);
-		}
+	lircd_buffer_unref(*lircd_client_queue_at(client, index));
+	for (i = index ; i + 1 < client->queue.count ; i++) {
+		*lircd_client_queue_at(client, i) = *lircd_client_queue_at(client, i + 1);
 	}
-	return return_code;
+	client->queue.count--;
+	*lircd_client_queue_at(client, client->queue.count) = NULL;
 }
 
-int lircd_exit()
+/*
+ * Append a buffer to the client's queue. A buffer of key repeats of one key
+ * replaces a buffer of key repeats of the same key at the tail of the queue,
+ * as a client that has fallen behind only needs the newest repeat count. When
+ * the queue is full, the oldest queued buffer holding only key repeats is
+ * dropped to make room. If there is none, then a new buffer of key repeats is
+ * dropped instead. Key presses and key releases are never dropped, so a queue
+ * that is full of them means that the client has stopped reading, and the
+ * caller should disconnect it.
+ */
+static int lircd_client_queue_push(struct lircd_client *client, struct lircd_buffer *buffer)
 {
-	struct lircd_client *client;
-	int return_code;
+	struct lircd_buffer **tail;
+	size_t i;
 
-	return_code = 0;
-
-	if (eventlircd_lircd.fd >= 0) {
-		if (monitor_client_remove(eventlircd_lircd.fd) != 0) {
-			return_code = -1;
+	/*
+	 * A partially written buffer cannot be replaced.
+	 */
+	if ((buffer->kind == LIRCD_MESSAGE_REPEAT) &&
+	    (buffer->key != LIRCD_KEY_NONE) &&
+	    (client->queue.count > ((client->queue.offset > 0) ? 1U : 0U))) {
+		tail = lircd_client_queue_at(client, client->queue.count - 1);
+		if (((*tail)->kind == LIRCD_MESSAGE_REPEAT) && ((*tail)->key == buffer->key)) {
+			client->stats.coalesced += (*tail)->count;
+			lircd_buffer_unref(*tail);
+			buffer->refcount++;
+			*tail = buffer;
+			client->stats.queued += buffer->count;
+			return 0;
 		}
-		close(eventlircd_lircd.fd);
-		eventlircd_lircd.fd = -1;
 	}
 
-	for (client = eventlircd_lircd.client_list ; client != NULL ; client = client->next) {
-		if (lircd_client_close(client) != 0) {
-			return_code = -1;
+	if (client->queue.count == eventlircd_lircd.client_queue_size) {
+		/*
+		 * A partially written buffer cannot be dropped.
+		 */
+		for (i = (client->queue.offset > 0) ? 1 : 0 ; i < client->queue.count ; i++) {
+			if ((*lircd_client_queue_at(client, i))->kind == LIRCD_MESSAGE_REPEAT) {
+				break;
+			}
+		}
+		if (i < client->queue.count) {
+			client->stats.dropped += (*lircd_client_queue_at(client, i))->count;
+			lircd_client_queue_remove(client, i);
+		} else if (buffer->kind == LIRCD_MESSAGE_REPEAT) {
+			client->stats.dropped += buffer->count;
+			return 0;
+		} else {
+			syslog(LOG_WARNING,
+			       "lircd client %d: output queue is full\n",
+			       client->fd);
+			return -1;
 		}
-	}
-	if (lircd_client_purge() != 0) {
-		return_code = -1;
 	}
 
-	if (eventlircd_lircd.path != NULL) {
-		unlink(eventlircd_lircd.path);
-		free(eventlircd_lircd.path);
-		eventlircd_lircd.path = NULL;
+	if (client->queue.count == 0) {
+		if (monitor_client_write(client->fd, true) != 0) {
+			return -1;
+		}
 	}
 
-	if (eventlircd_lircd.lirc_client_config != NULL) {
-		lirc_freeconfig(eventlircd_lircd.lirc_client_config);
-		eventlircd_lircd.lirc_client_config = NULL;
+	buffer->refcount++;
+	*lircd_client_queue_at(client, client->queue.count) = buffer;
+	client->queue.count++;
+	client->stats.queued += buffer->count;
+	if (client->stats.queue_max < client->queue.count) {
+		client->stats.queue_max = client->queue.count;
 	}
 
-	return return_code;
+	return 0;
 }
 
-int lircd_init(const char *path, mode_t mode, const char *release_suffix, const char *lirc_client_config_file)
+/*
+ * Write data to a client without blocking. A text client gets the data as one
+ * stream write. The data for a binary client is made of records, each of
+ * which is sent as its own packet, all with one sendmmsg(). It returns the
+ * number of bytes written.
+ */
+static ssize_t lircd_client_write(struct lircd_client *client, struct iovec *iov, size_t iov_count)
 {
-	struct sockaddr_un addr;
+	struct mmsghdr packet[LIRCD_CLIENT_IOV_MAX];
+	struct iovec record[LIRCD_CLIENT_IOV_MAX];
+	struct msghdr msg;
+	unsigned int count;
+	size_t offset;
+	size_t i;
+	int n;
 
-	eventlircd_lircd.fd = -1;
-	eventlircd_lircd.path = NULL;
-	eventlircd_lircd.mode = 0;
-	eventlircd_lircd.release_suffix = NULL;
-	eventlircd_lircd.client_list = NULL;
+	if (client->binary == false) {
+		memset(&msg, 0, sizeof msg);
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iov_count;
+		return sendmsg(client->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	}
 
-	if (path == NULL) {
-		errno = EINVAL;
-		return -1;
+	count = 0;
+	for (i = 0 ; (i < iov_count) && (count < LIRCD_CLIENT_IOV_MAX) ; i++) {
+		for (offset = 0 ; (offset + sizeof(struct lircd_record) <= iov[i].iov_len) && (count < LIRCD_CLIENT_IOV_MAX) ; offset += sizeof(struct lircd_record)) {
+			record[count].iov_base = (char *)iov[i].iov_base + offset;
+			record[count].iov_len = sizeof(struct lircd_record);
+			memset(&packet[count], 0, sizeof packet[count]);
+			packet[count].msg_hdr.msg_iov = &record[count];
+			packet[count].msg_hdr.msg_iovlen = 1;
+			count++;
+		}
 	}
 
-	if (strnlen(path, PATH_MAX + 1) >= PATH_MAX + 1) {
-		errno = ENAMETOOLONG;
-		syslog(LOG_ERR,
-		       "lircd socket path: %s\n",
-		       strerror(errno));
+	n = sendmmsg(client->fd, packet, count, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (n < 0) {
 		return -1;
 	}
 
-    	if (lirc_client_config_file != NULL && lirc_readconfig_only(lirc_client_config_file, &eventlircd_lircd.lirc_client_config, NULL) == -1) {
-		syslog(LOG_ERR, "failed to read lirc config file %s\n", lirc_client_config_file);
-		return -1;
-    	}
+	return (ssize_t)((size_t)n * sizeof(struct lircd_record));
+}
 
-	if ((eventlircd_lircd.path = strndup(path, PATH_MAX)) == NULL) {
-		syslog(LOG_ERR,
-		       "failed to allocate memory for the lircd device %s: %s\n",
-		       path,
-		       strerror(errno));
-		lircd_exit();
-		return -1;
-	}
+/*
+ * Write as much of the client's queue as the client will take without blocking.
+ */
+static int lircd_client_flush(struct lircd_client *client)
+{
+	struct iovec iov[LIRCD_CLIENT_IOV_MAX];
+	struct lircd_buffer *buffer;
+	size_t iov_count;
+	ssize_t n;
+	size_t len;
+	size_t total;
 
-	eventlircd_lircd.mode = mode;
+	while (client->queue.count > 0) {
+		total = 0;
+		for (iov_count = 0 ; (iov_count < client->queue.count) && (iov_count < LIRCD_CLIENT_IOV_MAX) ; iov_count++) {
+			buffer = *lircd_client_queue_at(client, iov_count);
+			iov[iov_count].iov_base = buffer->data;
+			iov[iov_count].iov_len = buffer->len;
+			total += buffer->len;
+		}
+		iov[0].iov_base = (char *)iov[0].iov_base + client->queue.offset;
+		iov[0].iov_len -= client->queue.offset;
+		total -= client->queue.offset;
 
-	if (release_suffix != NULL) {
-		if ((eventlircd_lircd.release_suffix = strndup(release_suffix, 128)) == NULL) {
-			syslog(LOG_ERR,
-			       "failed to allocate memory for the lircd device %s: %s\n",
-			       path,
-			       strerror(errno));
-			lircd_exit();
+		n = lircd_client_write(client, iov, iov_count);
+		if (n < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) {
+				return 0;
+			}
 			return -1;
 		}
+
+		/*
+		 * Pop the buffers that have been completely written.
+		 */
+		len = (size_t)n + client->queue.offset;
+		while ((client->queue.count > 0) && (len >= (*lircd_client_queue_at(client, 0))->len)) {
+			len -= (*lircd_client_queue_at(client, 0))->len;
+			client->stats.sent += (*lircd_client_queue_at(client, 0))->count;
+			lircd_client_queue_remove(client, 0);
+		}
+		client->queue.offset = len;
+
+		/*
+		 * The client did not take everything, so wait until it is
+		 * ready for writing again.
+		 */
+		if ((size_t)n < total) {
+			break;
+		}
 	}
 
-	if (unlink(eventlircd_lircd.path) != 0) {
-		if (errno != ENOENT) {
-			syslog(LOG_ERR,
-			       "failed to remove existing lircd socket %s: %s\n",
-			       path,
-			       strerror(errno));
-			lircd_exit();
+	if (client->queue.count == 0) {
+		if (monitor_client_write(client->fd, false) != 0) {
 			return -1;
 		}
 	}
 
-	eventlircd_lircd.fd = socket(AF_UNIX, SOCK_STREAM, 0);
-	if (eventlircd_lircd.fd < 0) {
-		syslog(LOG_ERR,
-		       "failed to create Unix socket for lircd output: %s\n",
-		       strerror(errno));
-		lircd_exit();
-		return -1;
+	return 0;
+}
+
+/*
+ * Send a buffer to the client. If nothing is queued for the client, then the
+ * buffer is written straight away with a single write and the client only
+ * keeps a reference to it if it did not take all of it. Otherwise the buffer
+ * is queued behind the buffers already waiting.
+ */
+static int lircd_client_send(struct lircd_client *client, struct lircd_buffer *buffer)
+{
+	struct iovec iov;
+	ssize_t n;
+
+	n = 0;
+	if (client->queue.count == 0) {
+		iov.iov_base = buffer->data;
+		iov.iov_len = buffer->len;
+		n = lircd_client_write(client, &iov, 1);
+		if (n == (ssize_t)buffer->len) {
+			client->stats.sent += buffer->count;
+			return 0;
+		}
+		if (n < 0) {
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+				return -1;
+			}
+			n = 0;
+		}
 	}
 
-	addr.sun_family = AF_UNIX;
-	strcpy(addr.sun_path, eventlircd_lircd.path);
-	if(bind(eventlircd_lircd.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-		syslog(LOG_ERR,
-		       "failed to bind to Unix socket needed for lircd output; %s\n",
-		       strerror(errno));
-		lircd_exit();
+	if (lircd_client_queue_push(client, buffer) != 0) {
 		return -1;
 	}
+	/*
+	 * A partially written buffer is always the only buffer in the queue.
+	 */
+	if (n > 0) {
+		client->queue.offset = (size_t)n;
+	}
 
-	chmod(eventlircd_lircd.path, mode);
+	return 0;
+}
 
-	if (listen(eventlircd_lircd.fd, 3) < 0) {
-		syslog(LOG_ERR,
-		       "failed to listen on Unix socket needed for lircd output: %s\n",
-		       strerror(errno));
-		lircd_exit();
+static int lircd_client_close(struct lircd_client *client)
+{
+	if (client == NULL) {
 		return -1;
 	}
 
-	if (monitor_client_add(eventlircd_lircd.fd, &lircd_handler, NULL) != 0) {
-		syslog(LOG_ERR,
-		       "failed to add lircd to the monitor client list: %s\n",
-		       strerror(errno));
-		lircd_exit();
-		return -1;
+	if (client->fd >= 0) {
+		syslog(LOG_DEBUG,
+		       "lircd client %d (pid %ld): closed: sent %lu, queued %lu, dropped %lu, coalesced %lu, max queue %lu\n",
+		       client->fd,
+		       (long)client->cred.pid,
+		       client->stats.sent,
+		       client->stats.queued,
+		       client->stats.dropped,
+		       client->stats.coalesced,
+		       (unsigned long)client->stats.queue_max);
+		monitor_client_remove(client->fd);
+		shutdown(client->fd, 2);
+		close(client->fd);
+		client->fd = -1;
+	}
+	if (client->ring_fd != -1) {
+		close(client->ring_fd);
+		client->ring_fd = -1;
+	}
+	if (client->timestamps == true) {
+		client->timestamps = false;
+		client->output->time_client_count--;
 	}
 
 	return 0;
 }
 
-int lircd_send(const struct input_event *event, const char *name, unsigned int repeat_count, const char *remote)
+static struct lircd_client *lircd_client_alloc()
 {
-	char message[1000];
-	int message_len;
+	struct lircd_client_slab *slab;
 	struct lircd_client *client;
-	char *cmd, *prog;
-	int forward;
+	struct lircd_buffer **ring;
+	size_t i;
 
-	if (event == NULL) {
-		errno = EINVAL;
-		return -1;
+	if (eventlircd_lircd.client_free_list == NULL) {
+		if ((slab = calloc(1, sizeof(struct lircd_client_slab) +
+		                      LIRCD_CLIENT_SLAB * eventlircd_lircd.client_queue_size * sizeof(struct lircd_buffer *))) == NULL) {
+			syslog(LOG_ERR,
+			       "failed to allocate memory for lircd clients: %s\n",
+			       strerror(errno));
+			return NULL;
+		}
+		for (i = 0 ; i < LIRCD_CLIENT_SLAB ; i++) {
+			slab->client[i].fd = -1;
+			slab->client[i].ring_fd = -1;
+			slab->client[i].queue.ring = &(slab->ring[i * eventlircd_lircd.client_queue_size]);
+			slab->client[i].next = eventlircd_lircd.client_free_list;
+			eventlircd_lircd.client_free_list = &(slab->client[i]);
+		}
+		slab->next = eventlircd_lircd.client_slab_list;
+		eventlircd_lircd.client_slab_list = slab;
 	}
-	if (name == NULL) {
-		errno = EINVAL;
-		return -1;
+
+	client = eventlircd_lircd.client_free_list;
+	eventlircd_lircd.client_free_list = client->next;
+
+	ring = client->queue.ring;
+	memset(client, 0, sizeof(struct lircd_client));
+	client->fd = -1;
+	client->ring_fd = -1;
+	client->queue.ring = ring;
+
+	return client;
+}
+
+/*
+ * Return a client record to the free list. Its queue must be empty.
+ */
+static void lircd_client_free(struct lircd_client *client)
+{
+	client->next = eventlircd_lircd.client_free_list;
+	eventlircd_lircd.client_free_list = client;
+}
+
+/*
+ * Return the id of a remote name, or -1 if no device has used the name.
+ */
+static int lircd_remote_find(const char *remote)
+{
+	unsigned int i;
+
+	for (i = 0 ; i < eventlircd_lircd.remote_count ; i++) {
+		if (strcmp(eventlircd_lircd.remote[i], remote) == 0) {
+			return (int)i;
+		}
 	}
-	if (remote == NULL) {
-		errno = EINVAL;
-		return -1;
+
+	return -1;
+}
+
+/*
+ * Return the id of a remote name, adding the name if it is new.
+ */
+static int lircd_remote_id(const char *remote)
+{
+	char **list;
+	int id;
+
+	if ((id = lircd_remote_find(remote)) != -1) {
+		return id;
 	}
 
-	if ((event->value == 0) && (eventlircd_lircd.release_suffix == NULL)) {
-		return 0;
+	if ((list = realloc(eventlircd_lircd.remote, (eventlircd_lircd.remote_count + 1) * sizeof(char *))) == NULL) {
+		goto nomem;
+	}
+	eventlircd_lircd.remote = list;
+	if ((eventlircd_lircd.remote[eventlircd_lircd.remote_count] = strndup(remote, PATH_MAX)) == NULL) {
+		goto nomem;
 	}
 
-	/*
-	 * If this is a key release, so append the key release suffix.
-	 */
-	if (event->value == 0) {
-		message_len = snprintf(message,
-		                       sizeof message,
-		                       "%x %x %s%s %s\n",
-		                       (unsigned int)event->code,
-		                       repeat_count,
-		                       name,
-		                       eventlircd_lircd.release_suffix,
-		                       remote);
-	} else {
-		message_len = snprintf(message, sizeof message, "%x %x %s %s\n",
-		                       (unsigned int)event->code,
-		                       repeat_count,
-		                       name,
-		                       remote);
+	return (int)eventlircd_lircd.remote_count++;
+
+nomem:
+	syslog(LOG_ERR,
+	       "failed to allocate memory for lircd remote %s: %s\n",
+	       remote,
+	       strerror(errno));
+	return -1;
+}
+
+static void lircd_filter_free(struct lircd_filter *filter)
+{
+	size_t i;
+
+	if (filter == NULL) {
+		return;
 	}
 
-	if (message_len > 0) {
-		if (eventlircd_lircd.lirc_client_config != NULL) {
-			syslog(LOG_DEBUG, "lircd message: %s", message);
-			forward = 0;
-			for (;;) {
-				cmd = prog = NULL;
-				if (lirc_code2charprog(eventlircd_lircd.lirc_client_config, message, &cmd, &prog) == -1) {
-					errno = EINVAL;
-					return -1;
-				}
-				if (cmd == NULL) {
-					break;
-				}
-				if (forward == 0) {
-					forward = 1;
+	for (i = 0 ; i < filter->button_count ; i++) {
+		free(filter->button[i]);
+	}
+	free(filter->button);
+	for (i = 0 ; i < filter->remote_name_count ; i++) {
+		free(filter->remote_name[i]);
+	}
+	free(filter->remote_name);
+	free(filter->remote);
+	free(filter);
+}
+
+/*
+ * Add a remote id to a filter's remote mask.
+ */
+static int lircd_filter_remote_add(struct lircd_filter *filter, unsigned int id)
+{
+	uint64_t *remote;
+	size_t words;
+
+	words = (size_t)id / 64 + 1;
+	if (words > filter->remote_words) {
+		if ((remote = realloc(filter->remote, words * sizeof(uint64_t))) == NULL) {
+			return -1;
+		}
+		memset(remote + filter->remote_words, 0, (words - filter->remote_words) * sizeof(uint64_t));
+		filter->remote = remote;
+		filter->remote_words = words;
+	}
+	filter->remote[id / 64] |= (uint64_t)1 << (id % 64);
+
+	return 0;
+}
+
+/*
+ * Parse the arguments of a SUBSCRIBE command into a filter. The arguments are
+ * any of "remote=<name>[,<name>...]", "button=<glob>[,<glob>...]" and
+ * "type=<type>[,<type>...]", where <type> is press, repeat or release. A
+ * missing argument matches everything. On error, '*error' is set to the
+ * reason.
+ *
+ * Clients are not trusted, so remote names are only looked up. A name that
+ * no device has used yet is kept in the filter and matched by name once a
+ * device with that remote shows up, rather than added to the remote list.
+ */
+static struct lircd_filter *lircd_filter_new(char *args, const char **error)
+{
+	struct lircd_filter *filter;
+	char **remote_name;
+	char **button;
+	char *arg;
+	char *arg_state;
+	char *value;
+	char *item;
+	char *item_state;
+	int id;
+
+	*error = "out of memory";
+
+	if ((filter = calloc(1, sizeof(struct lircd_filter))) == NULL) {
+		return NULL;
+	}
+	filter->kind = (1U << LIRCD_MESSAGE_RELEASE) | (1U << LIRCD_MESSAGE_PRESS) | (1U << LIRCD_MESSAGE_REPEAT);
+
+	if (args == NULL) {
+		return filter;
+	}
+
+	for (arg = strtok_r(args, " \t", &arg_state) ; arg != NULL ; arg = strtok_r(NULL, " \t", &arg_state)) {
+		if ((value = strchr(arg, '=')) == NULL) {
+			*error = "bad argument";
+			goto fail;
+		}
+		*value++ = '\0';
+		if (strcasecmp(arg, "remote") == 0) {
+			for (item = strtok_r(value, ",", &item_state) ; item != NULL ; item = strtok_r(NULL, ",", &item_state)) {
+				if ((id = lircd_remote_find(item)) != -1) {
+					if (lircd_filter_remote_add(filter, (unsigned int)id) != 0) {
+						goto fail;
+					}
+					continue;
+				}
+				if ((remote_name = realloc(filter->remote_name, (filter->remote_name_count + 1) * sizeof(char *))) == NULL) {
+					goto fail;
+				}
+				filter->remote_name = remote_name;
+				if ((filter->remote_name[filter->remote_name_count] = strdup(item)) == NULL) {
+					goto fail;
+				}
+				filter->remote_name_count++;
+			}
+		} else if (strcasecmp(arg, "button") == 0) {
+			for (item = strtok_r(value, ",", &item_state) ; item != NULL ; item = strtok_r(NULL, ",", &item_state)) {
+				if ((button = realloc(filter->button, (filter->button_count + 1) * sizeof(char *))) == NULL) {
+					goto fail;
+				}
+				filter->button = button;
+				if ((filter->button[filter->button_count] = strdup(item)) == NULL) {
+					goto fail;
+				}
+				filter->button_count++;
+			}
+		} else if (strcasecmp(arg, "type") == 0) {
+			filter->kind = 0;
+			for (item = strtok_r(value, ",", &item_state) ; item != NULL ; item = strtok_r(NULL, ",", &item_state)) {
+				if (strcasecmp(item, "press") == 0) {
+					filter->kind |= 1U << LIRCD_MESSAGE_PRESS;
+				} else if (strcasecmp(item, "repeat") == 0) {
+					filter->kind |= 1U << LIRCD_MESSAGE_REPEAT;
+				} else if (strcasecmp(item, "release") == 0) {
+					filter->kind |= 1U << LIRCD_MESSAGE_RELEASE;
+				} else {
+					*error = "bad type";
+					goto fail;
+				}
+			}
+		} else {
+			*error = "bad argument";
+			goto fail;
+		}
+	}
+
+	return filter;
+
+fail:
+	lircd_filter_free(filter);
+	return NULL;
+}
+
+/*
+ * Test whether a message of the current frame passes a client's filter.
+ */
+static bool lircd_filter_match(struct lircd_filter *filter, const struct lircd_frame_message *message)
+{
+	char name[LIRCD_MESSAGE_MAX];
+	size_t word;
+	uint64_t bit;
+	size_t i;
+
+	if ((filter->kind & (1U << message->kind)) == 0) {
+		return false;
+	}
+
+	if ((filter->remote != NULL) || (filter->remote_name_count > 0)) {
+		word = message->remote_id / 64;
+		bit = (uint64_t)1 << (message->remote_id % 64);
+		if ((word >= filter->remote_words) || ((filter->remote[word] & bit) == 0)) {
+			/*
+			 * The remote may be one that was subscribed by name before
+			 * it had an id. If so, remember its id and forget the name,
+			 * so that later messages only test the mask. If the mask
+			 * cannot grow, the name is kept and matched again.
+			 */
+			for (i = 0 ; i < filter->remote_name_count ; i++) {
+				if (strcmp(filter->remote_name[i], eventlircd_lircd.remote[message->remote_id]) == 0) {
+					break;
+				}
+			}
+			if (i == filter->remote_name_count) {
+				return false;
+			}
+			if (lircd_filter_remote_add(filter, message->remote_id) == 0) {
+				free(filter->remote_name[i]);
+				filter->remote_name[i] = filter->remote_name[--filter->remote_name_count];
+			}
+		}
+	}
+
+	if (filter->button_count == 0) {
+		return true;
+	}
+
+	word = message->code / 64;
+	bit = (uint64_t)1 << (message->code % 64);
+	if ((filter->known[word] & bit) == 0) {
+		filter->known[word] |= bit;
+		memcpy(name, message->message->text + message->message->prefix_len + 1, message->message->name_len);
+		name[message->message->name_len] = '\0';
+		for (i = 0 ; i < filter->button_count ; i++) {
+			if (fnmatch(filter->button[i], name, 0) == 0) {
+				filter->match[word] |= bit;
+				break;
+			}
+		}
+	}
+
+	return (filter->match[word] & bit) != 0;
+}
+
+/*
+ * Send a reply to a client command in the lircd reply format. The reply goes
+ * through the client's queue so that it stays in order with the key messages,
+ * and it is never dropped.
+ */
+static int lircd_client_reply(struct lircd_client *client, const char *command, const char *error)
+{
+	struct lircd_buffer *buffer;
+	int len;
+	int rc;
+
+	if ((buffer = lircd_buffer_new(LIRCD_COMMAND_MAX + 64)) == NULL) {
+		return -1;
+	}
+	if (error == NULL) {
+		len = snprintf(buffer->data, buffer->size, "BEGIN\n%s\nSUCCESS\nEND\n", command);
+	} else {
+		len = snprintf(buffer->data, buffer->size, "BEGIN\n%s\nERROR\nDATA\n1\n%s\nEND\n", command, error);
+	}
+	buffer->len = (size_t)len;
+	buffer->kind = LIRCD_MESSAGE_PRESS;
+
+	rc = lircd_client_send(client, buffer);
+	lircd_buffer_unref(buffer);
+
+	return rc;
+}
+
+/*
+ * Hand the event ring's memfd and the client's eventfd to the client, attached
+ * to a successful reply. The descriptors cannot go through the client's queue,
+ * so the reply is only sent when nothing is queued for the client and is
+ * written straight away.
+ */
+static int lircd_client_ring(struct lircd_client *client, const char *command)
+{
+	char reply[LIRCD_COMMAND_MAX + 64];
+	union {
+		struct cmsghdr header;
+		char data[CMSG_SPACE(2 * sizeof(int))];
+	} control;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	struct lircd_buffer *buffer;
+	int fd[2];
+	int len;
+	ssize_t n;
+
+	if (ring_fd() == -1) {
+		return lircd_client_reply(client, command, "event ring not enabled");
+	}
+	if (client->tcp == true) {
+		return lircd_client_reply(client, command, "not available over TCP");
+	}
+	if (client->queue.count != 0) {
+		return lircd_client_reply(client, command, "output queue not empty");
+	}
+
+	if (client->ring_fd == -1) {
+		if ((client->ring_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
+			syslog(LOG_ERR,
+			       "lircd client %d: failed to create eventfd: %s\n",
+			       client->fd,
+			       strerror(errno));
+			return lircd_client_reply(client, command, "failed to create eventfd");
+		}
+	}
+
+	len = snprintf(reply, sizeof reply, "BEGIN\n%s\nSUCCESS\nEND\n", command);
+	iov.iov_base = reply;
+	iov.iov_len = (size_t)len;
+
+	fd[0] = ring_fd();
+	fd[1] = client->ring_fd;
+	memset(&control, 0, sizeof control);
+	memset(&msg, 0, sizeof msg);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.data;
+	msg.msg_controllen = sizeof control.data;
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof fd);
+	memcpy(CMSG_DATA(cmsg), fd, sizeof fd);
+
+	n = sendmsg(client->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (n < 0) {
+		if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)) {
+			return -1;
+		}
+		return lircd_client_reply(client, command, "try again");
+	}
+	syslog(LOG_DEBUG,
+	       "lircd client %d: event ring sent\n",
+	       client->fd);
+	if (n == len) {
+		return 0;
+	}
+
+	/*
+	 * The descriptors went with the first byte, so the rest of the reply
+	 * can be queued as usual.
+	 */
+	if ((buffer = lircd_buffer_new((size_t)len)) == NULL) {
+		return -1;
+	}
+	memcpy(buffer->data, reply, (size_t)len);
+	buffer->len = (size_t)len;
+	buffer->kind = LIRCD_MESSAGE_PRESS;
+	if (lircd_client_queue_push(client, buffer) != 0) {
+		lircd_buffer_unref(buffer);
+		return -1;
+	}
+	client->queue.offset = (size_t)n;
+	lircd_buffer_unref(buffer);
+
+	return 0;
+}
+
+/*
+ * Set a client option. The only option is "timestamps", which appends the
+ * event time and the dispatch time to every message sent to the client.
+ */
+static int lircd_client_option(struct lircd_client *client, char *args, const char *command)
+{
+	char *value;
+	bool timestamps;
+
+	if ((args == NULL) || ((value = strchr(args, '=')) == NULL)) {
+		return lircd_client_reply(client, command, "bad option");
+	}
+	*value++ = '\0';
+
+	if (strcasecmp(args, "timestamps") != 0) {
+		return lircd_client_reply(client, command, "unknown option");
+	}
+	if (strcasecmp(value, "on") == 0) {
+		timestamps = true;
+	} else if (strcasecmp(value, "off") == 0) {
+		timestamps = false;
+	} else {
+		return lircd_client_reply(client, command, "bad option value");
+	}
+
+	if (client->timestamps != timestamps) {
+		client->timestamps = timestamps;
+		if (timestamps == true) {
+			client->output->time_client_count++;
+		} else {
+			client->output->time_client_count--;
+		}
+	}
+
+	return lircd_client_reply(client, command, NULL);
+}
+
+/*
+ * Run one command line sent by a client.
+ */
+static int lircd_client_command(struct lircd_client *client, char *line)
+{
+	char echo[LIRCD_COMMAND_MAX];
+	struct lircd_filter *filter;
+	const char *error;
+	char *command;
+	char *args;
+	char *state;
+
+	snprintf(echo, sizeof echo, "%s", line);
+
+	if ((command = strtok_r(line, " \t", &state)) == NULL) {
+		return 0;
+	}
+	args = strtok_r(NULL, "", &state);
+
+	if (strcasecmp(command, "SUBSCRIBE") == 0) {
+		if ((filter = lircd_filter_new(args, &error)) == NULL) {
+			return lircd_client_reply(client, echo, error);
+		}
+		lircd_filter_free(client->filter);
+		client->filter = filter;
+		syslog(LOG_DEBUG,
+		       "lircd client %d: %s\n",
+		       client->fd,
+		       echo);
+		return lircd_client_reply(client, echo, NULL);
+	}
+
+	if (strcasecmp(command, "OPTION") == 0) {
+		return lircd_client_option(client, args, echo);
+	}
+
+	if ((strcasecmp(command, "RING") == 0) && (args == NULL)) {
+		return lircd_client_ring(client, echo);
+	}
+
+	return lircd_client_reply(client, echo, "unknown command");
+}
+
+/*
+ * Split what a client sent into command lines and run them.
+ */
+static int lircd_client_input(struct lircd_client *client, const char *data, size_t len)
+{
+	size_t i;
+
+	for (i = 0 ; i < len ; i++) {
+		if (data[i] == '\n') {
+			if ((client->command.len > 0) && (client->command.data[client->command.len - 1] == '\r')) {
+				client->command.len--;
+			}
+			client->command.data[client->command.len] = '\0';
+			client->command.len = 0;
+			if (client->command.discard == true) {
+				client->command.discard = false;
+				if (lircd_client_reply(client, client->command.data, "command too long") != 0) {
+					return -1;
+				}
+			} else if (lircd_client_command(client, client->command.data) != 0) {
+				return -1;
+			}
+		} else if (client->command.len < sizeof client->command.data - 1) {
+			client->command.data[client->command.len++] = data[i];
+		} else {
+			client->command.discard = true;
+		}
+	}
+
+	return 0;
+}
+
+static int lircd_client_purge()
+{
+	struct lircd_output *output;
+	struct lircd_client **client_ptr;
+	struct lircd_client *client;
+	int return_code;
+
+	return_code = 0;
+
+	for (output = eventlircd_lircd.output_list ; output != NULL ; output = output->next) {
+		client_ptr = &(output->client_list);
+		while (*client_ptr != NULL) {
+			client = *client_ptr;
+			if (client->fd == -1) {
+				*client_ptr = client->next;
+				if (lircd_client_close(client) != 0) {
+					return_code = -1;
+				}
+				while (client->queue.count > 0) {
+					lircd_client_queue_remove(client, 0);
+				}
+				lircd_filter_free(client->filter);
+				client->filter = NULL;
+				lircd_client_free(client);
+			} else {
+				client_ptr = &((*client_ptr)->next);
+			}
+		}
+	}
+	return return_code;
+}
+
+/*
+ * Most lirc clients do not send anything, but a client can send commands, such
+ * as SUBSCRIBE, one per line. Reading also notices that a client has gone
+ * away. When the client is ready for writing, its output queue is flushed.
+ */
+static int lircd_client_handler(void *id, int ready, struct timeval* UNUSED(now))
+{
+	struct lircd_client *client;
+	char buffer[256];
+	ssize_t n;
+
+	if (id == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	client = (struct lircd_client *)id;
+
+	if ((ready & MONITOR_READ) != 0) {
+		n = read(client->fd, buffer, sizeof buffer);
+		if ((n == 0) || ((n < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))) {
+			lircd_client_close(client);
+			return lircd_client_purge();
+		}
+		if ((n > 0) && (client->binary == false) && (lircd_client_input(client, buffer, (size_t)n) != 0)) {
+			lircd_client_close(client);
+			return lircd_client_purge();
+		}
+	}
+
+	if ((ready & MONITOR_WRITE) != 0) {
+		if (lircd_client_flush(client) != 0) {
+			lircd_client_close(client);
+			return lircd_client_purge();
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Accept one pending connection. It returns 1 when a client was added, 0 when
+ * there are no more pending connections and -1 on error.
+ */
+static int lircd_client_add(struct lircd_output *output, int listen_fd, bool binary)
+{
+	struct lircd_client *client;
+	socklen_t cred_len;
+	int fd;
+	int nodelay;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	char host[NI_MAXHOST];
+	char port[NI_MAXSERV];
+
+	if (listen_fd == -1) {
+		return -1;
+	}
+
+	fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+			return 0;
+		}
+		/*
+		 * The connection went away before it was accepted, so move on
+		 * to the next one.
+		 */
+		if ((errno == ECONNABORTED) || (errno == EINTR)) {
+			return 1;
+		}
+		syslog(LOG_ERR,
+		       "error during accept(): %s\n",
+		       strerror(errno));
+		return -1;
+	}
+
+	if ((client = lircd_client_alloc()) == NULL) {
+		close(fd);
+		return -1;
+	}
+	client->fd = fd;
+	client->output = output;
+	client->binary = binary;
+	client->tcp = (listen_fd == output->tcp_fd);
+
+	cred_len = sizeof client->cred;
+	if ((client->tcp == true) || (getsockopt(client->fd, SOL_SOCKET, SO_PEERCRED, &client->cred, &cred_len) != 0)) {
+		client->cred.pid = 0;
+		client->cred.uid = (uid_t)-1;
+		client->cred.gid = (gid_t)-1;
+	}
+
+	/*
+	 * Messages are small and sent as soon as a frame is complete, so do not
+	 * let Nagle's algorithm hold them back waiting for an acknowledgement.
+	 */
+	if (client->tcp == true) {
+		nodelay = 1;
+		if (setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof nodelay) != 0) {
+			syslog(LOG_WARNING,
+			       "lircd client %d: failed to set TCP_NODELAY: %s\n",
+			       client->fd,
+			       strerror(errno));
+		}
+		addr_len = sizeof addr;
+		if ((getpeername(client->fd, (struct sockaddr *)&addr, &addr_len) != 0) ||
+		    (getnameinfo((struct sockaddr *)&addr, addr_len, host, sizeof host, port, sizeof port, NI_NUMERICHOST | NI_NUMERICSERV) != 0)) {
+			strcpy(host, "?");
+			strcpy(port, "?");
+		}
+		syslog(LOG_DEBUG,
+		       "lircd client %d: connected to %s over TCP from %s port %s\n",
+		       client->fd,
+		       output->name,
+		       host,
+		       port);
+	}
+
+	if (monitor_client_add(client->fd, &lircd_client_handler, client) != 0) {
+		close(client->fd);
+		lircd_client_free(client);
+		return -1;
+	}
+
+	client->next = output->client_list;
+	output->client_list = client;
+
+	if (client->tcp == false) {
+		syslog(LOG_DEBUG,
+		       "lircd client %d: connected to %s%s: pid %ld, uid %ld, gid %ld\n",
+		       client->fd,
+		       output->name,
+		       (client->binary == true) ? " binary event socket" : "",
+		       (long)client->cred.pid,
+		       (long)client->cred.uid,
+		       (long)client->cred.gid);
+	}
+
+	return 1;
+}
+
+/*
+ * Accept every pending connection, so that clients connecting at the same
+ * time (such as at boot) are not left waiting in the listen backlog.
+ */
+static int lircd_handler(void *id, int UNUSED(ready), struct timeval* UNUSED(now))
+{
+	struct lircd_output *output;
+	int rc;
+
+	if (id == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	output = (struct lircd_output *)id;
+
+	while ((rc = lircd_client_add(output, output->fd, false)) == 1);
+
+	return rc;
+}
+
+static int lircd_binary_handler(void *id, int UNUSED(ready), struct timeval* UNUSED(now))
+{
+	struct lircd_output *output;
+	int rc;
+
+	if (id == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	output = (struct lircd_output *)id;
+
+	while ((rc = lircd_client_add(output, output->binary_fd, true)) == 1);
+
+	return rc;
+}
+
+static int lircd_tcp_handler(void *id, int UNUSED(ready), struct timeval* UNUSED(now))
+{
+	struct lircd_output *output;
+	int rc;
+
+	if (id == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	output = (struct lircd_output *)id;
+
+	while ((rc = lircd_client_add(output, output->tcp_fd, false)) == 1);
+
+	return rc;
+}
+
+static void lircd_stats(void)
+{
+	struct lircd_output *output;
+	struct lircd_client *client;
+
+	for (output = eventlircd_lircd.output_list ; output != NULL ; output = output->next) {
+		for (client = output->client_list ; client != NULL ; client = client->next) {
+			if (client->fd == -1) {
+				continue;
+			}
+			syslog(LOG_INFO,
+			       "lircd client %d (%s, pid %ld, uid %ld): sent %lu, queued %lu, dropped %lu, coalesced %lu, max queue %lu, queue %lu\n",
+			       client->fd,
+			       output->name,
+			       (long)client->cred.pid,
+			       (long)client->cred.uid,
+			       client->stats.sent,
+			       client->stats.queued,
+			       client->stats.dropped,
+			       client->stats.coalesced,
+			       (unsigned long)client->stats.queue_max,
+			       (unsigned long)client->queue.count);
+		}
+	}
+}
+
+/*
+ * Stop listening on an output's sockets and disconnect its clients. The
+ * clients are freed by the next lircd_client_purge().
+ */
+static int lircd_output_close(struct lircd_output *output)
+{
+	struct lircd_client *client;
+	int return_code;
+
+	return_code = 0;
+
+	if (output->fd >= 0) {
+		if (monitor_client_remove(output->fd) != 0) {
+			return_code = -1;
+		}
+		close(output->fd);
+		output->fd = -1;
+	}
+
+	if (output->binary_fd >= 0) {
+		if (monitor_client_remove(output->binary_fd) != 0) {
+			return_code = -1;
+		}
+		close(output->binary_fd);
+		output->binary_fd = -1;
+	}
+
+	if (output->tcp_fd >= 0) {
+		if (monitor_client_remove(output->tcp_fd) != 0) {
+			return_code = -1;
+		}
+		close(output->tcp_fd);
+		output->tcp_fd = -1;
+	}
+
+	for (client = output->client_list ; client != NULL ; client = client->next) {
+		if (lircd_client_close(client) != 0) {
+			return_code = -1;
+		}
+	}
+
+	return return_code;
+}
+
+/*
+ * Free a closed output without clients, removing its sockets.
+ */
+static void lircd_output_free(struct lircd_output *output)
+{
+	if (output->binary_path != NULL) {
+		unlink(output->binary_path);
+		free(output->binary_path);
+	}
+	if (output->path != NULL) {
+		if (output->inherited == false) {
+			unlink(output->path);
+		}
+		free(output->path);
+	}
+	free(output->release_suffix);
+	lircd_buffer_unref(output->frame);
+	lircd_buffer_unref(output->binary_frame);
+	lircd_buffer_unref(output->time_frame);
+	if (output->lircrc != NULL) {
+		lircrc_free(output->lircrc);
+	}
+	free(output->name);
+	free(output);
+}
+
+int lircd_exit()
+{
+	struct lircd_output *output;
+	struct lircd_client_slab *slab;
+	int return_code;
+
+	return_code = 0;
+
+	for (output = eventlircd_lircd.output_list ; output != NULL ; output = output->next) {
+		if (lircd_output_close(output) != 0) {
+			return_code = -1;
+		}
+	}
+	if (lircd_client_purge() != 0) {
+		return_code = -1;
+	}
+	while ((output = eventlircd_lircd.output_list) != NULL) {
+		eventlircd_lircd.output_list = output->next;
+		lircd_output_free(output);
+	}
+
+	while ((slab = eventlircd_lircd.client_slab_list) != NULL) {
+		eventlircd_lircd.client_slab_list = slab->next;
+		free(slab);
+	}
+	eventlircd_lircd.client_free_list = NULL;
+
+	while (eventlircd_lircd.remote_count > 0) {
+		free(eventlircd_lircd.remote[--eventlircd_lircd.remote_count]);
+	}
+	free(eventlircd_lircd.remote);
+	eventlircd_lircd.remote = NULL;
+
+	return return_code;
+}
+
+/*
+ * Adopt the listening socket passed by a service manager using the socket
+ * activation protocol: LISTEN_PID is eventlircd's pid and LISTEN_FDS is the
+ * number of sockets passed, starting at file descriptor 3. Only the first
+ * socket is used. The variables are removed so that sh commands do not
+ * inherit them.
+ */
+static int lircd_socket_inherit(struct lircd_output *output)
+{
+	const char *value;
+	char *end;
+	long pid;
+	long fds;
+	long i;
+	int fd;
+	int type;
+	int listening;
+	socklen_t len;
+	int flags;
+
+	if ((value = getenv("LISTEN_PID")) == NULL) {
+		return 0;
+	}
+	pid = strtol(value, &end, 10);
+	if ((*value == '\0') || (*end != '\0') || (pid != (long)getpid())) {
+		return 0;
+	}
+	if ((value = getenv("LISTEN_FDS")) == NULL) {
+		return 0;
+	}
+	fds = strtol(value, &end, 10);
+	if ((*value == '\0') || (*end != '\0') || (fds < 1) || (fds > INT_MAX - LIRCD_LISTEN_FDS_START)) {
+		return 0;
+	}
+
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	unsetenv("LISTEN_FDNAMES");
+
+	/*
+	 * The extra sockets are left open, in case one of them is also given
+	 * as another descriptor option, but are not passed on to sh commands.
+	 */
+	if (fds > 1) {
+		syslog(LOG_WARNING,
+		       "ignoring %ld extra sockets passed by the service manager\n",
+		       fds - 1);
+		for (i = 1 ; i < fds ; i++) {
+			fcntl(LIRCD_LISTEN_FDS_START + (int)i, F_SETFD, FD_CLOEXEC);
+		}
+	}
+	fd = LIRCD_LISTEN_FDS_START;
+
+	len = sizeof type;
+	if ((getsockopt(fd, SOL_SOCKET, SO_TYPE, &type, &len) != 0) || (type != SOCK_STREAM)) {
+		errno = ENOTSOCK;
+		syslog(LOG_ERR,
+		       "socket passed by the service manager is not a stream socket\n");
+		return -1;
+	}
+	len = sizeof listening;
+	if ((getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) != 0) || (listening == 0)) {
+		errno = EINVAL;
+		syslog(LOG_ERR,
+		       "socket passed by the service manager is not listening\n");
+		return -1;
+	}
+
+	flags = fcntl(fd, F_GETFL);
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	output->fd = fd;
+	output->inherited = true;
+
+	syslog(LOG_INFO,
+	       "using the lircd socket passed by the service manager\n");
+
+	return 0;
+}
+
+/*
+ * Create a Unix socket of the given type listening at 'path'. It returns the
+ * socket, or -1 on error.
+ */
+static int lircd_socket_listen(const char *path, int type, mode_t mode)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (unlink(path) != 0) {
+		if (errno != ENOENT) {
+			syslog(LOG_ERR,
+			       "failed to remove existing lircd socket %s: %s\n",
+			       path,
+			       strerror(errno));
+			return -1;
+		}
+	}
+
+	fd = socket(AF_UNIX, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		syslog(LOG_ERR,
+		       "failed to create Unix socket for lircd output: %s\n",
+		       strerror(errno));
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof addr.sun_path - 1);
+	if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		syslog(LOG_ERR,
+		       "failed to bind to Unix socket needed for lircd output; %s\n",
+		       strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	chmod(path, mode);
+
+	if (listen(fd, eventlircd_lircd.backlog) < 0) {
+		syslog(LOG_ERR,
+		       "failed to listen on Unix socket needed for lircd output: %s\n",
+		       strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Create an output and add it to the end of the output list. Only the default
+ * output, which is created first, can use a socket passed by a service manager
+ * and have a binary event socket.
+ */
+static struct lircd_output *lircd_output_new(const char *name, const char *path, mode_t mode, const char *release_suffix, const char *lirc_client_config_file, const char *binary_path)
+{
+	struct lircd_output *output;
+	struct lircd_output **output_ptr;
+
+	if ((name == NULL) || (path == NULL)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (strnlen(path, PATH_MAX + 1) >= PATH_MAX + 1) {
+		errno = ENAMETOOLONG;
+		syslog(LOG_ERR,
+		       "lircd socket path: %s\n",
+		       strerror(errno));
+		return NULL;
+	}
+
+	for (output_ptr = &(eventlircd_lircd.output_list) ; *output_ptr != NULL ; output_ptr = &((*output_ptr)->next)) {
+		if (strcmp((*output_ptr)->name, name) == 0) {
+			errno = EEXIST;
+			syslog(LOG_ERR,
+			       "lircd output %s: the name is already used\n",
+			       name);
+			return NULL;
+		}
+		if (strcmp((*output_ptr)->path, path) == 0) {
+			errno = EEXIST;
+			syslog(LOG_ERR,
+			       "lircd output %s: socket %s is already used by output %s\n",
+			       name,
+			       path,
+			       (*output_ptr)->name);
+			return NULL;
+		}
+	}
+
+	if ((output = calloc(1, sizeof(struct lircd_output))) == NULL) {
+		syslog(LOG_ERR,
+		       "failed to allocate memory for lircd output %s: %s\n",
+		       name,
+		       strerror(errno));
+		return NULL;
+	}
+	output->fd = -1;
+	output->binary_fd = -1;
+	output->tcp_fd = -1;
+	output->inherited = false;
+	output->mode = mode;
+
+	if (((output->name = strdup(name)) == NULL) ||
+	    ((output->path = strndup(path, PATH_MAX)) == NULL) ||
+	    ((release_suffix != NULL) && ((output->release_suffix = strndup(release_suffix, 128)) == NULL))) {
+		syslog(LOG_ERR,
+		       "failed to allocate memory for the lircd device %s: %s\n",
+		       path,
+		       strerror(errno));
+		lircd_output_free(output);
+		return NULL;
+	}
+
+	if ((lirc_client_config_file != NULL) && ((output->lircrc = lircrc_read(lirc_client_config_file)) == NULL)) {
+		syslog(LOG_ERR, "failed to read lirc config file %s\n", lirc_client_config_file);
+		lircd_output_free(output);
+		return NULL;
+	}
+
+	if (eventlircd_lircd.output_list == NULL) {
+		if (lircd_socket_inherit(output) != 0) {
+			lircd_output_free(output);
+			return NULL;
+		}
+	}
+	if (output->inherited == false) {
+		if ((output->fd = lircd_socket_listen(output->path, SOCK_STREAM, output->mode)) == -1) {
+			lircd_output_free(output);
+			return NULL;
+		}
+	}
+
+	if (monitor_client_add(output->fd, &lircd_handler, output) != 0) {
+		syslog(LOG_ERR,
+		       "failed to add lircd to the monitor client list: %s\n",
+		       strerror(errno));
+		lircd_output_close(output);
+		lircd_output_free(output);
+		return NULL;
+	}
+
+	/*
+	 * The binary event socket is optional.
+	 */
+	if (binary_path != NULL) {
+		if (strnlen(binary_path, PATH_MAX + 1) >= PATH_MAX + 1) {
+			errno = ENAMETOOLONG;
+			syslog(LOG_ERR,
+			       "lircd binary event socket path: %s\n",
+			       strerror(errno));
+			lircd_output_close(output);
+			lircd_output_free(output);
+			return NULL;
+		}
+		if ((output->binary_path = strndup(binary_path, PATH_MAX)) == NULL) {
+			syslog(LOG_ERR,
+			       "failed to allocate memory for the lircd binary event socket %s: %s\n",
+			       binary_path,
+			       strerror(errno));
+			lircd_output_close(output);
+			lircd_output_free(output);
+			return NULL;
+		}
+		if ((output->binary_fd = lircd_socket_listen(output->binary_path, SOCK_SEQPACKET, output->mode)) == -1) {
+			free(output->binary_path);
+			output->binary_path = NULL;
+			lircd_output_close(output);
+			lircd_output_free(output);
+			return NULL;
+		}
+		if (monitor_client_add(output->binary_fd, &lircd_binary_handler, output) != 0) {
+			syslog(LOG_ERR,
+			       "failed to add the lircd binary event socket to the monitor client list: %s\n",
+			       strerror(errno));
+			lircd_output_close(output);
+			lircd_output_free(output);
+			return NULL;
+		}
+	}
+
+	*output_ptr = output;
+
+	return output;
+}
+
+int lircd_init(const char *path, mode_t mode, const char *release_suffix, const char *lirc_client_config_file, size_t client_queue_size, int backlog, const char *binary_path)
+{
+	eventlircd_lircd.output_list = NULL;
+	eventlircd_lircd.client_queue_size = LIRCD_CLIENT_QUEUE_DEFAULT;
+	eventlircd_lircd.backlog = LIRCD_BACKLOG_DEFAULT;
+	eventlircd_lircd.client_free_list = NULL;
+	eventlircd_lircd.client_slab_list = NULL;
+
+	if (path == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (client_queue_size < 1) {
+		errno = EINVAL;
+		syslog(LOG_ERR,
+		       "lircd client queue size: %s\n",
+		       strerror(errno));
+		return -1;
+	}
+	eventlircd_lircd.client_queue_size = client_queue_size;
+
+	if (backlog < 1) {
+		errno = EINVAL;
+		syslog(LOG_ERR,
+		       "lircd socket backlog: %s\n",
+		       strerror(errno));
+		return -1;
+	}
+	eventlircd_lircd.backlog = backlog;
+
+	if (lircd_output_new(LIRCD_OUTPUT_DEFAULT, path, mode, release_suffix, lirc_client_config_file, binary_path) == NULL) {
+		return -1;
+	}
+
+	monitor_stats_add(&lircd_stats);
+
+	return 0;
+}
+
+/*
+ * Add a named output, to which udev can route input devices with the
+ * eventlircd_output property.
+ */
+int lircd_output_add(const char *name, const char *path, mode_t mode, const char *release_suffix, const char *lirc_client_config_file)
+{
+	if (eventlircd_lircd.output_list == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (lircd_output_new(name, path, mode, release_suffix, lirc_client_config_file, NULL) == NULL) {
+		return -1;
+	}
+
+	syslog(LOG_INFO,
+	       "lircd output %s: listening on %s\n",
+	       name,
+	       path);
+
+	return 0;
+}
+
+/*
+ * Listen for lircd clients on a TCP socket as well, for clients that cannot
+ * reach the default output's Unix socket. The address is [<host>:]<port>,
+ * with IPv6 hosts in brackets, and the host defaults to the loopback address.
+ * TCP clients are served like the default output's other clients, except that
+ * they cannot get the event ring.
+ */
+int lircd_tcp_add(const char *address)
+{
+	struct lircd_output *output;
+	struct addrinfo hints;
+	struct addrinfo *result;
+	struct addrinfo *ai;
+	char host[NI_MAXHOST];
+	const char *port;
+	const char *colon;
+	size_t host_len;
+	int reuse;
+	int rc;
+	int fd;
+
+	if (((output = eventlircd_lircd.output_list) == NULL) || (address == NULL)) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (output->tcp_fd != -1) {
+		errno = EEXIST;
+		return -1;
+	}
+
+	if ((colon = strrchr(address, ':')) == NULL) {
+		strcpy(host, LIRCD_TCP_HOST_DEFAULT);
+		port = address;
+	} else {
+		host_len = (size_t)(colon - address);
+		if ((host_len >= 2) && (address[0] == '[') && (address[host_len - 1] == ']')) {
+			address++;
+			host_len -= 2;
+		}
+		if ((host_len == 0) || (host_len >= sizeof host)) {
+			errno = EINVAL;
+			syslog(LOG_ERR,
+			       "invalid lircd TCP address %s\n",
+			       address);
+			return -1;
+		}
+		memcpy(host, address, host_len);
+		host[host_len] = '\0';
+		port = colon + 1;
+	}
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+	if ((rc = getaddrinfo(host, port, &hints, &result)) != 0) {
+		errno = EINVAL;
+		syslog(LOG_ERR,
+		       "invalid lircd TCP address %s port %s: %s\n",
+		       host,
+		       port,
+		       gai_strerror(rc));
+		return -1;
+	}
+
+	fd = -1;
+	for (ai = result ; ai != NULL ; ai = ai->ai_next) {
+		if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol)) == -1) {
+			continue;
+		}
+		reuse = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof reuse);
+		if ((bind(fd, ai->ai_addr, ai->ai_addrlen) == 0) && (listen(fd, eventlircd_lircd.backlog) == 0)) {
+			break;
+		}
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(result);
+	if (fd == -1) {
+		syslog(LOG_ERR,
+		       "failed to listen on lircd TCP address %s port %s: %s\n",
+		       host,
+		       port,
+		       strerror(errno));
+		return -1;
+	}
+
+	if (monitor_client_add(fd, &lircd_tcp_handler, output) != 0) {
+		syslog(LOG_ERR,
+		       "failed to add the lircd TCP socket to the monitor client list: %s\n",
+		       strerror(errno));
+		close(fd);
+		return -1;
+	}
+	output->tcp_fd = fd;
+
+	syslog(LOG_INFO,
+	       "lircd output %s: listening on TCP address %s port %s\n",
+	       output->name,
+	       host,
+	       port);
+
+	return 0;
+}
+
+int lircd_device_add_code(struct lircd_device *device, __u16 code, const char *name)
+{
+	struct lircd_message *message;
+	char prefix[16];
+	int prefix_len;
+	size_t name_len;
+	size_t remote_len;
+	size_t suffix_len;
+	size_t press_len;
+	size_t release_len;
+	char release_name[LIRCD_MESSAGE_MAX];
+	struct lircd_output *output;
+	char *p;
+
+	if (device == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (code >= KEY_CNT) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (name == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (device->message[code] != NULL) {
+		return 0;
+	}
+
+	output = device->output;
+
+	prefix_len = snprintf(prefix, sizeof prefix, "%x ", (unsigned int)code);
+	name_len = strlen(name);
+	remote_len = strlen(device->remote);
+	press_len = 1 + name_len + 1 + remote_len + 1;
+	suffix_len = 0;
+	release_len = 0;
+	if (output->release_suffix != NULL) {
+		suffix_len = strlen(output->release_suffix);
+		release_len = press_len + suffix_len;
+	}
+
+	/*
+	 * Leave room for the longest possible repeat count (8 hex digits).
+	 */
+	if ((size_t)prefix_len + 8 + ((release_len > press_len) ? release_len : press_len) > LIRCD_MESSAGE_MAX) {
+		errno = ENAMETOOLONG;
+		syslog(LOG_ERR,
+		       "lircd message for %s %s: %s\n",
+		       name,
+		       device->remote,
+		       strerror(errno));
+		return -1;
+	}
+
+	if ((message = malloc(sizeof(struct lircd_message) + (size_t)prefix_len + press_len + release_len)) == NULL) {
+		syslog(LOG_ERR,
+		       "failed to allocate memory for lircd message %s %s: %s\n",
+		       name,
+		       device->remote,
+		       strerror(errno));
+		return -1;
+	}
+
+	message->prefix_len = (size_t)prefix_len;
+	message->press_len = press_len;
+	message->release_len = release_len;
+	message->name_len = name_len;
+
+	p = message->text;
+	memcpy(p, prefix, (size_t)prefix_len);
+	p += prefix_len;
+
+	*p++ = ' ';
+	memcpy(p, name, name_len);
+	p += name_len;
+	*p++ = ' ';
+	memcpy(p, device->remote, remote_len);
+	p += remote_len;
+	*p++ = '\n';
+
+	if (release_len > 0) {
+		*p++ = ' ';
+		memcpy(p, name, name_len);
+		p += name_len;
+		memcpy(p, output->release_suffix, suffix_len);
+		p += suffix_len;
+		*p++ = ' ';
+		memcpy(p, device->remote, remote_len);
+		p += remote_len;
+		*p++ = '\n';
+	}
+
+	/*
+	 * Look up the lircrc entries for the key press and key release names
+	 * once, so that sending a message does not need to parse it.
+	 */
+	message->lircrc[0] = NULL;
+	message->lircrc[1] = NULL;
+	message->reload[0] = NULL;
+	message->reload[1] = NULL;
+	if (output->lircrc != NULL) {
+		if ((message->lircrc[0] = lircrc_key(output->lircrc, device->remote, name)) == NULL) {
+			free(message);
+			return -1;
+		}
+		if (release_len > 0) {
+			snprintf(release_name, sizeof release_name, "%s%s", name, output->release_suffix);
+			if ((message->lircrc[1] = lircrc_key(output->lircrc, device->remote, release_name)) == NULL) {
+				free(message);
+				return -1;
+			}
+		}
+	}
+
+	device->message[code] = message;
+
+	return 0;
+}
+
+/*
+ * Create the lircd state of an input device whose keys are sent to the output
+ * named 'name'. A device for which no output is named, or whose output does
+ * not exist, is sent to the default output.
+ */
+struct lircd_device *lircd_device_new(const char *name, const char *remote)
+{
+	struct lircd_output *output;
+	struct lircd_device *device;
+	int id;
+
+	if (remote == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (eventlircd_lircd.output_list == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	output = eventlircd_lircd.output_list;
+	if (name != NULL) {
+		for ( ; (output != NULL) && (strcmp(output->name, name) != 0) ; output = output->next);
+		if (output == NULL) {
+			syslog(LOG_WARNING,
+			       "lircd output %s does not exist: using output %s for remote %s\n",
+			       name,
+			       eventlircd_lircd.output_list->name,
+			       remote);
+			output = eventlircd_lircd.output_list;
+		}
+	}
+
+	if ((device = calloc(1, sizeof(struct lircd_device))) == NULL) {
+		syslog(LOG_ERR,
+		       "failed to allocate memory for lircd device %s: %s\n",
+		       remote,
+		       strerror(errno));
+		return NULL;
+	}
+
+	if ((device->remote = strndup(remote, PATH_MAX)) == NULL) {
+		syslog(LOG_ERR,
+		       "failed to allocate memory for lircd device %s: %s\n",
+		       remote,
+		       strerror(errno));
+		free(device);
+		return NULL;
+	}
+
+	if ((id = lircd_remote_id(remote)) == -1) {
+		free(device->remote);
+		free(device);
+		return NULL;
+	}
+	device->remote_id = (unsigned int)id;
+	device->id = eventlircd_lircd.device_id++;
+	device->output = output;
+	device->next = eventlircd_lircd.device_list;
+	eventlircd_lircd.device_list = device;
+
+	return device;
+}
+
+void lircd_device_free(struct lircd_device *device)
+{
+	struct lircd_device **device_ptr;
+	size_t i;
+
+	if (device == NULL) {
+		return;
+	}
+
+	for (device_ptr = &eventlircd_lircd.device_list ; *device_ptr != NULL ; device_ptr = &((*device_ptr)->next)) {
+		if (*device_ptr == device) {
+			*device_ptr = device->next;
+			break;
+		}
+	}
+
+	for (i = 0 ; i < KEY_CNT ; i++) {
+		free(device->message[i]);
+	}
+	free(device->remote);
+	free(device);
+}
+
+/*
+ * Read the new lircrc file of the output named 'name' (NULL for none) and
+ * compile the keys of the output's devices with it, without using either yet.
+ * The new file replaces the old one when lircd_reload_finish() commits the
+ * reload. The lircrc modes and button sequences in progress start over.
+ * Outputs are only added at start-up, so an output that does not exist is
+ * skipped with a warning.
+ */
+int lircd_reload(const char *name, const char *lirc_client_config_file)
+{
+	struct lircd_output *output;
+	struct lircd_device *device;
+	struct lircd_message *message;
+	const char *key_name;
+	char press_name[LIRCD_MESSAGE_MAX];
+	char release_name[LIRCD_MESSAGE_MAX];
+	size_t i;
+
+	if (name == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	for (output = eventlircd_lircd.output_list ; (output != NULL) && (strcmp(output->name, name) != 0) ; output = output->next);
+	if (output == NULL) {
+		syslog(LOG_WARNING,
+		       "lircd output %s: outputs are only added at start-up\n",
+		       name);
+		return 0;
+	}
+	if (output->reload == true) {
+		syslog(LOG_ERR,
+		       "lircd output %s: the output is given more than once\n",
+		       name);
+		return -1;
+	}
+
+	output->reload = true;
+	output->reload_lircrc = NULL;
+	if ((lirc_client_config_file != NULL) && ((output->reload_lircrc = lircrc_read(lirc_client_config_file)) == NULL)) {
+		return -1;
+	}
+	if (output->reload_lircrc == NULL) {
+		return 0;
+	}
+
+	for (device = eventlircd_lircd.device_list ; device != NULL ; device = device->next) {
+		if (device->output != output) {
+			continue;
+		}
+		for (i = 0 ; i < KEY_CNT ; i++) {
+			if ((message = device->message[i]) == NULL) {
+				continue;
+			}
+			key_name = message->text + message->prefix_len + 1;
+			snprintf(press_name, sizeof press_name, "%.*s", (int)message->name_len, key_name);
+			if ((message->reload[0] = lircrc_key(output->reload_lircrc, device->remote, press_name)) == NULL) {
+				return -1;
+			}
+			if (message->release_len > 0) {
+				snprintf(release_name, sizeof release_name, "%s%s", press_name, output->release_suffix);
+				if ((message->reload[1] = lircrc_key(output->reload_lircrc, device->remote, release_name)) == NULL) {
+					return -1;
 				}
-				if (prog != NULL) {
-					if (strcmp(prog, "forward") == 0) {
-						forward = 2;
-					} else if (strcmp(prog, "txir") == 0) {
-						if (txir_send(cmd) == -1)
-							return -1;
-					} else if (strcmp(prog, "lge") == 0) {
-						if (lge_send(cmd, NULL) == -1)
-							return -1;
-					} else if (strcmp(prog, "sh") == 0) {
-						if (system(cmd) == -1)
-							return -1;
-					}
+			}
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Switch the outputs given to lircd_reload() to their new lircrc files when
+ * 'commit' is true, or drop the new files when it is false.
+ */
+void lircd_reload_finish(bool commit)
+{
+	struct lircd_output *output;
+	struct lircd_device *device;
+	struct lircd_message *message;
+	size_t i;
+
+	for (output = eventlircd_lircd.output_list ; output != NULL ; output = output->next) {
+		if (output->reload == false) {
+			continue;
+		}
+		for (device = eventlircd_lircd.device_list ; device != NULL ; device = device->next) {
+			if (device->output != output) {
+				continue;
+			}
+			for (i = 0 ; i < KEY_CNT ; i++) {
+				if ((message = device->message[i]) == NULL) {
+					continue;
+				}
+				if (commit == true) {
+					message->lircrc[0] = message->reload[0];
+					message->lircrc[1] = message->reload[1];
 				}
+				message->reload[0] = NULL;
+				message->reload[1] = NULL;
 			}
-			if (forward == 1)
-				return 0;
 		}
+		if (commit == true) {
+			if (output->lircrc != NULL) {
+				lircrc_free(output->lircrc);
+			}
+			output->lircrc = output->reload_lircrc;
+		} else if (output->reload_lircrc != NULL) {
+			lircrc_free(output->reload_lircrc);
+		}
+		output->reload_lircrc = NULL;
+		output->reload = false;
+	}
+}
 
-		for(client = eventlircd_lircd.client_list ; client != NULL ; client = client->next) {
-			if (write(client->fd, message, (size_t)message_len) != (ssize_t)message_len) {
-				if (lircd_client_close(client) != 0) {
-					return -1;
+/*
+ * Build the lircd message for a key event from its template. The repeat count
+ * is the only field that changes between messages, so it is the only field
+ * that is formatted.
+ */
+static size_t lircd_message_build(const struct lircd_message *message, bool release, unsigned int repeat_count, char *buffer)
+{
+	static const char hex[] = "0123456789abcdef";
+	char digits[8];
+	size_t digits_len;
+	char *p;
+
+	digits_len = 0;
+	do {
+		digits[sizeof digits - 1 - digits_len++] = hex[repeat_count & 0xf];
+		repeat_count >>= 4;
+	} while (repeat_count != 0);
+
+	p = buffer;
+	memcpy(p, message->text, message->prefix_len);
+	p += message->prefix_len;
+	memcpy(p, digits + sizeof digits - digits_len, digits_len);
+	p += digits_len;
+	if (release == true) {
+		memcpy(p, message->text + message->prefix_len + message->press_len, message->release_len);
+		p += message->release_len;
+	} else {
+		memcpy(p, message->text + message->prefix_len, message->press_len);
+		p += message->press_len;
+	}
+	*p = '\0';
+
+	return (size_t)(p - buffer);
+}
+
+/*
+ * Add a message kind to a buffer. Key releases are the most important, then
+ * key presses and then key repeats.
+ */
+static void lircd_buffer_kind(struct lircd_buffer *buffer, int kind)
+{
+	if (kind == LIRCD_MESSAGE_RELEASE) {
+		buffer->kind = LIRCD_MESSAGE_RELEASE;
+	} else if ((kind == LIRCD_MESSAGE_PRESS) && (buffer->kind == LIRCD_MESSAGE_REPEAT)) {
+		buffer->kind = LIRCD_MESSAGE_PRESS;
+	}
+}
+
+/*
+ * Add the key of a message just added to a buffer.
+ */
+static void lircd_buffer_key(struct lircd_buffer *buffer, unsigned long key)
+{
+	if (buffer->count == 1) {
+		buffer->key = key;
+	} else if (buffer->key != key) {
+		buffer->key = LIRCD_KEY_NONE;
+	}
+}
+
+/*
+ * Send the frame's messages that pass the client's filter. A client without a
+ * filter, or whose filter passes every message, shares the frame buffer. A
+ * client whose filter passes none of the messages costs no write. 'time' is
+ * true when the frame is the time stamped frame.
+ */
+static int lircd_client_send_filtered(struct lircd_client *client, struct lircd_buffer *frame, bool time)
+{
+	struct lircd_frame_message *message;
+	struct lircd_buffer *buffer;
+	uint64_t pass;
+	unsigned int count;
+	size_t len;
+	unsigned int i;
+	int rc;
+
+	if (client->filter == NULL) {
+		return lircd_client_send(client, frame);
+	}
+
+	pass = 0;
+	count = 0;
+	len = 0;
+	for (i = 0 ; i < frame->count ; i++) {
+		message = &(client->output->frame_message[i]);
+		if (lircd_filter_match(client->filter, message) == true) {
+			pass |= (uint64_t)1 << i;
+			count++;
+			len += (time == true) ? message->time_len : message->len;
+		}
+	}
+
+	if (count == 0) {
+		return 0;
+	}
+	if (count == frame->count) {
+		return lircd_client_send(client, frame);
+	}
+
+	if ((buffer = lircd_buffer_new(len)) == NULL) {
+		return -1;
+	}
+	for (i = 0 ; i < frame->count ; i++) {
+		if ((pass & ((uint64_t)1 << i)) == 0) {
+			continue;
+		}
+		message = &(client->output->frame_message[i]);
+		if (time == true) {
+			memcpy(buffer->data + buffer->len, frame->data + message->time_offset, message->time_len);
+			buffer->len += message->time_len;
+		} else {
+			memcpy(buffer->data + buffer->len, frame->data + message->offset, message->len);
+			buffer->len += message->len;
+		}
+		buffer->count++;
+		lircd_buffer_kind(buffer, message->kind);
+		lircd_buffer_key(buffer, LIRCD_KEY(message->remote_id, message->code));
+	}
+
+	rc = lircd_client_send(client, buffer);
+	lircd_buffer_unref(buffer);
+
+	return rc;
+}
+
+/*
+ * Return the format in which a client gets the current frame. A client that
+ * asked for time stamps in the middle of a frame gets the frame without them.
+ */
+static int lircd_client_format(const struct lircd_client *client, bool time)
+{
+	if (client->binary == true) {
+		return LIRCD_FORMAT_BINARY;
+	}
+	if ((client->timestamps == true) && (time == true)) {
+		return LIRCD_FORMAT_TIME;
+	}
+	return LIRCD_FORMAT_TEXT;
+}
+
+/*
+ * Send the messages assembled for the current frame to every client that
+ * gets them in the frame's format.
+ */
+static int lircd_flush_frame(struct lircd_output *output, struct lircd_buffer **frame_ptr, int format, bool time)
+{
+	struct lircd_buffer *frame;
+	struct lircd_client *client;
+	int rc;
+
+	frame = *frame_ptr;
+	if ((frame == NULL) || (frame->len == 0)) {
+		return 0;
+	}
+
+	for(client = output->client_list ; client != NULL ; client = client->next) {
+		if ((client->fd == -1) || (lircd_client_format(client, time) != format)) {
+			continue;
+		}
+		if (format == LIRCD_FORMAT_BINARY) {
+			rc = lircd_client_send(client, frame);
+		} else {
+			rc = lircd_client_send_filtered(client, frame, (format == LIRCD_FORMAT_TIME));
+		}
+		if (rc != 0) {
+			if (lircd_client_close(client) != 0) {
+				return -1;
+			}
+		}
+	}
+
+	/*
+	 * Reuse the frame buffer unless a client has queued it.
+	 */
+	if (frame->refcount == 1) {
+		frame->kind = LIRCD_MESSAGE_REPEAT;
+		frame->key = LIRCD_KEY_NONE;
+		frame->count = 0;
+		frame->len = 0;
+	} else {
+		lircd_buffer_unref(frame);
+		*frame_ptr = NULL;
+	}
+
+	return 0;
+}
+
+int lircd_flush()
+{
+	struct lircd_output *output;
+	struct lircd_client *client;
+	uint64_t one;
+	bool time;
+
+	/*
+	 * Wake up the event ring consumers. A write only fails when a
+	 * consumer's eventfd counter is full, and then the consumer has a
+	 * wakeup pending anyway.
+	 */
+	if (ring_commit() != 0) {
+		one = 1;
+		for (output = eventlircd_lircd.output_list ; output != NULL ; output = output->next) {
+			for (client = output->client_list ; client != NULL ; client = client->next) {
+				if ((client->ring_fd != -1) && (write(client->ring_fd, &one, sizeof one) != sizeof one)) {
+					syslog(LOG_DEBUG,
+					       "lircd client %d: event ring wakeup pending\n",
+					       client->fd);
 				}
 			}
 		}
-		if (lircd_client_purge() != 0) {
+	}
+
+	for (output = eventlircd_lircd.output_list ; output != NULL ; output = output->next) {
+		/*
+		 * The time stamped frame is only complete when it has been
+		 * assembled since the start of the frame.
+		 */
+		time = (output->frame != NULL) &&
+		       (output->time_frame != NULL) &&
+		       (output->time_frame->count == output->frame->count);
+
+		if (lircd_flush_frame(output, &(output->frame), LIRCD_FORMAT_TEXT, time) != 0) {
+			return -1;
+		}
+		if (lircd_flush_frame(output, &(output->time_frame), LIRCD_FORMAT_TIME, time) != 0) {
+			return -1;
+		}
+		if (lircd_flush_frame(output, &(output->binary_frame), LIRCD_FORMAT_BINARY, time) != 0) {
+			return -1;
+		}
+	}
+
+	if (lircd_client_purge() != 0) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Run the config string of a triggered lircrc entry.
+ */
+static int lircd_action(int prog, const char *target, const char *config, void *arg)
+{
+	bool *forward = arg;
+
+	switch (prog) {
+	case LIRCRC_PROG_FORWARD:
+		*forward = true;
+		break;
+	case LIRCRC_PROG_TXIR:
+		return txir_send(config);
+	case LIRCRC_PROG_LGE:
+		return lge_send(target, config, NULL);
+	case LIRCRC_PROG_SH:
+		return sh_run(config);
+	case LIRCRC_PROG_MACRO:
+		return macro_run(config, NULL);
+	default:
+		break;
+	}
+
+	return 0;
+}
+
+/*
+ * Build the lircd message for a key event in the current frame. The message is
+ * sent to the clients by the next call to lircd_flush(), which the caller makes
+ * at the end of the input event frame.
+ */
+static void lircd_record_fill(struct lircd_record *record, const struct lircd_device *device, const struct input_event *event_in, const struct input_event *event, unsigned int repeat_count)
+{
+	record->sec = (__u64)event_in->input_event_sec;
+	record->usec = (__u32)event_in->input_event_usec;
+	record->device = device->id;
+	record->type_in = event_in->type;
+	record->code_in = event_in->code;
+	record->value_in = event_in->value;
+	record->type = event->type;
+	record->code = event->code;
+	record->value = event->value;
+	record->repeat_count = repeat_count;
+	record->reserved = 0;
+}
+
+/*
+ * Add the binary record for a key event to the current frame, if the binary
+ * event socket is in use.
+ */
+static void lircd_record_add(const struct lircd_device *device, const struct input_event *event_in, const struct input_event *event, unsigned int repeat_count)
+{
+	struct lircd_buffer *frame;
+	struct lircd_record record;
+
+	if ((frame = device->output->binary_frame) == NULL) {
+		return;
+	}
+
+	lircd_record_fill(&record, device, event_in, event, repeat_count);
+	memcpy(frame->data + frame->len, &record, sizeof record);
+	frame->len += sizeof record;
+	frame->count++;
+	lircd_buffer_kind(frame, event->value);
+	lircd_buffer_key(frame, LIRCD_KEY(device->id, event->code));
+}
+
+/*
+ * Append the time stamped copy of the message just built at the end of the
+ * frame buffer to the time stamped frame. The event time is the kernel's
+ * (monotonic) time stamp, and the dispatch time is now.
+ */
+static void lircd_time_add(struct lircd_output *output, struct lircd_frame_message *frame_message, const char *message, size_t message_len, const struct input_event *event_in)
+{
+	struct lircd_buffer *frame;
+	struct timespec now;
+	char *p;
+	int len;
+
+	frame = output->time_frame;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	p = frame->data + frame->len;
+	memcpy(p, message, message_len - 1);
+	len = snprintf(p + message_len - 1, LIRCD_TIME_MAX, " %lld.%06ld %lld.%06ld\n",
+	               (long long)event_in->input_event_sec,
+	               (long)event_in->input_event_usec,
+	               (long long)now.tv_sec,
+	               (long)(now.tv_nsec / 1000));
+
+	frame_message->time_offset = frame->len;
+	frame_message->time_len = message_len - 1 + (size_t)len;
+	frame->len += frame_message->time_len;
+	frame->count++;
+	lircd_buffer_kind(frame, frame_message->kind);
+	lircd_buffer_key(frame, LIRCD_KEY(frame_message->remote_id, frame_message->code));
+}
+
+/*
+ * Write a mapped input event of any type into the event ring, if there is one.
+ * Consumers are woken up by the next lircd_flush().
+ */
+void lircd_event(struct lircd_device *device, const struct input_event *event_in, const struct input_event *event, unsigned int repeat_count)
+{
+	struct lircd_record record;
+
+	if ((ring_fd() == -1) || (device == NULL) || (event_in == NULL) || (event == NULL)) {
+		return;
+	}
+
+	lircd_record_fill(&record, device, event_in, event, (event->type == EV_KEY) ? repeat_count : 0);
+	ring_write(&record);
+}
+
+int lircd_send(struct lircd_device *device, const struct input_event *event_in, const struct input_event *event, const char *name, unsigned int repeat_count)
+{
+	struct lircd_output *output;
+	struct lircd_buffer *frame;
+	char *message;
+	size_t message_len;
+	struct lircd_message *template;
+	bool forward;
+	int count;
+
+	if (device == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (event_in == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (event == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (event->code >= KEY_CNT) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	output = device->output;
+
+	/*
+	 * Make sure that the frame buffers have room for the message (and its
+	 * terminating '\0') and the record, sending the frame so far if needed.
+	 */
+	if (((output->frame != NULL) &&
+	     ((output->frame->len + LIRCD_MESSAGE_MAX + 1 > output->frame->size) ||
+	      (output->frame->count == LIRCD_FRAME_MESSAGE_MAX))) ||
+	    ((output->binary_frame != NULL) &&
+	     (output->binary_frame->count == LIRCD_FRAME_MESSAGE_MAX))) {
+		if (lircd_flush() != 0) {
+			return -1;
+		}
+	}
+	if (output->frame == NULL) {
+		if ((output->frame = lircd_buffer_new(LIRCD_FRAME_SIZE)) == NULL) {
+			return -1;
+		}
+	}
+	/*
+	 * The time stamped frame has room for every message of a frame that
+	 * fits in the frame buffer, each with the largest time stamps.
+	 */
+	if ((output->time_client_count > 0) && (output->time_frame == NULL)) {
+		if ((output->time_frame = lircd_buffer_new(LIRCD_FRAME_SIZE + LIRCD_FRAME_MESSAGE_MAX * LIRCD_TIME_MAX)) == NULL) {
+			return -1;
+		}
+	}
+	if ((output->binary_fd != -1) && (output->binary_frame == NULL)) {
+		if ((output->binary_frame = lircd_buffer_new(LIRCD_FRAME_MESSAGE_MAX * sizeof(struct lircd_record))) == NULL) {
+			return -1;
+		}
+	}
+	frame = output->frame;
+
+	if ((event->value == 0) && (output->release_suffix == NULL)) {
+		lircd_record_add(device, event_in, event, repeat_count);
+		return 0;
+	}
+
+	/*
+	 * Templates are normally created when the device is added. Create any
+	 * template that is missing on first use.
+	 */
+	if (device->message[event->code] == NULL) {
+		if (lircd_device_add_code(device, event->code, name) != 0) {
 			return -1;
 		}
 	}
 
+	/*
+	 * If this is a key release, then the template's key release tail
+	 * appends the key release suffix. The message is built in place at the
+	 * end of the frame buffer, and only becomes part of the frame when it is
+	 * to be forwarded to the clients.
+	 */
+	template = device->message[event->code];
+	message = frame->data + frame->len;
+	message_len = lircd_message_build(template, (event->value == 0), repeat_count, message);
+
+	if (message_len > 0) {
+		/*
+		 * The binary socket and the ring carry the raw event stream, so
+		 * they get the event even when lircrc consumes the key.
+		 */
+		lircd_record_add(device, event_in, event, repeat_count);
+
+		if (output->lircrc != NULL) {
+			syslog(LOG_DEBUG, "lircd message: %s", message);
+			forward = false;
+			count = lircrc_run(output->lircrc,
+			                   template->lircrc[(event->value == 0) ? 1 : 0],
+			                   repeat_count,
+			                   lircd_action,
+			                   &forward);
+			if (count == -1) {
+				return -1;
+			}
+			/*
+			 * A key that triggers lircrc entries is only sent to the
+			 * clients when one of the entries is a forward entry.
+			 */
+			if ((count > 0) && (forward == false)) {
+				return 0;
+			}
+		}
+
+		output->frame_message[frame->count].offset = frame->len;
+		output->frame_message[frame->count].len = message_len;
+		output->frame_message[frame->count].remote_id = device->remote_id;
+		output->frame_message[frame->count].code = event->code;
+		output->frame_message[frame->count].kind = event->value;
+		output->frame_message[frame->count].message = template;
+		if ((output->time_client_count > 0) &&
+		    (output->time_frame->count == frame->count)) {
+			lircd_time_add(output, &(output->frame_message[frame->count]), message, message_len, event_in);
+		}
+		frame->len += message_len;
+		frame->count++;
+		lircd_buffer_kind(frame, event->value);
+		lircd_buffer_key(frame, LIRCD_KEY(device->remote_id, event->code));
+	}
+
 	return 0;
 }
@@ -22,14 +22,77 @@
 /*
  * Single Unix Specification Version 3 headers.
  */
+#include <stdbool.h>      /* C99 */
 #include <sys/stat.h>     /* POSIX */
 /*
  * Linux headers.
  */
 #include <linux/input.h>  /* */
 
-int lircd_init(const char *path, mode_t mode, const char *release_suffix, const char *lirc_client_config_file);
+/*
+ * The lircd message kinds. They match the key event values.
+ */
+#define LIRCD_MESSAGE_RELEASE 0
+#define LIRCD_MESSAGE_PRESS   1
+#define LIRCD_MESSAGE_REPEAT  2
+
+/*
+ * The default number of input frames (buffers) that can be queued for a client
+ * that is not keeping up. A buffer holds the messages of one input frame.
+ */
+#define LIRCD_CLIENT_QUEUE_DEFAULT 128
+
+/*
+ * The default listen backlog of the lircd socket.
+ */
+#define LIRCD_BACKLOG_DEFAULT 64
+
+/*
+ * The name of the output given to lircd_init(), which gets the input devices
+ * that are not routed to a named output, and the largest number of outputs.
+ */
+#define LIRCD_OUTPUT_DEFAULT "default"
+#define LIRCD_OUTPUT_MAX 16
+
+/*
+ * The default host and port of the TCP socket. The port is lircd's.
+ */
+#define LIRCD_TCP_HOST_DEFAULT "127.0.0.1"
+#define LIRCD_TCP_PORT_DEFAULT "8765"
+
+/*
+ * The record written to the clients of the binary event socket, one record
+ * per packet, for each key event sent to the lircd socket clients. Key
+ * releases are sent even when no key release suffix is set. The same record
+ * is used for every event in the event ring (see ring.h).
+ */
+struct lircd_record {
+	__u64 sec;                          /* The kernel timestamp of the input event. */
+	__u32 usec;
+	__u32 device;                       /* The input device's id (unique while eventlircd runs). */
+	__u16 type_in;                      /* The input event. */
+	__u16 code_in;
+	__s32 value_in;
+	__u16 type;                         /* The mapped event. */
+	__u16 code;
+	__s32 value;
+	__u32 repeat_count;                 /* The number of times the mapped key has repeated. */
+	__u32 reserved;
+};
+
+struct lircd_device;
+
+int lircd_init(const char *path, mode_t mode, const char *release_suffix, const char *lirc_client_config_file, size_t client_queue_size, int backlog, const char *binary_path);
+int lircd_output_add(const char *name, const char *path, mode_t mode, const char *release_suffix, const char *lirc_client_config_file);
+int lircd_tcp_add(const char *address);
 int lircd_exit();
-int lircd_send(const struct input_event *event, const char *name, unsigned int repeat_count, const char *remote);
+int lircd_reload(const char *name, const char *lirc_client_config_file);
+void lircd_reload_finish(bool commit);
+struct lircd_device *lircd_device_new(const char *output, const char *remote);
+void lircd_device_free(struct lircd_device *device);
+int lircd_device_add_code(struct lircd_device *device, __u16 code, const char *name);
+int lircd_send(struct lircd_device *device, const struct input_event *event_in, const struct input_event *event, const char *name, unsigned int repeat_count);
+void lircd_event(struct lircd_device *device, const struct input_event *event_in, const struct input_event *event, unsigned int repeat_count);
+int lircd_flush();
 
 #endif
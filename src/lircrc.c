@@ -0,0 +1,1003 @@
+/*
+ * Copyright (C) 2009-2010 Paul Bender.
+ *
+ * This file is part of eventlircd.
+ *
+ * eventlircd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * eventlircd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eventlircd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Single Unix Specification Version 3 headers.
+ */
+#include <ctype.h>        /* C89 */
+#include <errno.h>        /* C89 */
+#include <stdbool.h>      /* C99 */
+#include <stdint.h>       /* POSIX */
+#include <stdio.h>        /* C89 */
+#include <stdlib.h>       /* C89 */
+#include <string.h>       /* C89 */
+#include <strings.h>      /* XSI */
+#include <syslog.h>       /* XSI */
+/*
+ * Linux headers.
+ */
+#include <linux/limits.h> /* */
+/*
+ * eventlircd headers.
+ */
+#include "lircrc.h"
+
+/*
+ * The lircrc file is read into a table of entries in file order, the same way
+ * liblirc reads it, and evaluated with the same rules as liblirc's
+ * lirc_code2charprog(). The difference is that nothing is parsed when a key
+ * event is evaluated. Instead, each (remote, button) pair that eventlircd sends
+ * is compiled once into a 'lircrc_key', which lists the entries that the pair
+ * can affect together with a bit mask of the entry's button sequence
+ * positions that the pair matches. Modes are interned so that mode changes
+ * and mode checks are integer operations.
+ */
+
+/*
+ * The longest button sequence supported in one lircrc entry.
+ */
+#define LIRCRC_CODE_MAX 32
+
+/*
+ * The deepest include file nesting supported.
+ */
+#define LIRCRC_INCLUDE_MAX 32
+
+/*
+ * The lircrc entry flags. LIRCRC_FLAG_ECNO is internal, and marks a 'once'
+ * entry whose mode change has already been done.
+ */
+#define LIRCRC_FLAG_ONCE         0x01
+#define LIRCRC_FLAG_QUIT         0x02
+#define LIRCRC_FLAG_MODE         0x04
+#define LIRCRC_FLAG_ECNO         0x08
+#define LIRCRC_FLAG_STARTUP_MODE 0x10
+#define LIRCRC_FLAG_TOGGLE_RESET 0x20
+
+/*
+ * The mode id used for "no mode".
+ */
+#define LIRCRC_MODE_NULL 0
+
+/*
+ * The 'lircrc_code' structure holds one button of an entry's button sequence.
+ * A NULL remote or button matches any remote or button ("*").
+ */
+struct lircrc_code {
+	char *remote;
+	char *button;
+};
+
+/*
+ * The 'lircrc_entry' structure holds one begin/end block of the lircrc file.
+ */
+struct lircrc_entry {
+	char *prog;                               /* The entry's prog. */
+	int prog_id;                              /* The entry's prog as a LIRCRC_PROG_* value. */
+	const char *target;                       /* The name after 'lge:' in prog, NULL for none. */
+	struct lircrc_code code[LIRCRC_CODE_MAX]; /* The entry's button sequence. */
+	size_t code_count;                        /* The length of the entry's button sequence. */
+	size_t next_code;                         /* The next position to be matched in the button sequence. */
+	char **config;                            /* The entry's config strings. */
+	size_t config_count;                      /* The number of config strings. */
+	size_t next_config;                       /* The config string to be used next. */
+	unsigned int mode;                        /* The mode in which the entry is active (LIRCRC_MODE_NULL for all modes). */
+	unsigned int change_mode;                 /* The mode the entry switches to (LIRCRC_MODE_NULL for none). */
+	unsigned int flags;                       /* The entry's flags. */
+	unsigned int rep_delay;                   /* The number of repeats ignored before repeats are acted on. */
+	unsigned int rep;                         /* Act on every rep'th repeat (0 for none). */
+	struct lircrc_entry *next;
+};
+
+/*
+ * The 'lircrc_candidate' structure holds one entry that a (remote, button) pair
+ * can affect and the entry's button sequence positions that the pair matches.
+ */
+struct lircrc_candidate {
+	struct lircrc_entry *entry;
+	uint32_t match;
+};
+
+struct lircrc_key {
+	char *remote;
+	char *button;
+	struct lircrc_candidate *candidate;
+	size_t candidate_count;
+	struct lircrc_key *next;
+};
+
+struct lircrc {
+	struct lircrc_entry *entry_list;          /* The entries in file order. */
+	char **mode;                              /* The interned mode names (index 0 is unused). */
+	unsigned int mode_count;
+	unsigned int current_mode;                /* The current mode (LIRCRC_MODE_NULL for none). */
+	struct lircrc_key *key_list;              /* The compiled (remote, button) pairs. */
+};
+
+/*
+ * The 'lircrc_parse' structure holds the parser state that carries across
+ * lines and include files.
+ */
+struct lircrc_parse {
+	struct lircrc *lircrc;
+	struct lircrc_entry **last;               /* Where the next entry is linked. */
+	struct lircrc_entry *entry;               /* The entry being read, if any. */
+	char *remote;                             /* The remote used for the following buttons (NULL for "*"). */
+	unsigned int mode;                        /* The mode of the mode block being read, if any. */
+};
+
+static void lircrc_entry_free(struct lircrc_entry *entry)
+{
+	size_t i;
+
+	if (entry == NULL) {
+		return;
+	}
+
+	free(entry->prog);
+	for (i = 0 ; i < entry->code_count ; i++) {
+		free(entry->code[i].remote);
+		free(entry->code[i].button);
+	}
+	for (i = 0 ; i < entry->config_count ; i++) {
+		free(entry->config[i]);
+	}
+	free(entry->config);
+	free(entry);
+}
+
+void lircrc_free(struct lircrc *lircrc)
+{
+	struct lircrc_entry *entry;
+	struct lircrc_key *key;
+	unsigned int i;
+
+	if (lircrc == NULL) {
+		return;
+	}
+
+	while ((entry = lircrc->entry_list) != NULL) {
+		lircrc->entry_list = entry->next;
+		lircrc_entry_free(entry);
+	}
+	while ((key = lircrc->key_list) != NULL) {
+		lircrc->key_list = key->next;
+		free(key->remote);
+		free(key->button);
+		free(key->candidate);
+		free(key);
+	}
+	for (i = 0 ; i < lircrc->mode_count ; i++) {
+		free(lircrc->mode[i]);
+	}
+	free(lircrc->mode);
+	free(lircrc);
+}
+
+/*
+ * Return the id of the named mode, adding it if it is new. Mode names are not
+ * case sensitive.
+ */
+static unsigned int lircrc_mode_intern(struct lircrc *lircrc, const char *name)
+{
+	char **mode;
+	unsigned int i;
+
+	for (i = 1 ; i < lircrc->mode_count ; i++) {
+		if (strcasecmp(lircrc->mode[i], name) == 0) {
+			return i;
+		}
+	}
+
+	if (lircrc->mode_count == 0) {
+		lircrc->mode_count = 1;
+	}
+	if ((mode = realloc(lircrc->mode, (lircrc->mode_count + 1) * sizeof(char *))) == NULL) {
+		syslog(LOG_ERR,
+		       "failed to allocate memory for lircrc mode %s: %s\n",
+		       name,
+		       strerror(errno));
+		return LIRCRC_MODE_NULL;
+	}
+	lircrc->mode = mode;
+	lircrc->mode[0] = NULL;
+	if ((lircrc->mode[lircrc->mode_count] = strdup(name)) == NULL) {
+		syslog(LOG_ERR,
+		       "failed to allocate memory for lircrc mode %s: %s\n",
+		       name,
+		       strerror(errno));
+		return LIRCRC_MODE_NULL;
+	}
+
+	return lircrc->mode_count++;
+}
+
+/*
+ * Expand the escape sequences in a config string the same way liblirc does.
+ */
+static void lircrc_unescape(char *s)
+{
+	char *in;
+	char *out;
+	unsigned int value;
+	int i;
+
+	for (in = out = s ; *in != '\0' ; in++) {
+		if (*in != '\\') {
+			*out++ = *in;
+			continue;
+		}
+		in++;
+		switch (*in) {
+		case '\0':
+			in--;
+			break;
+		case 'a':
+			*out++ = '\a';
+			break;
+		case 'b':
+			*out++ = '\b';
+			break;
+		case 'e':
+			*out++ = '\033';
+			break;
+		case 'f':
+			*out++ = '\f';
+			break;
+		case 'n':
+			*out++ = '\n';
+			break;
+		case 'r':
+			*out++ = '\r';
+			break;
+		case 't':
+			*out++ = '\t';
+			break;
+		case 'v':
+			*out++ = '\v';
+			break;
+		case 'x':
+			value = 0;
+			for (i = 0 ; (i < 2) && isxdigit((unsigned char)in[1]) ; i++) {
+				in++;
+				value = (value << 4) | (unsigned int)(isdigit((unsigned char)*in) ? (*in - '0') : (tolower((unsigned char)*in) - 'a' + 10));
+			}
+			*out++ = (char)value;
+			break;
+		default:
+			if ((*in >= '0') && (*in <= '7')) {
+				value = (unsigned int)(*in - '0');
+				for (i = 1 ; (i < 3) && (in[1] >= '0') && (in[1] <= '7') ; i++) {
+					in++;
+					value = (value << 3) | (unsigned int)(*in - '0');
+				}
+				*out++ = (char)value;
+			} else {
+				*out++ = *in;
+			}
+			break;
+		}
+	}
+	*out = '\0';
+}
+
+static unsigned int lircrc_flags(const char *path, unsigned int line_number, char *value)
+{
+	unsigned int flags;
+	char *flag;
+	char *state;
+
+	flags = 0;
+	for (flag = strtok_r(value, " \t|", &state) ; flag != NULL ; flag = strtok_r(NULL, " \t|", &state)) {
+		if (strcasecmp(flag, "once") == 0) {
+			flags |= LIRCRC_FLAG_ONCE;
+		} else if (strcasecmp(flag, "quit") == 0) {
+			flags |= LIRCRC_FLAG_QUIT;
+		} else if (strcasecmp(flag, "mode") == 0) {
+			flags |= LIRCRC_FLAG_MODE;
+		} else if (strcasecmp(flag, "startup_mode") == 0) {
+			flags |= LIRCRC_FLAG_STARTUP_MODE;
+		} else if (strcasecmp(flag, "toggle_reset") == 0) {
+			flags |= LIRCRC_FLAG_TOGGLE_RESET;
+		} else {
+			syslog(LOG_WARNING,
+			       "%s:%u: unknown flag '%s'\n",
+			       path,
+			       line_number,
+			       flag);
+		}
+	}
+
+	return flags;
+}
+
+static int lircrc_prog_id(const char *prog)
+{
+	if (strcmp(prog, "forward") == 0) {
+		return LIRCRC_PROG_FORWARD;
+	}
+	if (strcmp(prog, "txir") == 0) {
+		return LIRCRC_PROG_TXIR;
+	}
+	if ((strcmp(prog, "lge") == 0) || (strncmp(prog, "lge:", 4) == 0)) {
+		return LIRCRC_PROG_LGE;
+	}
+	if (strcmp(prog, "sh") == 0) {
+		return LIRCRC_PROG_SH;
+	}
+	if (strcmp(prog, "macro") == 0) {
+		return LIRCRC_PROG_MACRO;
+	}
+	return LIRCRC_PROG_OTHER;
+}
+
+/*
+ * Set one 'token = value' line of the entry being read.
+ */
+static int lircrc_entry_set(struct lircrc_parse *parse, const char *path, unsigned int line_number, const char *token, char *value)
+{
+	struct lircrc_entry *entry;
+	struct lircrc_code *code;
+	char **config;
+	char *end;
+
+	entry = parse->entry;
+
+	if (strcasecmp(token, "prog") == 0) {
+		free(entry->prog);
+		if ((entry->prog = strdup(value)) == NULL) {
+			goto nomem;
+		}
+		entry->prog_id = lircrc_prog_id(entry->prog);
+		entry->target = NULL;
+		if ((entry->prog_id == LIRCRC_PROG_LGE) && (entry->prog[3] == ':')) {
+			entry->target = entry->prog + 4;
+		}
+	} else if (strcasecmp(token, "remote") == 0) {
+		free(parse->remote);
+		parse->remote = NULL;
+		if (strcmp(value, "*") != 0) {
+			if ((parse->remote = strdup(value)) == NULL) {
+				goto nomem;
+			}
+		}
+	} else if (strcasecmp(token, "button") == 0) {
+		if (entry->code_count == LIRCRC_CODE_MAX) {
+			syslog(LOG_ERR,
+			       "%s:%u: button sequence is longer than %u buttons\n",
+			       path,
+			       line_number,
+			       LIRCRC_CODE_MAX);
+			return -1;
+		}
+		code = &(entry->code[entry->code_count]);
+		code->remote = NULL;
+		code->button = NULL;
+		if ((parse->remote != NULL) && ((code->remote = strdup(parse->remote)) == NULL)) {
+			goto nomem;
+		}
+		if ((strcmp(value, "*") != 0) && ((code->button = strdup(value)) == NULL)) {
+			free(code->remote);
+			goto nomem;
+		}
+		entry->code_count++;
+	} else if (strcasecmp(token, "delay") == 0) {
+		entry->rep_delay = (unsigned int)strtoul(value, &end, 0);
+		if ((*value == '\0') || (*end != '\0')) {
+			syslog(LOG_WARNING,
+			       "%s:%u: '%s' is not a valid delay\n",
+			       path,
+			       line_number,
+			       value);
+			entry->rep_delay = 0;
+		}
+	} else if (strcasecmp(token, "repeat") == 0) {
+		entry->rep = (unsigned int)strtoul(value, &end, 0);
+		if ((*value == '\0') || (*end != '\0')) {
+			syslog(LOG_WARNING,
+			       "%s:%u: '%s' is not a valid repeat\n",
+			       path,
+			       line_number,
+			       value);
+			entry->rep = 0;
+		}
+	} else if (strcasecmp(token, "config") == 0) {
+		if ((config = realloc(entry->config, (entry->config_count + 1) * sizeof(char *))) == NULL) {
+			goto nomem;
+		}
+		entry->config = config;
+		lircrc_unescape(value);
+		if ((entry->config[entry->config_count] = strdup(value)) == NULL) {
+			goto nomem;
+		}
+		entry->config_count++;
+	} else if (strcasecmp(token, "mode") == 0) {
+		if ((entry->change_mode = lircrc_mode_intern(parse->lircrc, value)) == LIRCRC_MODE_NULL) {
+			return -1;
+		}
+	} else if (strcasecmp(token, "flags") == 0) {
+		entry->flags = lircrc_flags(path, line_number, value);
+	} else {
+		syslog(LOG_WARNING,
+		       "%s:%u: unknown token '%s'\n",
+		       path,
+		       line_number,
+		       token);
+	}
+
+	return 0;
+
+nomem:
+	syslog(LOG_ERR,
+	       "failed to allocate memory for lircrc entry: %s\n",
+	       strerror(errno));
+	return -1;
+}
+
+static int lircrc_entry_end(struct lircrc_parse *parse, const char *path, unsigned int line_number)
+{
+	struct lircrc_entry *entry;
+
+	entry = parse->entry;
+	parse->entry = NULL;
+
+	free(parse->remote);
+	parse->remote = NULL;
+
+	if (entry->prog == NULL) {
+		syslog(LOG_ERR,
+		       "%s:%u: prog missing in config before this line\n",
+		       path,
+		       line_number);
+		lircrc_entry_free(entry);
+		return -1;
+	}
+	if ((entry->rep_delay > 0) && (entry->rep == 0)) {
+		syslog(LOG_WARNING,
+		       "%s:%u: repeat delay set without repeat\n",
+		       path,
+		       line_number);
+	}
+
+	entry->mode = parse->mode;
+
+	*(parse->last) = entry;
+	parse->last = &(entry->next);
+
+	return 0;
+}
+
+static int lircrc_read_file(struct lircrc_parse *parse, const char *path, unsigned int depth)
+{
+	FILE *fp;
+	char *line;
+	size_t line_len;
+	unsigned int line_number;
+	char *s;
+	char *token;
+	char *value;
+	char *end;
+	char include_path[PATH_MAX + 1];
+	const char *slash;
+	int return_code;
+
+	if (depth > LIRCRC_INCLUDE_MAX) {
+		syslog(LOG_ERR,
+		       "%s: lircrc files are included too deeply\n",
+		       path);
+		return -1;
+	}
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		syslog(LOG_ERR,
+		       "failed to open lircrc file '%s': %s\n",
+		       path,
+		       strerror(errno));
+		return -1;
+	}
+
+	return_code = 0;
+	line = NULL;
+	line_len = 0;
+	line_number = 0;
+	while ((return_code == 0) && (getline(&line, &line_len, fp) >= 0)) {
+		line_number++;
+
+		/*
+		 * Trim the line, and skip blank and comment lines.
+		 */
+		for (s = line ; isspace((unsigned char)*s) ; s++);
+		for (end = s + strlen(s) ; (end > s) && isspace((unsigned char)end[-1]) ; end--);
+		*end = '\0';
+		if ((*s == '\0') || (*s == '#')) {
+			continue;
+		}
+
+		/*
+		 * Split the line into a token and a value. The value is either
+		 * what follows an '=' or the second word.
+		 */
+		token = s;
+		for ( ; (*s != '\0') && (*s != '=') && !isspace((unsigned char)*s) ; s++);
+		value = s;
+		for ( ; isspace((unsigned char)*value) ; value++);
+		if (*value == '=') {
+			for (value++ ; isspace((unsigned char)*value) ; value++);
+		} else {
+			value = (*value == '\0') ? NULL : value;
+		}
+		*s = '\0';
+
+		if (strcasecmp(token, "include") == 0) {
+			if ((value == NULL) || (parse->entry != NULL)) {
+				syslog(LOG_ERR,
+				       "%s:%u: bad include\n",
+				       path,
+				       line_number);
+				return_code = -1;
+				continue;
+			}
+			if (((*value == '"') || (*value == '<')) && (strlen(value) >= 2)) {
+				value[strlen(value) - 1] = '\0';
+				value++;
+			}
+			slash = strrchr(path, '/');
+			if ((*value == '/') || (slash == NULL)) {
+				snprintf(include_path, sizeof include_path, "%s", value);
+			} else {
+				snprintf(include_path, sizeof include_path, "%.*s/%s", (int)(slash - path), path, value);
+			}
+			return_code = lircrc_read_file(parse, include_path, depth + 1);
+		} else if (strcasecmp(token, "begin") == 0) {
+			if (parse->entry != NULL) {
+				syslog(LOG_ERR,
+				       "%s:%u: 'begin' inside of an entry\n",
+				       path,
+				       line_number);
+				return_code = -1;
+			} else if (value != NULL) {
+				if (parse->mode != LIRCRC_MODE_NULL) {
+					syslog(LOG_ERR,
+					       "%s:%u: mode blocks cannot be nested\n",
+					       path,
+					       line_number);
+					return_code = -1;
+				} else if ((parse->mode = lircrc_mode_intern(parse->lircrc, value)) == LIRCRC_MODE_NULL) {
+					return_code = -1;
+				}
+			} else if ((parse->entry = calloc(1, sizeof(struct lircrc_entry))) == NULL) {
+				syslog(LOG_ERR,
+				       "failed to allocate memory for lircrc entry: %s\n",
+				       strerror(errno));
+				return_code = -1;
+			}
+		} else if (strcasecmp(token, "end") == 0) {
+			if (value != NULL) {
+				if ((parse->entry != NULL) ||
+				    (parse->mode == LIRCRC_MODE_NULL) ||
+				    (strcasecmp(parse->lircrc->mode[parse->mode], value) != 0)) {
+					syslog(LOG_ERR,
+					       "%s:%u: 'end %s' without 'begin %s'\n",
+					       path,
+					       line_number,
+					       value,
+					       value);
+					return_code = -1;
+				}
+				parse->mode = LIRCRC_MODE_NULL;
+			} else if (parse->entry == NULL) {
+				syslog(LOG_ERR,
+				       "%s:%u: 'end' without 'begin'\n",
+				       path,
+				       line_number);
+				return_code = -1;
+			} else {
+				return_code = lircrc_entry_end(parse, path, line_number);
+			}
+		} else if (parse->entry == NULL) {
+			syslog(LOG_ERR,
+			       "%s:%u: '%s' outside of an entry\n",
+			       path,
+			       line_number,
+			       token);
+			return_code = -1;
+		} else if (value == NULL) {
+			syslog(LOG_ERR,
+			       "%s:%u: '%s' has no value\n",
+			       path,
+			       line_number,
+			       token);
+			return_code = -1;
+		} else {
+			return_code = lircrc_entry_set(parse, path, line_number, token, value);
+		}
+	}
+
+	free(line);
+	fclose(fp);
+
+	return return_code;
+}
+
+/*
+ * Apply the first 'startup_mode' entry's mode the way liblirc does: the mode
+ * becomes the current mode, the entry no longer changes mode and 'once'
+ * entries that switch to the mode count as already done.
+ */
+static void lircrc_startup_mode(struct lircrc *lircrc)
+{
+	struct lircrc_entry *entry;
+
+	for (entry = lircrc->entry_list ; entry != NULL ; entry = entry->next) {
+		if ((entry->flags & LIRCRC_FLAG_STARTUP_MODE) == 0) {
+			continue;
+		}
+		if (entry->change_mode == LIRCRC_MODE_NULL) {
+			syslog(LOG_WARNING,
+			       "lircrc: startup_mode flag requires 'mode ='\n");
+			continue;
+		}
+		lircrc->current_mode = entry->change_mode;
+		entry->change_mode = LIRCRC_MODE_NULL;
+		break;
+	}
+
+	if (lircrc->current_mode == LIRCRC_MODE_NULL) {
+		return;
+	}
+
+	for (entry = lircrc->entry_list ; entry != NULL ; entry = entry->next) {
+		if ((entry->change_mode == lircrc->current_mode) && ((entry->flags & LIRCRC_FLAG_ONCE) != 0)) {
+			entry->flags |= LIRCRC_FLAG_ECNO;
+		}
+	}
+}
+
+struct lircrc *lircrc_read(const char *path)
+{
+	struct lircrc *lircrc;
+	struct lircrc_parse parse;
+	int return_code;
+
+	if (path == NULL) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if ((lircrc = calloc(1, sizeof(struct lircrc))) == NULL) {
+		syslog(LOG_ERR,
+		       "failed to allocate memory for lircrc file %s: %s\n",
+		       path,
+		       strerror(errno));
+		return NULL;
+	}
+
+	parse.lircrc = lircrc;
+	parse.last = &(lircrc->entry_list);
+	parse.entry = NULL;
+	parse.remote = NULL;
+	parse.mode = LIRCRC_MODE_NULL;
+
+	return_code = lircrc_read_file(&parse, path, 0);
+	if ((return_code == 0) && (parse.entry != NULL)) {
+		syslog(LOG_ERR,
+		       "%s: missing 'end' at end of file\n",
+		       path);
+		return_code = -1;
+	}
+	if ((return_code == 0) && (parse.mode != LIRCRC_MODE_NULL)) {
+		syslog(LOG_ERR,
+		       "%s: missing 'end %s' at end of file\n",
+		       path,
+		       lircrc->mode[parse.mode]);
+		return_code = -1;
+	}
+	lircrc_entry_free(parse.entry);
+	free(parse.remote);
+
+	if (return_code != 0) {
+		lircrc_free(lircrc);
+		return NULL;
+	}
+
+	lircrc_startup_mode(lircrc);
+
+	return lircrc;
+}
+
+static bool lircrc_code_match(const struct lircrc_code *code, const char *remote, const char *button)
+{
+	if ((code->remote != NULL) && (strcasecmp(code->remote, remote) != 0)) {
+		return false;
+	}
+	if ((code->button != NULL) && (strcasecmp(code->button, button) != 0)) {
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Compile a (remote, button) pair. An entry is a candidate for the pair when
+ * the pair matches one of the entry's buttons, or when the entry's state can
+ * change on a key press that it does not match: entries without buttons
+ * match everything, button sequences rebase, and 'toggle_reset' entries go
+ * back to their first config string.
+ */
+struct lircrc_key *lircrc_key(struct lircrc *lircrc, const char *remote, const char *button)
+{
+	struct lircrc_key *key;
+	struct lircrc_entry *entry;
+	uint32_t match;
+	size_t count;
+	size_t i;
+
+	if ((lircrc == NULL) || (remote == NULL) || (button == NULL)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	for (key = lircrc->key_list ; key != NULL ; key = key->next) {
+		if ((strcasecmp(key->remote, remote) == 0) && (strcasecmp(key->button, button) == 0)) {
+			return key;
+		}
+	}
+
+	if ((key = calloc(1, sizeof(struct lircrc_key))) == NULL) {
+		goto nomem;
+	}
+	if (((key->remote = strdup(remote)) == NULL) || ((key->button = strdup(button)) == NULL)) {
+		goto nomem;
+	}
+
+	count = 0;
+	for (entry = lircrc->entry_list ; entry != NULL ; entry = entry->next) {
+		count++;
+	}
+	if ((count > 0) && ((key->candidate = calloc(count, sizeof(struct lircrc_candidate))) == NULL)) {
+		goto nomem;
+	}
+
+	for (entry = lircrc->entry_list ; entry != NULL ; entry = entry->next) {
+		match = 0;
+		for (i = 0 ; i < entry->code_count ; i++) {
+			if (lircrc_code_match(&(entry->code[i]), remote, button) == true) {
+				match |= (uint32_t)1 << i;
+			}
+		}
+		if ((match != 0) ||
+		    (entry->code_count != 1) ||
+		    ((entry->flags & LIRCRC_FLAG_TOGGLE_RESET) != 0)) {
+			key->candidate[key->candidate_count].entry = entry;
+			key->candidate[key->candidate_count].match = match;
+			key->candidate_count++;
+		}
+	}
+
+	key->next = lircrc->key_list;
+	lircrc->key_list = key;
+
+	return key;
+
+nomem:
+	syslog(LOG_ERR,
+	       "failed to allocate memory for lircrc key %s %s: %s\n",
+	       remote,
+	       button,
+	       strerror(errno));
+	if (key != NULL) {
+		free(key->remote);
+		free(key->button);
+		free(key->candidate);
+		free(key);
+	}
+	return NULL;
+}
+
+static bool lircrc_repeat_match(const struct lircrc_entry *entry, unsigned int repeat_count)
+{
+	return (entry->rep > 0) &&
+	       (repeat_count > entry->rep_delay) &&
+	       (((repeat_count - entry->rep_delay - 1) % entry->rep) == 0);
+}
+
+/*
+ * The equivalent of liblirc's lirc_iscode(). It returns 0 when the entry is
+ * not triggered, 1 when the key advanced the entry's button sequence and 2
+ * when the entry is triggered.
+ */
+static int lircrc_iscode(struct lircrc_entry *entry, uint32_t match, unsigned int repeat_count)
+{
+	size_t start;
+	size_t i;
+	int iscode;
+
+	/*
+	 * No buttons, so the entry matches every key.
+	 */
+	if (entry->code_count == 0) {
+		return (repeat_count == 0) || lircrc_repeat_match(entry, repeat_count);
+	}
+
+	if ((match & ((uint32_t)1 << entry->next_code)) != 0) {
+		iscode = 0;
+		/*
+		 * Repeats only advance single button entries.
+		 */
+		if ((entry->code_count == 1) || (repeat_count == 0)) {
+			entry->next_code++;
+			if (entry->code_count > 1) {
+				iscode = 1;
+			}
+		}
+		/*
+		 * The button sequence is complete.
+		 */
+		if (entry->next_code == entry->code_count) {
+			entry->next_code = 0;
+			if ((entry->code_count > 1) ||
+			    (repeat_count == 0) ||
+			    lircrc_repeat_match(entry, repeat_count)) {
+				iscode = 2;
+			}
+		}
+		return iscode;
+	}
+
+	if (repeat_count != 0) {
+		return 0;
+	}
+
+	if ((entry->flags & LIRCRC_FLAG_TOGGLE_RESET) != 0) {
+		entry->next_config = 0;
+	}
+
+	if (entry->next_code == 0) {
+		return 0;
+	}
+
+	/*
+	 * Rebase the button sequence on the longest tail of the buttons matched
+	 * so far that, followed by this button, is also a head of the sequence.
+	 */
+	for (start = 1 ; start <= entry->next_code ; start++) {
+		for (i = 0 ; start + i < entry->next_code ; i++) {
+			if ((entry->code[i].remote != NULL) &&
+			    ((entry->code[start + i].remote == NULL) ||
+			     (strcasecmp(entry->code[i].remote, entry->code[start + i].remote) != 0))) {
+				break;
+			}
+			if ((entry->code[i].button != NULL) &&
+			    ((entry->code[start + i].button == NULL) ||
+			     (strcasecmp(entry->code[i].button, entry->code[start + i].button) != 0))) {
+				break;
+			}
+		}
+		if ((start + i == entry->next_code) && ((match & ((uint32_t)1 << i)) != 0)) {
+			entry->next_code = i + 1;
+			return 0;
+		}
+	}
+	entry->next_code = 0;
+
+	return 0;
+}
+
+static void lircrc_clear_mode(struct lircrc *lircrc)
+{
+	struct lircrc_entry *entry;
+
+	if (lircrc->current_mode == LIRCRC_MODE_NULL) {
+		return;
+	}
+
+	for (entry = lircrc->entry_list ; entry != NULL ; entry = entry->next) {
+		if (entry->change_mode == lircrc->current_mode) {
+			entry->flags &= ~LIRCRC_FLAG_ECNO;
+		}
+	}
+	lircrc->current_mode = LIRCRC_MODE_NULL;
+}
+
+/*
+ * The equivalent of liblirc's lirc_execute(). It does the entry's mode change
+ * and returns the config string to run, if any.
+ */
+static const char *lircrc_execute(struct lircrc *lircrc, struct lircrc_entry *entry)
+{
+	const char *config;
+	bool do_once;
+
+	do_once = true;
+
+	if ((entry->flags & LIRCRC_FLAG_MODE) != 0) {
+		lircrc_clear_mode(lircrc);
+	}
+	if (entry->change_mode != LIRCRC_MODE_NULL) {
+		lircrc->current_mode = entry->change_mode;
+		if ((entry->flags & LIRCRC_FLAG_ONCE) != 0) {
+			if ((entry->flags & LIRCRC_FLAG_ECNO) != 0) {
+				do_once = false;
+			} else {
+				entry->flags |= LIRCRC_FLAG_ECNO;
+			}
+		}
+	}
+
+	if ((entry->config_count == 0) || (do_once == false)) {
+		return NULL;
+	}
+
+	config = entry->config[entry->next_config];
+	entry->next_config = (entry->next_config + 1) % entry->config_count;
+
+	return config;
+}
+
+/*
+ * Evaluate the entries for a key event, calling 'action' with the prog, the
+ * target named in the prog (as in 'lge:projector') and config string of each
+ * triggered entry in the order in which liblirc's
+ * lirc_code2charprog() would return them. It returns the number of triggered
+ * entries, or -1 if 'action' fails.
+ */
+int lircrc_run(struct lircrc *lircrc, struct lircrc_key *key, unsigned int repeat_count,
+               int (*action)(int prog, const char *target, const char *config, void *arg), void *arg)
+{
+	struct lircrc_entry *entry;
+	const char *config;
+	bool quit;
+	int level;
+	int count;
+	size_t i;
+
+	if ((lircrc == NULL) || (key == NULL) || (action == NULL)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	quit = false;
+	count = 0;
+	for (i = 0 ; i < key->candidate_count ; i++) {
+		entry = key->candidate[i].entry;
+		level = lircrc_iscode(entry, key->candidate[i].match, repeat_count);
+		if ((level == 0) || (quit == true)) {
+			continue;
+		}
+		if ((entry->mode != LIRCRC_MODE_NULL) && (entry->mode != lircrc->current_mode)) {
+			continue;
+		}
+		if (level > 1) {
+			if ((config = lircrc_execute(lircrc, entry)) != NULL) {
+				count++;
+				if (action(entry->prog_id, entry->target, config, arg) != 0) {
+					return -1;
+				}
+			}
+		}
+		/*
+		 * After a 'quit' entry, the remaining entries still track their
+		 * button sequences but are not triggered.
+		 */
+		if ((entry->flags & LIRCRC_FLAG_QUIT) != 0) {
+			quit = true;
+		}
+	}
+
+	return count;
+}
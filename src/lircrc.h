@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2009-2010 Paul Bender.
+ *
+ * This file is part of eventlircd.
+ *
+ * eventlircd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * eventlircd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eventlircd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _EVENTLIRCD_LIRCRC_H_
+#define _EVENTLIRCD_LIRCRC_H_ 1
+
+/*
+ * The programs that eventlircd knows how to run an lircrc entry's config
+ * string with. Any other prog is LIRCRC_PROG_OTHER. 'lge:<name>' sends to the
+ * lge port called name, 'lge' to the first one.
+ */
+#define LIRCRC_PROG_OTHER   0
+#define LIRCRC_PROG_FORWARD 1
+#define LIRCRC_PROG_TXIR    2
+#define LIRCRC_PROG_LGE     3
+#define LIRCRC_PROG_SH      4
+#define LIRCRC_PROG_MACRO   5
+
+struct lircrc;
+struct lircrc_key;
+
+struct lircrc *lircrc_read(const char *path);
+void lircrc_free(struct lircrc *lircrc);
+struct lircrc_key *lircrc_key(struct lircrc *lircrc, const char *remote, const char *button);
+int lircrc_run(struct lircrc *lircrc, struct lircrc_key *key, unsigned int repeat_count,
+               int (*action)(int prog, const char *target, const char *config, void *arg), void *arg);
+
+#endif
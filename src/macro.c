@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/timerfd.h>  /* Linux */
+#include <syslog.h>       /* XSI */
+
+#include "monitor.h"
+#include "lge.h"
+#include "txir.h"
+#include "macro.h"
+
+#ifdef UNUSED
+# error cannot define UNUSED because it is already defined
+#endif
+#if defined(__GNUC__)
+# define UNUSED(x) x __attribute__((unused))
+#else
+# define UNUSED(x) x
+#endif
+
+/* The longest wait, so that a typo cannot stall a macro for days. */
+#define MACRO_WAIT_MAX		600000
+
+#define MACRO_STEP_TXIR		0
+#define MACRO_STEP_LGE		1
+#define MACRO_STEP_WAIT		2
+
+/*
+ * A macro is the config string of a 'prog = macro' lircrc entry: steps
+ * separated by ';', each one of
+ *	txir <lircd command>
+ *	lge[:<name>] <codes>
+ *	wait <ms>
+ * Steps up to the next wait are sent at once through the txir and lge
+ * queues, and the rest are sent when the wait's timer fires, so a macro
+ * never blocks the event loop. Only one macro runs at a time: starting one
+ * cancels the steps the previous one has not sent yet.
+ */
+typedef struct macro_step {
+	int type;
+	const char *name;	/* lge port, NULL for the first one */
+	const char *arg;	/* txir command or lge codes */
+	unsigned int wait;	/* ms */
+} macro_step_t;
+
+static int macro_timerfd = -1;
+static char *macro_text;
+static macro_step_t macro_steps[MACRO_STEPS_MAX];
+static unsigned int macro_count, macro_next;
+
+static void macro_set_timer(unsigned int ms)
+{
+	struct itimerspec t;
+
+	memset(&t, 0, sizeof(t));
+	t.it_value.tv_sec = ms / 1000;
+	t.it_value.tv_nsec = (ms % 1000) * 1000000;
+	if (timerfd_settime(macro_timerfd, 0, &t, NULL) == -1)
+		syslog(LOG_ERR, "setting macro timer failed: %s\n", strerror(errno));
+}
+
+static char *macro_trim(char *s)
+{
+	char *end;
+
+	while (isspace((unsigned char)*s))
+		s++;
+	end = s + strlen(s);
+	while (end > s && isspace((unsigned char)end[-1]))
+		*--end = '\0';
+	return s;
+}
+
+/*
+ * Split a copy of the config string into steps. Nothing is sent unless the
+ * whole macro parses, so a bad macro does not cancel the running one.
+ */
+static int macro_parse(char *text, macro_step_t *steps, unsigned int *count)
+{
+	char *step, *next, *arg, *end;
+	unsigned long ms;
+
+	*count = 0;
+	for (step = text; step != NULL; step = next) {
+		if ((next = strchr(step, ';')) != NULL)
+			*next++ = '\0';
+		step = macro_trim(step);
+		if (*step == '\0')
+			continue;
+		if (*count == MACRO_STEPS_MAX) {
+			syslog(LOG_ERR, "macro: more than %d steps\n", MACRO_STEPS_MAX);
+			return -1;
+		}
+
+		arg = step + strcspn(step, " \t");
+		if (*arg != '\0')
+			*arg++ = '\0';
+		arg = macro_trim(arg);
+
+		steps[*count].name = NULL;
+		steps[*count].arg = arg;
+		steps[*count].wait = 0;
+		if (strcmp(step, "txir") == 0) {
+			steps[*count].type = MACRO_STEP_TXIR;
+		} else if (strcmp(step, "lge") == 0 || strncmp(step, "lge:", 4) == 0) {
+			steps[*count].type = MACRO_STEP_LGE;
+			if (step[3] == ':')
+				steps[*count].name = step + 4;
+		} else if (strcmp(step, "wait") == 0) {
+			steps[*count].type = MACRO_STEP_WAIT;
+			errno = 0;
+			ms = strtoul(arg, &end, 10);
+			if (errno != 0 || end == arg || *end != '\0' || ms > MACRO_WAIT_MAX) {
+				syslog(LOG_ERR, "macro: invalid wait '%s'\n", arg);
+				return -1;
+			}
+			steps[*count].wait = ms;
+		} else {
+			syslog(LOG_ERR, "macro: unknown step '%s'\n", step);
+			return -1;
+		}
+		if (steps[*count].type != MACRO_STEP_WAIT && *arg == '\0') {
+			syslog(LOG_ERR, "macro: '%s' step without a command\n", step);
+			return -1;
+		}
+		++*count;
+	}
+	return 0;
+}
+
+/*
+ * Send the steps up to the next wait and arm the timer for it. A step that
+ * cannot be queued is logged by txir or lge and skipped; the devices it
+ * would have reached are usually independent of the rest of the macro.
+ */
+static void macro_step(struct timeval *now)
+{
+	macro_step_t *step;
+
+	while (macro_next < macro_count) {
+		step = &macro_steps[macro_next++];
+		switch (step->type) {
+		case MACRO_STEP_TXIR:
+			txir_send(step->arg);
+			break;
+		case MACRO_STEP_LGE:
+			lge_send(step->name, step->arg, now);
+			break;
+		case MACRO_STEP_WAIT:
+			if (step->wait > 0) {
+				macro_set_timer(step->wait);
+				return;
+			}
+			break;
+		}
+	}
+
+	free(macro_text);
+	macro_text = NULL;
+	macro_count = macro_next = 0;
+}
+
+static int macro_timer_handler(void* UNUSED(id), int ready, struct timeval *now)
+{
+	uint64_t expirations;
+
+	if (!(ready & MONITOR_READ) || read(macro_timerfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return 0;
+	if (macro_text != NULL)
+		macro_step(now);
+	return 0;
+}
+
+int macro_init(void)
+{
+	if ((macro_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+		syslog(LOG_ERR, "creating macro timer failed: %s\n", strerror(errno));
+		return -1;
+	}
+	if (monitor_client_add(macro_timerfd, &macro_timer_handler, NULL) != 0) {
+		close(macro_timerfd);
+		macro_timerfd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+int macro_exit(void)
+{
+	if (macro_timerfd != -1) {
+		monitor_client_remove(macro_timerfd);
+		close(macro_timerfd);
+		macro_timerfd = -1;
+	}
+	free(macro_text);
+	macro_text = NULL;
+	macro_count = macro_next = 0;
+	return 0;
+}
+
+/*
+ * Start a macro, cancelling the one that is still waiting, if any.
+ */
+int macro_run(const char *config, struct timeval *now)
+{
+	macro_step_t steps[MACRO_STEPS_MAX];
+	unsigned int count;
+	char *text;
+
+	if (macro_timerfd == -1)
+		return -1;
+
+	if ((text = strdup(config)) == NULL) {
+		syslog(LOG_ERR, "failed to allocate memory for the macro: %s\n", strerror(errno));
+		return -1;
+	}
+	if (macro_parse(text, steps, &count) != 0) {
+		free(text);
+		return -1;
+	}
+
+	if (macro_text != NULL) {
+		syslog(LOG_INFO, "macro: cancelled %u unsent steps\n", macro_count - macro_next);
+		macro_set_timer(0);
+		free(macro_text);
+	}
+	macro_text = text;
+	memcpy(macro_steps, steps, sizeof(steps));
+	macro_count = count;
+	macro_next = 0;
+	macro_step(now);
+	return 0;
+}
@@ -0,0 +1,13 @@
+#ifndef _MACRO_H_
+#define _MACRO_H_ 1
+
+#include <sys/time.h>
+
+/* The most steps in one macro, counting the waits. */
+#define MACRO_STEPS_MAX 32
+
+int macro_init(void);
+int macro_exit(void);
+int macro_run(const char *config, struct timeval *now);
+
+#endif
@@ -23,6 +23,7 @@
 /*
  * Single Unix Specification Version 3 headers.
  */
+#include <errno.h>        /* C89 */
 #include <signal.h>       /* C89 */
 #include <stdbool.h>      /* C99 */
 #include <stdio.h>        /* C89 */
@@ -30,7 +31,12 @@
 #include <string.h>       /* C89 */
 #include <sys/stat.h>     /* POSIX */
 #include <syslog.h>       /* XSI */
+#include <time.h>         /* C89 */
 #include <unistd.h>       /* POSIX */
+/*
+ * Linux headers.
+ */
+#include <sys/signalfd.h> /* */
 /*
  * Misc headers.
  */
@@ -42,83 +48,367 @@
 #include "input.h"
 #include "lircd.h"
 #include "monitor.h"
+#include "notify.h"
+#include "ring.h"
+#include "sh.h"
 #include "lge.h"
 #include "txir.h"
+#include "macro.h"
 
-int main(int argc,char **argv)
+/*
+ * The reload handler does not use all of its parameters, so we need to let
+ * gcc's -Wused know that it is ok.
+ */
+#ifdef UNUSED
+# error cannot define UNUSED because it is already defined
+#endif
+#if defined(__GNUC__)
+# define UNUSED(x) x __attribute__((unused))
+#else
+# define UNUSED(x) x
+#endif
+
+/*
+ * The settings given on the command line and in the configuration file. The
+ * strings point into the command line or into the configuration file's
+ * arguments, which are kept with the settings.
+ */
+struct eventlircd_options
 {
-    static struct option longopts[] =
-    {
-        {"help",no_argument,NULL,'h'},
-        {"version",no_argument,NULL,'V'},
-        {"verbose",no_argument,NULL,'v'},
-        {"foreground",no_argument,NULL,'f'},
-        {"evmap",required_argument,NULL,'e'},
-        {"socket",required_argument,NULL,'s'},
-        {"mode",required_argument,NULL,'m'},
-        {"repeat-filter",no_argument,NULL,'R'},
-        {"release",required_argument,NULL,'r'},
-        {"lircrc",required_argument,NULL,'C'},
-        {"lge-port",required_argument,NULL,'L'},
-        {"lge-on",required_argument,NULL,0x100},
-        {"lge-off",required_argument,NULL,0x101},
-        {"lge-open-retry",required_argument,NULL,0x102},
-        {"txir",required_argument,NULL,'T'},
-        {0, 0, 0, 0}
-    };
-    const char *progname = NULL;
-    int verbose = 0;
-    bool foreground = false;
-    const char *input_device_evmap_dir = EVMAP_DIR;
-    const char *lircd_socket_path = LIRCD_SOCKET;
-    mode_t lircd_socket_mode = S_IWUSR | S_IRUSR | S_IWGRP | S_IRGRP | S_IWOTH | S_IROTH;
-    bool input_repeat_filter = false;
-    const char *lircd_release_suffix = NULL;
-    int opt;
+    const char *config;
+    char *config_path;                  /* The configuration file's absolute path. */
+    int verbose;
+    bool version;
+    bool foreground;
+    const char *input_device_evmap_dir;
+    const char *lircd_socket_path;
+    mode_t lircd_socket_mode;
+    bool input_repeat_filter;
+    const char *lircd_release_suffix;
+    size_t lircd_client_queue;
+    int lircd_backlog;
+    const char *lircd_binary_socket;
+    const char *lircd_tcp;
+    size_t ring_slots;
+    const char *lircd_output[LIRCD_OUTPUT_MAX];
+    size_t lircd_output_count;
+    const char *lirc_client_config_file;
+    const char *lge_port;
+    const char *lge_on_codes;
+    const char *lge_off_codes;
+    int lge_open_retry;
+    unsigned int lge_poll;
+    const char *lge_protocol;
+    char *lge_ports[LGE_PORT_MAX];
+    size_t lge_port_count;
+    const char *txir;
+    size_t sh_jobs;
+    int ready_fd;
+    char **file_argv;                   /* The configuration file's options as arguments. */
+    int file_argc;
+    char *kept[4 + LIRCD_OUTPUT_MAX];   /* Copies of the settings kept over a reload. */
+    size_t kept_count;
+};
+
+static struct option eventlircd_longopts[] =
+{
+    {"help",no_argument,NULL,'h'},
+    {"version",no_argument,NULL,'V'},
+    {"verbose",no_argument,NULL,'v'},
+    {"foreground",no_argument,NULL,'f'},
+    {"config",required_argument,NULL,'c'},
+    {"evmap",required_argument,NULL,'e'},
+    {"socket",required_argument,NULL,'s'},
+    {"mode",required_argument,NULL,'m'},
+    {"repeat-filter",no_argument,NULL,'R'},
+    {"release",required_argument,NULL,'r'},
+    {"client-queue",required_argument,NULL,'Q'},
+    {"backlog",required_argument,NULL,0x104},
+    {"binary-socket",required_argument,NULL,0x106},
+    {"ring",optional_argument,NULL,0x107},
+    {"output",required_argument,NULL,0x108},
+    {"listen",optional_argument,NULL,0x109},
+    {"lircrc",required_argument,NULL,'C'},
+    {"lge-port",required_argument,NULL,'L'},
+    {"lge-on",required_argument,NULL,0x100},
+    {"lge-off",required_argument,NULL,0x101},
+    {"lge-open-retry",required_argument,NULL,0x102},
+    {"lge-poll",required_argument,NULL,0x10a},
+    {"lge-protocol",required_argument,NULL,0x10b},
+    {"lge",required_argument,NULL,0x10c},
+    {"txir",required_argument,NULL,'T'},
+    {"sh-jobs",required_argument,NULL,0x103},
+    {"ready-fd",required_argument,NULL,0x105},
+    {0, 0, 0, 0}
+};
+
+static const char *eventlircd_progname;
+static int eventlircd_argc;
+static char **eventlircd_argv;
+static struct eventlircd_options eventlircd_options;
+static int eventlircd_reload_fd = -1;
+
+/*
+ * Add the lge serial port described by the value of an --lge option:
+ * name=<name>,port=<path>[,protocol=<file>][,poll=<s>][,open-retry=<n>][,on=<codes>][,off=<codes>]
+ * The codes of on and off are separated by spaces. When reloading, the port
+ * is given to lge_reload() instead. The option is parsed from a copy so that
+ * it can be parsed again.
+ */
+static int lge_port_add(const char *option, bool reload)
+{
+    char *const tokens[] = { "name", "port", "protocol", "poll", "open-retry", "on", "off", NULL };
+    const char *name = NULL;
+    const char *port = NULL;
+    const char *protocol = NULL;
+    const char *on = NULL;
+    const char *off = NULL;
+    unsigned int poll = 0;
+    int open_retry = 0;
+    char *copy;
+    char *spec;
+    char *value;
+    int rc;
+
+    if ((copy = strdup(option)) == NULL)
+    {
+        syslog(LOG_ERR, "lge port: %s\n", strerror(errno));
+        return -1;
+    }
+    spec = copy;
+
+    while (*spec != '\0')
+    {
+        switch (getsubopt(&spec, tokens, &value))
+        {
+            case 0:
+                name = value;
+                break;
+            case 1:
+                port = value;
+                break;
+            case 2:
+                protocol = value;
+                break;
+            case 3:
+                poll = (value != NULL) ? (unsigned int)atoi(value) : 0;
+                break;
+            case 4:
+                open_retry = (value != NULL) ? atoi(value) : 0;
+                break;
+            case 5:
+                on = value;
+                break;
+            case 6:
+                off = (value != NULL) ? value : "";
+                break;
+            default:
+                syslog(LOG_ERR, "lge port: unknown option '%s'\n", (value != NULL) ? value : "");
+                free(copy);
+                return -1;
+        }
+    }
+
+    if ((name == NULL) || (port == NULL))
+    {
+        syslog(LOG_ERR, "lge port: name and port are required\n");
+        free(copy);
+        return -1;
+    }
+
+    if (reload == true)
+        rc = lge_reload(name, port, open_retry, poll, protocol, on, off);
+    else
+        rc = lge_add(name, port, open_retry, poll, protocol, on, off);
+    free(copy);
+    return rc;
+}
+
+/*
+ * Add the lircd output described by the value of an --output option:
+ * name=<name>,socket=<socket>[,mode=<mode>][,release=<suffix>][,lircrc=<file>]
+ * When reloading, only the output's lircrc file is given to lircd_reload().
+ */
+static int output_add(const char *option, mode_t mode, bool reload)
+{
+    char *const tokens[] = { "name", "socket", "mode", "release", "lircrc", NULL };
+    const char *name = NULL;
+    const char *socket_path = NULL;
+    const char *release_suffix = NULL;
     const char *lirc_client_config_file = NULL;
-    const char *lge_port = NULL, *lge_on = NULL, *lge_off = NULL;
-    int lge_open_retry = 0;
-    const char *txir = NULL;
+    char *copy;
+    char *spec;
+    char *value;
+    char *end;
     int rc;
 
-    for (progname = argv[0] ; strchr(progname, '/') != NULL ; progname = strchr(progname, '/') + 1);
+    if ((copy = strdup(option)) == NULL)
+    {
+        syslog(LOG_ERR, "lircd output: %s\n", strerror(errno));
+        return -1;
+    }
+    spec = copy;
+
+    while (*spec != '\0')
+    {
+        switch (getsubopt(&spec, tokens, &value))
+        {
+            case 0:
+                name = value;
+                break;
+            case 1:
+                socket_path = value;
+                break;
+            case 2:
+                if (value != NULL)
+                {
+                    mode = (mode_t)strtol(value, &end, 8);
+                    if ((*value == '\0') || (*end != '\0'))
+                        value = NULL;
+                }
+                if (value == NULL)
+                {
+                    syslog(LOG_ERR, "lircd output: invalid mode\n");
+                    free(copy);
+                    return -1;
+                }
+                break;
+            case 3:
+                release_suffix = value;
+                break;
+            case 4:
+                lirc_client_config_file = value;
+                break;
+            default:
+                syslog(LOG_ERR, "lircd output: unknown option '%s'\n", (value != NULL) ? value : "");
+                free(copy);
+                return -1;
+        }
+    }
+
+    if ((name == NULL) || (socket_path == NULL))
+    {
+        syslog(LOG_ERR, "lircd output: name and socket are required\n");
+        free(copy);
+        return -1;
+    }
+
+    if (reload == true)
+        rc = lircd_reload(name, lirc_client_config_file);
+    else
+        rc = lircd_output_add(name, socket_path, mode, release_suffix, lirc_client_config_file);
+    free(copy);
+    return rc;
+}
+
+static void options_init(struct eventlircd_options *options)
+{
+    memset(options, 0, sizeof(*options));
+    options->input_device_evmap_dir = EVMAP_DIR;
+    options->lircd_socket_path = LIRCD_SOCKET;
+    options->lircd_socket_mode = S_IWUSR | S_IRUSR | S_IWGRP | S_IRGRP | S_IWOTH | S_IROTH;
+    options->lircd_client_queue = LIRCD_CLIENT_QUEUE_DEFAULT;
+    options->lircd_backlog = LIRCD_BACKLOG_DEFAULT;
+    options->sh_jobs = SH_JOBS_DEFAULT;
+    options->ready_fd = -1;
+}
+
+static void options_free(struct eventlircd_options *options)
+{
+    int i;
+
+    for (i = 0 ; i < options->file_argc ; i++)
+        free(options->file_argv[i]);
+    free(options->file_argv);
+    for (i = 0 ; i < (int)options->kept_count ; i++)
+        free(options->kept[i]);
+    free(options->config_path);
+    options_init(options);
+}
+
+static void options_logmask(int verbose)
+{
+    if      (verbose == 0)
+    {
+        setlogmask(0 | LOG_DEBUG | LOG_INFO | LOG_NOTICE);
+    }
+    else if (verbose == 1)
+    {
+        setlogmask(0 | LOG_DEBUG | LOG_INFO);
+    }
+    else if (verbose == 2)
+    {
+        setlogmask(0 | LOG_DEBUG);
+    }
+    else
+    {
+        setlogmask(0);
+    }
+}
 
-    openlog(progname, LOG_CONS | LOG_PERROR | LOG_PID, LOG_DAEMON);
+/*
+ * Parse options into 'options'. 'file' is the configuration file the
+ * arguments come from, or NULL for the command line. Options given more than
+ * once replace the earlier value, except for --output and --lge, which add up.
+ */
+static int options_parse(struct eventlircd_options *options, int argc, char **argv, const char *file)
+{
+    int opt;
 
-    while((opt = getopt_long(argc, argv, "hVvfe:s:m:Rr:C:L:T:", longopts, NULL)) != -1)
+    optind = 0;
+    while((opt = getopt_long(argc, argv, "hVvfc:e:s:m:Rr:Q:C:L:T:", eventlircd_longopts, NULL)) != -1)
     {
         switch(opt)
         {
             case 'h':
-		fprintf(stdout, "Usage: %s [options]\n", progname);
+		fprintf(stdout, "Usage: %s [options]\n", eventlircd_progname);
 		fprintf(stdout, "    -h --help              print this help message and exit\n");
 		fprintf(stdout, "    -V --version           print the program version and exit\n");
 		fprintf(stdout, "    -v --verbose           increase the output message verbosity (-v, -vv or -vvv)\n");
 		fprintf(stdout, "    -f --foreground        run in the foreground\n");
+		fprintf(stdout, "    -c --config=<file>     read options from <file>, reread on SIGHUP\n");
 		fprintf(stdout, "    -e --evmap=<dir>       directory containing input device event map files (default is '%s')\n",
-                                                            input_device_evmap_dir);
+                                                            options->input_device_evmap_dir);
 		fprintf(stdout, "    -s --socket=<socket>   lircd socket (default is '%s')\n",
-                                                            lircd_socket_path);
+                                                            options->lircd_socket_path);
 		fprintf(stdout, "    -m --mode=<mode>       lircd socket mode (default is '%04o')\n",
-                                                            lircd_socket_mode);
+                                                            options->lircd_socket_mode);
 		fprintf(stdout, "    -R --repeat-filter     enable repeat filtering (default is '%s')\n",
-                                                            input_repeat_filter ? "false" : "true");
+                                                            options->input_repeat_filter ? "false" : "true");
 		fprintf(stdout, "    -r --release=<suffix>  generate key release events suffixed with <suffix>\n");
+		fprintf(stdout, "    -Q --client-queue=<n>  input frames queued for a slow lircd client (default is '%lu')\n",
+                                                            (unsigned long)options->lircd_client_queue);
+		fprintf(stdout, "    --backlog=<n>          lircd socket listen backlog (default is '%d')\n",
+                                                            options->lircd_backlog);
+		fprintf(stdout, "    --binary-socket=<socket> binary event socket\n");
+		fprintf(stdout, "    --output=name=<name>,socket=<socket>[,mode=<mode>][,release=<suffix>][,lircrc=<file>]\n");
+		fprintf(stdout, "                           additional lircd socket for devices with eventlircd_output=<name>\n");
+		fprintf(stdout, "    --listen[=[<host>:]<port>] lircd TCP socket (default is '%s:%s')\n",
+                                                            LIRCD_TCP_HOST_DEFAULT, LIRCD_TCP_PORT_DEFAULT);
+		fprintf(stdout, "    --ring[=<n>]           shared memory event ring of <n> slots (default is '%d')\n",
+                                                            RING_SLOTS_DEFAULT);
 		fprintf(stdout, "    -C --lircrc=<file>     lirc client config file\n");
 		fprintf(stdout, "    -L --lge-port=<path>   lge serial port device\n");
 		fprintf(stdout, "    --lge-on=<codes>       lge codes to switch tv on\n");
 		fprintf(stdout, "    --lge-off=<codes>      lge codes to switch tv off\n");
-		fprintf(stdout, "    --lge-open-retry=<n>   retry port open every 100ms\n");
+		fprintf(stdout, "    --lge-open-retry=<n>   open port in background, <n> times at 100ms\n");
+		fprintf(stdout, "    --lge-poll=<s>         read tv state after <s> idle seconds\n");
+		fprintf(stdout, "    --lge-protocol=<file>  serial protocol description (default is LG)\n");
+		fprintf(stdout, "    --lge=name=<name>,port=<path>[,protocol=<file>][,poll=<s>][,open-retry=<n>][,on=<codes>][,off=<codes>]\n");
+		fprintf(stdout, "                           additional serial port for lircrc prog = lge:<name>\n");
 		fprintf(stdout, "    -T --txir=<path>       txir socket path\n");
+		fprintf(stdout, "    --sh-jobs=<n>          lircrc sh commands run at once (default is '%lu')\n",
+                                                            (unsigned long)options->sh_jobs);
+		fprintf(stdout, "    --ready-fd=<fd>        write a newline to <fd> once started\n");
                 exit(EX_OK);
                 break;
             case 'V':
-                fprintf(stdout, PACKAGE_STRING "\n");
+                options->version = true;
                 break;
             case 'v':
-                if (verbose < 3)
+                if (options->verbose < 3)
                 {
-                    verbose++;
+                    options->verbose++;
                 }
                 else
                 {
@@ -126,64 +416,479 @@ int main(int argc,char **argv)
                 }
                 break;
             case 'f':
-                foreground = true;
+                options->foreground = true;
+                break;
+            case 'c':
+                options->config = optarg;
                 break;
             case 'e':
-                input_device_evmap_dir = optarg;
+                options->input_device_evmap_dir = optarg;
                 break;
             case 's':
-                lircd_socket_path = optarg;
+                options->lircd_socket_path = optarg;
                 break;
             case 'm':
-                lircd_socket_mode = (mode_t)atol(optarg);
+                options->lircd_socket_mode = (mode_t)atol(optarg);
                 break;
             case 'R':
-                input_repeat_filter = true;
+                options->input_repeat_filter = true;
                 break;
             case 'r':
-                lircd_release_suffix = optarg;
+                options->lircd_release_suffix = optarg;
+                break;
+            case 'Q':
+                options->lircd_client_queue = (size_t)atol(optarg);
                 break;
             case 'C':
-                lirc_client_config_file = optarg;
+                options->lirc_client_config_file = optarg;
                 break;
             case 'T':
-                txir = optarg;
+                options->txir = optarg;
                 break;
             case 'L':
-                lge_port = optarg;
+                options->lge_port = optarg;
                 break;
             case 0x100:
-                lge_on = optarg;
+                options->lge_on_codes = optarg;
                 break;
             case 0x101:
-                lge_off = optarg;
+                options->lge_off_codes = optarg;
                 break;
             case 0x102:
-                lge_open_retry = atoi(optarg);
+                options->lge_open_retry = atoi(optarg);
+                break;
+            case 0x10a:
+                options->lge_poll = (unsigned int)atoi(optarg);
+                break;
+            case 0x10b:
+                options->lge_protocol = optarg;
+                break;
+            case 0x10c:
+                if (options->lge_port_count == LGE_PORT_MAX)
+                {
+                    syslog(LOG_ERR, "too many lge ports\n");
+                    return -1;
+                }
+                options->lge_ports[options->lge_port_count++] = optarg;
+                break;
+            case 0x103:
+                options->sh_jobs = (size_t)atol(optarg);
+                break;
+            case 0x104:
+                options->lircd_backlog = atoi(optarg);
+                break;
+            case 0x105:
+                options->ready_fd = atoi(optarg);
+                break;
+            case 0x106:
+                options->lircd_binary_socket = optarg;
+                break;
+            case 0x107:
+                options->ring_slots = (optarg != NULL) ? (size_t)atol(optarg) : RING_SLOTS_DEFAULT;
+                break;
+            case 0x108:
+                if (options->lircd_output_count == LIRCD_OUTPUT_MAX)
+                {
+                    syslog(LOG_ERR, "too many lircd outputs\n");
+                    return -1;
+                }
+                options->lircd_output[options->lircd_output_count++] = optarg;
+                break;
+            case 0x109:
+                options->lircd_tcp = (optarg != NULL) ? optarg : LIRCD_TCP_PORT_DEFAULT;
                 break;
             default:
-                fprintf(stderr, "error: unknown option: %c\n", opt);
-                exit(EX_USAGE);
+                syslog(LOG_ERR, "%s: unknown option\n", (file != NULL) ? file : "command line");
+                return -1;
         }
     }
 
-    if      (verbose == 0)
+    return 0;
+}
+
+/*
+ * Read the options in a configuration file. Each line holds one long option
+ * without its leading "--", optionally followed by '=' or blanks and its
+ * value, as in "lircrc = /etc/eventlircd/lircrc". Blank lines and lines that
+ * start with '#' are ignored. The options are turned into arguments and
+ * parsed like the command line.
+ */
+static int options_read(struct eventlircd_options *options, const char *path)
+{
+    FILE *fp;
+    char *line = NULL;
+    size_t line_size = 0;
+    unsigned int line_number = 0;
+    const struct option *longopt;
+    char *name;
+    char *value;
+    char *end;
+    char **argv;
+    size_t arg_size;
+    int rc = 0;
+
+    if ((fp = fopen(path, "r")) == NULL)
     {
-        setlogmask(0 | LOG_DEBUG | LOG_INFO | LOG_NOTICE);
+        syslog(LOG_ERR, "failed to open configuration file %s: %s\n", path, strerror(errno));
+        return -1;
     }
-    else if (verbose == 1)
+
+    if (((options->file_argv = calloc(1, sizeof(char *))) == NULL) ||
+        ((options->file_argv[0] = strdup(path)) == NULL))
     {
-        setlogmask(0 | LOG_DEBUG | LOG_INFO);
+        syslog(LOG_ERR, "failed to allocate memory for configuration file %s: %s\n", path, strerror(errno));
+        fclose(fp);
+        return -1;
     }
-    else if (verbose == 2)
+    options->file_argc = 1;
+
+    while ((rc == 0) && (getline(&line, &line_size, fp) >= 0))
     {
-        setlogmask(0 | LOG_DEBUG);
+        line_number++;
+        for (name = line ; (*name == ' ') || (*name == '\t') ; name++);
+        for (end = name + strlen(name) ; (end > name) && ((end[-1] == '\n') || (end[-1] == ' ') || (end[-1] == '\t') || (end[-1] == '\r')) ; end--);
+        *end = '\0';
+        if ((*name == '\0') || (*name == '#'))
+            continue;
+
+        value = name + strcspn(name, " \t=");
+        if (*value != '\0')
+        {
+            *value++ = '\0';
+            value += strspn(value, " \t");
+            if (*value == '=')
+                value++;
+            value += strspn(value, " \t");
+        }
+
+        for (longopt = eventlircd_longopts ; (longopt->name != NULL) && (strcmp(longopt->name, name) != 0) ; longopt++);
+        if ((longopt->name == NULL) || (longopt->val == 'h') || (longopt->val == 'V') || (longopt->val == 'c'))
+        {
+            syslog(LOG_ERR, "%s:%u: unknown option '%s'\n", path, line_number, name);
+            rc = -1;
+            break;
+        }
+        if ((longopt->has_arg == required_argument) && (*value == '\0'))
+        {
+            syslog(LOG_ERR, "%s:%u: option '%s' needs a value\n", path, line_number, name);
+            rc = -1;
+            break;
+        }
+        if ((longopt->has_arg == no_argument) && (*value != '\0'))
+        {
+            syslog(LOG_ERR, "%s:%u: option '%s' does not take a value\n", path, line_number, name);
+            rc = -1;
+            break;
+        }
+
+        if ((argv = realloc(options->file_argv, (size_t)(options->file_argc + 2) * sizeof(char *))) == NULL)
+        {
+            syslog(LOG_ERR, "failed to allocate memory for configuration file %s: %s\n", path, strerror(errno));
+            rc = -1;
+            break;
+        }
+        options->file_argv = argv;
+        arg_size = 2 + strlen(name) + 1 + strlen(value) + 1;
+        if ((argv[options->file_argc] = malloc(arg_size)) == NULL)
+        {
+            syslog(LOG_ERR, "failed to allocate memory for configuration file %s: %s\n", path, strerror(errno));
+            rc = -1;
+            break;
+        }
+        snprintf(argv[options->file_argc], arg_size, (*value != '\0') ? "--%s=%s" : "--%s", name, value);
+        argv[++options->file_argc] = NULL;
     }
-    else
+
+    free(line);
+    fclose(fp);
+
+    if (rc == 0)
+        rc = options_parse(options, options->file_argc, options->file_argv, path);
+    return rc;
+}
+
+/*
+ * Load the settings: the defaults, then the configuration file, if any, and
+ * then the command line, so that the command line overrides the file.
+ */
+static int options_load(struct eventlircd_options *options, int argc, char **argv, const char *config_path)
+{
+    options_init(options);
+
+    if (config_path != NULL)
     {
-        setlogmask(0);
+        if ((options->config_path = strdup(config_path)) == NULL)
+        {
+            syslog(LOG_ERR, "failed to allocate memory for configuration file %s: %s\n", config_path, strerror(errno));
+            return -1;
+        }
+        if (options_read(options, config_path) != 0)
+            return -1;
+    }
+
+    return options_parse(options, argc, argv, NULL);
+}
+
+static bool options_differ(const char *a, const char *b)
+{
+    if ((a == NULL) || (b == NULL))
+        return (a != b);
+    return (strcmp(a, b) != 0);
+}
+
+/*
+ * Set 'setting' of 'options' to a copy of 'value' that is kept with the
+ * options, because 'value' may point into arguments that are freed. On
+ * failure the setting is left as it is.
+ */
+static void options_keep(struct eventlircd_options *options, const char **setting, const char *value)
+{
+    char *copy;
+
+    if (value == NULL)
+    {
+        *setting = NULL;
+        return;
+    }
+    if ((options->kept_count == sizeof(options->kept) / sizeof(options->kept[0])) ||
+        ((copy = strdup(value)) == NULL))
+    {
+        syslog(LOG_ERR, "failed to keep the setting '%s'\n", value);
+        return;
+    }
+    options->kept[options->kept_count++] = copy;
+    *setting = copy;
+}
+
+/*
+ * Whether two --output values differ in more than their lircrc file, which is
+ * the only part of an output that a reload applies.
+ */
+static bool options_output_differ(const char *a, const char *b)
+{
+    size_t a_length;
+    size_t b_length;
+
+    if ((a == NULL) || (b == NULL))
+        return (a != b);
+    for (;;)
+    {
+        /* Skip the lircrc files, and compare the other suboptions in order. */
+        while (strncmp(a, "lircrc=", 7) == 0)
+            a += strcspn(a, ",") + ((a[strcspn(a, ",")] == ',') ? 1 : 0);
+        while (strncmp(b, "lircrc=", 7) == 0)
+            b += strcspn(b, ",") + ((b[strcspn(b, ",")] == ',') ? 1 : 0);
+        if ((*a == '\0') || (*b == '\0'))
+            return (*a != *b);
+        a_length = strcspn(a, ",");
+        b_length = strcspn(b, ",");
+        if ((a_length != b_length) || (strncmp(a, b, a_length) != 0))
+            return true;
+        a += a_length + ((a[a_length] == ',') ? 1 : 0);
+        b += b_length + ((b[b_length] == ',') ? 1 : 0);
+    }
+}
+
+/*
+ * Warn about the settings that a reload does not apply, and put the settings
+ * in use back into 'new', so that it describes what is running and the next
+ * reload compares against that.
+ */
+static void options_restart(const struct eventlircd_options *old, struct eventlircd_options *new)
+{
+    bool differ;
+    size_t i;
+
+    differ = (old->lircd_output_count != new->lircd_output_count);
+    for (i = 0 ; !differ && i < old->lircd_output_count ; i++)
+        differ = options_output_differ(old->lircd_output[i], new->lircd_output[i]);
+    if (differ)
+    {
+        syslog(LOG_WARNING, "lircd outputs only change on restart, except for their lircrc files\n");
+        for (i = 0 ; i < old->lircd_output_count ; i++)
+            options_keep(new, &new->lircd_output[i], old->lircd_output[i]);
+        new->lircd_output_count = old->lircd_output_count;
+    }
+
+    if (options_differ(old->lircd_socket_path, new->lircd_socket_path) ||
+        (old->lircd_socket_mode != new->lircd_socket_mode) ||
+        options_differ(old->lircd_release_suffix, new->lircd_release_suffix) ||
+        (old->lircd_client_queue != new->lircd_client_queue) ||
+        (old->lircd_backlog != new->lircd_backlog) ||
+        options_differ(old->lircd_binary_socket, new->lircd_binary_socket) ||
+        options_differ(old->lircd_tcp, new->lircd_tcp) ||
+        (old->ring_slots != new->ring_slots) ||
+        (old->sh_jobs != new->sh_jobs))
+    {
+        syslog(LOG_WARNING, "socket, ring and sh job settings only change on restart\n");
+    }
+    options_keep(new, &new->lircd_socket_path, old->lircd_socket_path);
+    new->lircd_socket_mode = old->lircd_socket_mode;
+    options_keep(new, &new->lircd_release_suffix, old->lircd_release_suffix);
+    new->lircd_client_queue = old->lircd_client_queue;
+    new->lircd_backlog = old->lircd_backlog;
+    options_keep(new, &new->lircd_binary_socket, old->lircd_binary_socket);
+    options_keep(new, &new->lircd_tcp, old->lircd_tcp);
+    new->ring_slots = old->ring_slots;
+    new->sh_jobs = old->sh_jobs;
+}
+
+/*
+ * Read the configuration file and the command line again and switch input,
+ * lircd, lge and txir to the new settings together. Every one of them first
+ * builds its new configuration next to the one in use, and only when all of
+ * them have succeeded do they switch; otherwise nothing changes. lircd
+ * clients, grabbed input devices and queued serial and txir commands are
+ * kept.
+ */
+static int reload(void)
+{
+    struct eventlircd_options options;
+    struct timespec start;
+    struct timespec end;
+    long ms;
+    size_t i;
+    int rc;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    rc = options_load(&options, eventlircd_argc, eventlircd_argv, eventlircd_options.config_path);
+
+    if (rc == 0)
+        rc = input_reload(options.input_device_evmap_dir, options.input_repeat_filter);
+
+    if (rc == 0)
+        rc = lircd_reload(LIRCD_OUTPUT_DEFAULT, options.lirc_client_config_file);
+
+    for (i = 0 ; rc == 0 && i < options.lircd_output_count ; i++)
+        rc = output_add(options.lircd_output[i], options.lircd_socket_mode, true);
+
+    if (rc == 0 && options.lge_port != NULL)
+        rc = lge_reload(LGE_NAME_DEFAULT, options.lge_port, options.lge_open_retry, options.lge_poll, options.lge_protocol,
+                        options.lge_on_codes, options.lge_off_codes);
+
+    for (i = 0 ; rc == 0 && i < options.lge_port_count ; i++)
+        rc = lge_port_add(options.lge_ports[i], true);
+
+    if (rc == 0)
+        rc = txir_reload(options.txir);
+
+    input_reload_finish(rc == 0);
+    lircd_reload_finish(rc == 0);
+    lge_reload_finish(rc == 0);
+    txir_reload_finish(rc == 0);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ms = (long)(end.tv_sec - start.tv_sec) * 1000 + (end.tv_nsec - start.tv_nsec) / 1000000;
+
+    if (rc != 0)
+    {
+        syslog(LOG_ERR, "reload failed after %ld ms, the configuration is unchanged\n", ms);
+        options_free(&options);
+        return -1;
+    }
+
+    options_restart(&eventlircd_options, &options);
+    options_logmask(options.verbose);
+    options_free(&eventlircd_options);
+    eventlircd_options = options;
+    syslog(LOG_INFO, "reloaded the configuration in %ld ms\n", ms);
+    return 0;
+}
+
+static int reload_handler(void* UNUSED(id), int UNUSED(ready), struct timeval* UNUSED(now))
+{
+    struct signalfd_siginfo info;
+
+    /* Signals that arrived together are handled by one reload. */
+    while (read(eventlircd_reload_fd, &info, sizeof(info)) == sizeof(info));
+
+    reload();
+    return 0;
+}
+
+/*
+ * Reload on SIGHUP. The signal stays blocked until eventlircd exits, and is
+ * read from a signalfd watched by monitor, so a reload never interrupts the
+ * handling of an event.
+ */
+static int reload_init(void)
+{
+    sigset_t sigmask;
+
+    sigemptyset(&sigmask);
+    sigaddset(&sigmask, SIGHUP);
+    if (sigprocmask(SIG_BLOCK, &sigmask, NULL) != 0)
+    {
+        syslog(LOG_ERR, "failed to block SIGHUP: %s\n", strerror(errno));
+        return -1;
+    }
+    if ((eventlircd_reload_fd = signalfd(-1, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1)
+    {
+        syslog(LOG_ERR, "failed to create SIGHUP signalfd: %s\n", strerror(errno));
+        return -1;
+    }
+    if (monitor_client_add(eventlircd_reload_fd, &reload_handler, NULL) != 0)
+    {
+        close(eventlircd_reload_fd);
+        eventlircd_reload_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+static void reload_exit(void)
+{
+    if (eventlircd_reload_fd != -1)
+    {
+        monitor_client_remove(eventlircd_reload_fd);
+        close(eventlircd_reload_fd);
+        eventlircd_reload_fd = -1;
+    }
+}
+
+int main(int argc,char **argv)
+{
+    struct eventlircd_options *options = &eventlircd_options;
+    char *config_path = NULL;
+    size_t i;
+    int rc;
+
+    for (eventlircd_progname = argv[0] ; strchr(eventlircd_progname, '/') != NULL ; eventlircd_progname = strchr(eventlircd_progname, '/') + 1);
+
+    openlog(eventlircd_progname, LOG_CONS | LOG_PERROR | LOG_PID, LOG_DAEMON);
+
+    /*
+     * The command line names the configuration file, which is read before
+     * the command line is parsed again. Its path is made absolute so that it
+     * can be read again after daemon() changes the directory.
+     */
+    options_init(options);
+    if (options_parse(options, argc, argv, NULL) != 0)
+    {
+        exit(EX_USAGE);
+    }
+    if ((options->config != NULL) && ((config_path = realpath(options->config, NULL)) == NULL))
+    {
+        fprintf(stderr, "error: configuration file %s: %s\n", options->config, strerror(errno));
+        exit(EX_USAGE);
+    }
+    eventlircd_argc = argc;
+    eventlircd_argv = argv;
+    rc = options_load(options, argc, argv, config_path);
+    free(config_path);
+    if (rc != 0)
+    {
+        exit(EX_USAGE);
     }
 
+    if (options->version == true)
+    {
+        fprintf(stdout, PACKAGE_STRING "\n");
+    }
+
+    options_logmask(options->verbose);
+
     signal(SIGPIPE, SIG_IGN);
 
     if (monitor_init() != 0)
@@ -191,15 +896,38 @@ int main(int argc,char **argv)
         exit(EXIT_FAILURE);
     }
 
+    /* Block SIGHUP before anything can report readiness, or a reload sent
+       straight after it would end the process. */
+    if (reload_init() != 0)
+    {
+        monitor_exit();
+        exit(EXIT_FAILURE);
+    }
+
     /* Initialize the lircd socket before daemonizing in order to ensure that programs
        started after it damonizes will have an lircd socket with which to connect. */
-    if (lircd_init(lircd_socket_path, lircd_socket_mode, lircd_release_suffix, lirc_client_config_file) != 0)
+    if (lircd_init(options->lircd_socket_path, options->lircd_socket_mode, options->lircd_release_suffix, options->lirc_client_config_file, options->lircd_client_queue, options->lircd_backlog, options->lircd_binary_socket) != 0)
     {
         monitor_exit();
         exit(EXIT_FAILURE);
     }
+    for (i = 0 ; i < options->lircd_output_count ; i++)
+    {
+        if (output_add(options->lircd_output[i], options->lircd_socket_mode, false) != 0)
+        {
+            monitor_exit();
+            lircd_exit();
+            exit(EXIT_FAILURE);
+        }
+    }
+    if ((options->lircd_tcp != NULL) && (lircd_tcp_add(options->lircd_tcp) != 0))
+    {
+        monitor_exit();
+        lircd_exit();
+        exit(EXIT_FAILURE);
+    }
 
-    if (foreground != true)
+    if (options->foreground != true)
     {
         if (daemon(0, 0) != 0)
         {
@@ -209,18 +937,32 @@ int main(int argc,char **argv)
         }
     }
 
-    rc = 0;
+    rc = txir_init(options->txir);
 
-    txir_init(txir);
+    if (rc == 0)
+        rc = sh_init(options->sh_jobs);
 
-    if (lge_port != NULL)
-	   rc = lge_init(lge_port, lge_open_retry);
+    if (rc == 0)
+        rc = macro_init();
 
     if (rc == 0)
-    	rc = input_init(input_device_evmap_dir, input_repeat_filter);
+        rc = ring_init(options->ring_slots);
+
+    if (rc == 0 && options->lge_port != NULL)
+	   rc = lge_add(LGE_NAME_DEFAULT, options->lge_port, options->lge_open_retry, options->lge_poll, options->lge_protocol, options->lge_on_codes, options->lge_off_codes);
 
-    if (rc == 0 && lge_on != NULL)
-	rc = lge_send(lge_on, NULL);
+    for (i = 0 ; rc == 0 && i < options->lge_port_count ; i++)
+	rc = lge_port_add(options->lge_ports[i], false);
+
+    if (rc == 0)
+    	rc = input_init(options->input_device_evmap_dir, options->input_repeat_filter);
+
+    /* Readiness failures are logged but are not fatal. */
+    if (rc == 0)
+        notify_ready(options->ready_fd);
+
+    if (rc == 0)
+	rc = lge_on();
 
     if (rc == 0)
    	rc = monitor_run();
@@ -228,11 +970,16 @@ int main(int argc,char **argv)
     if (rc == 0)
 	rc = input_exit();
 
-    if (rc == 0 && lge_off != NULL) {
-	rc = lge_send(lge_off, NULL);
-    	if (rc == 0)
-		rc = lge_push(0);
-    	if (rc == 0)
+    reload_exit();
+
+    /* A macro still waiting must not send after the off codes. */
+    if (rc == 0)
+	rc = macro_exit();
+
+    /* Run until every lge port has sent its off codes. */
+    if (rc == 0) {
+	rc = lge_off();
+    	if (rc > 0)
    		rc = monitor_run();
     }
 
@@ -248,13 +995,22 @@ int main(int argc,char **argv)
     if (rc == 0)
 	rc = txir_exit();
 
+    if (rc == 0)
+	rc = sh_exit();
+
+    ring_exit();
+
     if (rc == -1)
     {
 	input_exit();
+	reload_exit();
         monitor_exit();
         lircd_exit();
 	lge_exit();
 	txir_exit();
+	sh_exit();
+	macro_exit();
+	ring_exit();
         exit(EXIT_FAILURE);
     }
 
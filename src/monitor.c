@@ -36,22 +36,41 @@
 #include "lircd.h"
 #include "monitor.h"
 
+/*
+ * The signal handlers do not use all of their parameters, so we need to let
+ * gcc's -Wused know that it is ok.
+ */
+#ifdef UNUSED
+# error cannot define UNUSED because it is already defined
+#endif
+#if defined(__GNUC__)
+# define UNUSED(x) x __attribute__((unused))
+#else
+# define UNUSED(x) x
+#endif
+
+#define MONITOR_STATS_MAX 8
+
 struct monitor_client {
 	int fd;
 	int (*handler)(void *id, int ready, struct timeval *now);
 	void *id;
 	struct timeval timeout;
+	bool write;
 	struct monitor_client *next;
 };
 
 struct {
 	struct monitor_client *client_list;
+	void (*stats[MONITOR_STATS_MAX])(void);
 } eventlircd_monitor = {
-	.client_list = NULL
+	.client_list = NULL,
+	.stats = { NULL }
 };
 
 static bool monitor_sigterm_active = false;
 static int  monitor_sigterm_signal = 0;
+static volatile sig_atomic_t monitor_sigusr1_active = 0;
 
 static int monitor_client_close(struct monitor_client *client)
 {
@@ -64,10 +83,16 @@ static int monitor_client_close(struct monitor_client *client)
 	client->handler = NULL;
 	client->id = NULL;
 	timerclear(&client->timeout);
+	client->write = false;
 
 	return 0;
 }
 
+/*
+ * Free the clients that monitor_client_remove closed. Handlers remove clients
+ * while monitor_run is walking the list, so the nodes stay linked until the
+ * walk is over and are freed here.
+ */
 static int monitor_client_purge()
 {
 	struct monitor_client **client_ptr;
@@ -82,9 +107,9 @@ static int monitor_client_purge()
 		if (client->fd == -1) {
 			*client_ptr = client->next;
 			if (monitor_client_close(client) != 0) {
-				free(client);
 				return_code = -1;
 			}
+			free(client);
 		} else {
 			client_ptr = &((*client_ptr)->next);
 		}
@@ -107,9 +132,6 @@ int monitor_client_remove(int fd)
 			}
 		}
 	}
-	if (monitor_client_purge() != 0) {
-		return_code = -1;
-	}
 
 	return return_code;
 }
@@ -138,6 +160,7 @@ int monitor_client_add(int fd, int (*handler)(void *id, int ready, struct timeva
 	client->handler = handler;
 	client->id = id;
 	timerclear(&client->timeout);
+	client->write = false;
 
 	client->next = eventlircd_monitor.client_list;
 	eventlircd_monitor.client_list = client;
@@ -145,6 +168,44 @@ int monitor_client_add(int fd, int (*handler)(void *id, int ready, struct timeva
 	return 0;
 }
 
+/*
+ * Ask monitor to also call the file descriptor's handler when the file
+ * descriptor is ready for writing. Clients that queue output use this to flush
+ * the queue without blocking, and turn it off again once the queue is empty.
+ */
+int monitor_client_write(int fd, bool enable)
+{
+	struct monitor_client *client;
+
+	for (client = eventlircd_monitor.client_list ; client != NULL ; client = client->next) {
+		if (client->fd == fd) {
+			client->write = enable;
+			return 0;
+		}
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+ * Register a function that logs statistics when eventlircd receives SIGUSR1.
+ */
+int monitor_stats_add(void (*stats)(void))
+{
+	size_t i;
+
+	for (i = 0 ; i < MONITOR_STATS_MAX ; i++) {
+		if ((eventlircd_monitor.stats[i] == NULL) || (eventlircd_monitor.stats[i] == stats)) {
+			eventlircd_monitor.stats[i] = stats;
+			return 0;
+		}
+	}
+
+	errno = ENOSPC;
+	return -1;
+}
+
 int monitor_exit()
 {
 	struct monitor_client *client;
@@ -182,6 +243,11 @@ void monitor_timeout(int fd, struct timeval *timeout) {
 	}
 }
 
+static void monitor_sigusr1_handler(int UNUSED(signal))
+{
+	monitor_sigusr1_active = 1;
+}
+
 void monitor_sigterm_handler(int signal)
 {
 	if (monitor_sigterm_active == true) {
@@ -204,7 +270,10 @@ int monitor_run()
 	struct sigaction signal_action;
 	struct monitor_client *client;
 	fd_set fdset;
+	fd_set fdset_write;
 	int nfds;
+	int ready;
+	size_t i;
 	struct timeval timeout, now;
 
 	monitor_sigterm_active = false;
@@ -213,13 +282,27 @@ int monitor_run()
 	signal_action.sa_flags=SA_RESTART;
 	sigaction(SIGTERM, &signal_action, NULL);
 	sigaction(SIGINT,  &signal_action, NULL);
+	signal_action.sa_handler = monitor_sigusr1_handler;
+	sigaction(SIGUSR1, &signal_action, NULL);
 
 	while (true) {
 		if (monitor_sigterm_active == true) {
 			break;
 		}
 
+		if (monitor_client_purge() != 0) {
+			return -1;
+		}
+
+		if (monitor_sigusr1_active != 0) {
+			monitor_sigusr1_active = 0;
+			for (i = 0 ; (i < MONITOR_STATS_MAX) && (eventlircd_monitor.stats[i] != NULL) ; i++) {
+				eventlircd_monitor.stats[i]();
+			}
+		}
+
 		FD_ZERO(&fdset);
+		FD_ZERO(&fdset_write);
 		nfds = 0;
 		timerclear(&timeout);
 		for (client = eventlircd_monitor.client_list ; client != NULL ; client = client->next) {
@@ -227,6 +310,9 @@ int monitor_run()
 				continue;
 			}
 			FD_SET(client->fd, &fdset);
+			if (client->write == true) {
+				FD_SET(client->fd, &fdset_write);
+			}
 			if (nfds < client->fd) {
 				nfds = client->fd;
 			}
@@ -235,7 +321,7 @@ int monitor_run()
 		}
 		nfds++;
 
-		if (select(nfds, &fdset, NULL, NULL, timerisset(&timeout) ? &timeout : NULL) < 0) {
+		if (select(nfds, &fdset, &fdset_write, NULL, timerisset(&timeout) ? &timeout : NULL) < 0) {
 			if (errno == EINTR) {
 				continue;
 			}
@@ -249,9 +335,16 @@ int monitor_run()
 			if (client->fd == -1) {
 				continue;
 			}
-			if (FD_ISSET(client->fd, &fdset) || timerisset(&client->timeout)) {
+			ready = 0;
+			if (FD_ISSET(client->fd, &fdset)) {
+				ready |= MONITOR_READ;
+			}
+			if ((client->write == true) && FD_ISSET(client->fd, &fdset_write)) {
+				ready |= MONITOR_WRITE;
+			}
+			if ((ready != 0) || timerisset(&client->timeout)) {
 				timerclear(&client->timeout);
-				client->handler(client->id, FD_ISSET(client->fd, &fdset), &now);
+				client->handler(client->id, ready, &now);
 			}
 		}
 	}
@@ -19,12 +19,21 @@
 #ifndef _EVENTLIRCD_MONITOR_H_
 #define _EVENTLIRCD_MONITOR_H_ 1
 
+#include <stdbool.h>
 #include <sys/time.h>
 
+/*
+ * The readiness flags passed to a monitor client's handler.
+ */
+#define MONITOR_READ  0x1
+#define MONITOR_WRITE 0x2
+
 int monitor_init();
 int monitor_exit();
 int monitor_client_add(int fd, int (*handler)(void *id, int ready, struct timeval *now), void *id);
 int monitor_client_remove(int fd);
+int monitor_client_write(int fd, bool enable);
+int monitor_stats_add(void (*stats)(void));
 void monitor_timeout(int fd, struct timeval *timeout);
 int monitor_now(struct timeval *time);
 void monitor_sigterm_handler(int signal);
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2009-2010 Paul Bender.
+ *
+ * This file is part of eventlircd.
+ *
+ * eventlircd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * eventlircd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eventlircd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Single Unix Specification Version 3 headers.
+ */
+#include <errno.h>        /* C89 */
+#include <stddef.h>       /* C89 */
+#include <stdio.h>        /* C89 */
+#include <stdlib.h>       /* C89 */
+#include <string.h>       /* C89 */
+#include <sys/socket.h>   /* POSIX */
+#include <sys/types.h>    /* POSIX */
+#include <sys/un.h>       /* XSI */
+#include <syslog.h>       /* XSI */
+#include <unistd.h>       /* POSIX */
+/*
+ * eventlircd headers.
+ */
+#include "notify.h"
+
+/*
+ * Send "READY=1" to the service manager's notification socket named by
+ * NOTIFY_SOCKET. A name starting with '@' is in the abstract namespace.
+ */
+static int notify_socket(const char *name)
+{
+	struct sockaddr_un addr;
+	socklen_t addr_len;
+	char message[64];
+	int message_len;
+	size_t name_len;
+	int fd;
+
+	name_len = strlen(name);
+	if (((name[0] != '/') && (name[0] != '@')) || (name_len < 2) || (name_len >= sizeof addr.sun_path)) {
+		errno = EINVAL;
+		syslog(LOG_WARNING,
+		       "invalid NOTIFY_SOCKET '%s'\n",
+		       name);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, name, name_len);
+	if (addr.sun_path[0] == '@') {
+		addr.sun_path[0] = '\0';
+	}
+	addr_len = (socklen_t)(offsetof(struct sockaddr_un, sun_path) + name_len);
+
+	/*
+	 * MAINPID is sent because the pid changes when eventlircd daemonizes.
+	 */
+	message_len = snprintf(message, sizeof message, "READY=1\nMAINPID=%ld", (long)getpid());
+
+	if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) == -1) {
+		syslog(LOG_WARNING,
+		       "failed to create notification socket: %s\n",
+		       strerror(errno));
+		return -1;
+	}
+	if (sendto(fd, message, (size_t)message_len, MSG_NOSIGNAL, (struct sockaddr *)&addr, addr_len) != message_len) {
+		syslog(LOG_WARNING,
+		       "failed to notify %s: %s\n",
+		       name,
+		       strerror(errno));
+		close(fd);
+		return -1;
+	}
+	close(fd);
+
+	return 0;
+}
+
+/*
+ * Tell whoever started eventlircd that it is ready: the lircd socket is
+ * accepting clients and the input devices present at startup have been added.
+ * Readiness is sent to the notification socket named by NOTIFY_SOCKET, if it
+ * is set, and as a newline written to 'fd' (a readiness pipe), if it is not
+ * -1. The file descriptor is closed afterwards.
+ */
+int notify_ready(int fd)
+{
+	const char *name;
+	int return_code;
+
+	return_code = 0;
+
+	if ((name = getenv("NOTIFY_SOCKET")) != NULL) {
+		if (notify_socket(name) != 0) {
+			return_code = -1;
+		}
+		unsetenv("NOTIFY_SOCKET");
+	}
+
+	if (fd != -1) {
+		if (write(fd, "\n", 1) != 1) {
+			syslog(LOG_WARNING,
+			       "failed to write readiness to file descriptor %d: %s\n",
+			       fd,
+			       strerror(errno));
+			return_code = -1;
+		}
+		close(fd);
+	}
+
+	return return_code;
+}
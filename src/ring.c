@@ -0,0 +1,194 @@
+/*
+ * Copyright (C) 2009-2010 Paul Bender.
+ *
+ * This file is part of eventlircd.
+ *
+ * eventlircd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * eventlircd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eventlircd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * memfd_create() and the file sealing fcntl() commands are Linux extensions.
+ */
+#define _GNU_SOURCE 1
+
+/*
+ * Single Unix Specification Version 3 headers.
+ */
+#include <errno.h>        /* C89 */
+#include <fcntl.h>        /* POSIX */
+#include <stddef.h>       /* C89 */
+#include <stdint.h>       /* POSIX */
+#include <string.h>       /* C89 */
+#include <sys/mman.h>     /* POSIX */
+#include <syslog.h>       /* XSI */
+#include <unistd.h>       /* POSIX */
+/*
+ * eventlircd headers.
+ */
+#include "ring.h"
+
+/*
+ * The largest number of slots (48 MiB of records).
+ */
+#define RING_SLOTS_MAX (1 << 20)
+
+static struct {
+	int fd;                             /* The memfd holding the ring. */
+	size_t size;                        /* The size of the mapping. */
+	struct ring_header *header;
+	struct ring_slot *slot;
+	__u64 committed;                    /* The head at the last ring_commit(). */
+} eventlircd_ring = {
+	.fd = -1,
+	.size = 0,
+	.header = NULL,
+	.slot = NULL,
+	.committed = 0
+};
+
+/*
+ * Create the ring with 'slot_count' slots, which must be a power of two.
+ * Nothing is created when 'slot_count' is 0.
+ */
+int ring_init(size_t slot_count)
+{
+	void *map;
+	int seals;
+	int rc;
+
+	if (slot_count == 0) {
+		return 0;
+	}
+	if (((slot_count & (slot_count - 1)) != 0) || (slot_count > RING_SLOTS_MAX)) {
+		errno = EINVAL;
+		syslog(LOG_ERR,
+		       "invalid event ring size %lu: it must be a power of two no larger than %d\n",
+		       (unsigned long)slot_count,
+		       RING_SLOTS_MAX);
+		return -1;
+	}
+
+	eventlircd_ring.size = sizeof(struct ring_header) + slot_count * sizeof(struct ring_slot);
+
+	if ((eventlircd_ring.fd = memfd_create("eventlircd-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING)) == -1) {
+		syslog(LOG_ERR,
+		       "failed to create event ring: %s\n",
+		       strerror(errno));
+		return -1;
+	}
+	if (ftruncate(eventlircd_ring.fd, (off_t)eventlircd_ring.size) != 0) {
+		syslog(LOG_ERR,
+		       "failed to size event ring: %s\n",
+		       strerror(errno));
+		ring_exit();
+		return -1;
+	}
+	if ((map = mmap(NULL, eventlircd_ring.size, PROT_READ | PROT_WRITE, MAP_SHARED, eventlircd_ring.fd, 0)) == MAP_FAILED) {
+		syslog(LOG_ERR,
+		       "failed to map event ring: %s\n",
+		       strerror(errno));
+		ring_exit();
+		return -1;
+	}
+	eventlircd_ring.header = (struct ring_header *)map;
+	eventlircd_ring.slot = (struct ring_slot *)(eventlircd_ring.header + 1);
+
+	/*
+	 * Consumers must not be able to resize the ring under us, or (where
+	 * the kernel supports it) write to it.
+	 */
+	seals = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL;
+	rc = -1;
+#ifdef F_SEAL_FUTURE_WRITE
+	rc = fcntl(eventlircd_ring.fd, F_ADD_SEALS, seals | F_SEAL_FUTURE_WRITE);
+#endif
+	if (rc != 0) {
+		rc = fcntl(eventlircd_ring.fd, F_ADD_SEALS, seals);
+	}
+	if (rc != 0) {
+		syslog(LOG_ERR,
+		       "failed to seal event ring: %s\n",
+		       strerror(errno));
+		ring_exit();
+		return -1;
+	}
+
+	eventlircd_ring.header->magic = RING_MAGIC;
+	eventlircd_ring.header->version = RING_VERSION;
+	eventlircd_ring.header->slot_size = sizeof(struct ring_slot);
+	eventlircd_ring.header->slot_count = (__u32)slot_count;
+	eventlircd_ring.header->head = 0;
+	eventlircd_ring.committed = 0;
+
+	return 0;
+}
+
+void ring_exit(void)
+{
+	if (eventlircd_ring.header != NULL) {
+		munmap(eventlircd_ring.header, eventlircd_ring.size);
+		eventlircd_ring.header = NULL;
+		eventlircd_ring.slot = NULL;
+	}
+	if (eventlircd_ring.fd != -1) {
+		close(eventlircd_ring.fd);
+		eventlircd_ring.fd = -1;
+	}
+}
+
+/*
+ * Return the ring's memfd, or -1 when there is no ring.
+ */
+int ring_fd(void)
+{
+	return eventlircd_ring.fd;
+}
+
+/*
+ * Write a record into the next slot. The slot's sequence number is cleared
+ * before the record is written and set after it, so that a consumer copying
+ * the slot at the same time can tell that its copy is torn.
+ */
+void ring_write(const struct lircd_record *record)
+{
+	struct ring_slot *slot;
+	__u64 seq;
+
+	if (eventlircd_ring.header == NULL) {
+		return;
+	}
+
+	seq = eventlircd_ring.header->head;
+	slot = &(eventlircd_ring.slot[seq & (eventlircd_ring.header->slot_count - 1)]);
+
+	__atomic_store_n(&(slot->seq), 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&(slot->record), record, sizeof slot->record);
+	__atomic_store_n(&(slot->seq), seq + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&(eventlircd_ring.header->head), seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Return 1 when records have been written since the last call, meaning that
+ * waiting consumers should be woken up, and 0 otherwise.
+ */
+int ring_commit(void)
+{
+	if ((eventlircd_ring.header == NULL) || (eventlircd_ring.header->head == eventlircd_ring.committed)) {
+		return 0;
+	}
+	eventlircd_ring.committed = eventlircd_ring.header->head;
+
+	return 1;
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright (C) 2009-2010 Paul Bender.
+ *
+ * This file is part of eventlircd.
+ *
+ * eventlircd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * eventlircd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eventlircd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _EVENTLIRCD_RING_H_
+#define _EVENTLIRCD_RING_H_ 1
+
+/*
+ * Linux headers.
+ */
+#include <linux/types.h>  /* */
+/*
+ * eventlircd headers.
+ */
+#include "lircd.h"
+
+/*
+ * The shared memory event ring. Every mapped input event, including relative
+ * and absolute motion, is written as a 'lircd_record' into the next slot of a
+ * ring in a memfd that lircd clients map read only (the RING command).
+ *
+ * A consumer keeps the sequence number of the next record it wants, starting
+ * with 'head'. Record 'seq' is in slot 'seq % slot_count' and has been
+ * completely written when the slot's 'seq' is 'seq + 1'. A consumer:
+ *
+ *   1. reads 'head' (acquire); if it is not past its sequence number, then it
+ *      waits for its eventfd to become readable;
+ *   2. reads the slot's 'seq' (acquire), copies the record and reads the
+ *      slot's 'seq' again (after an acquire fence);
+ *   3. uses the copy if both reads were 'seq + 1'. Otherwise the producer has
+ *      lapped the consumer, which has lost the records before
+ *      'head - slot_count' and starts again from there.
+ *
+ * The producer never waits for consumers.
+ */
+#define RING_MAGIC   0x52524c45         /* "ELRR" */
+#define RING_VERSION 1
+
+/*
+ * The default number of slots.
+ */
+#define RING_SLOTS_DEFAULT 4096
+
+struct ring_header {
+	__u32 magic;                        /* RING_MAGIC. */
+	__u32 version;                      /* RING_VERSION. */
+	__u32 slot_size;                    /* sizeof(struct ring_slot). */
+	__u32 slot_count;                   /* The number of slots (a power of two). */
+	__u64 head;                         /* The sequence number of the next record to be written. */
+	__u8 reserved[40];
+};
+
+struct ring_slot {
+	__u64 seq;                          /* The record's sequence number + 1 (0 while it is being written). */
+	struct lircd_record record;
+};
+
+int ring_init(size_t slot_count);
+void ring_exit(void);
+int ring_fd(void);
+void ring_write(const struct lircd_record *record);
+int ring_commit(void);
+
+#endif
@@ -0,0 +1,454 @@
+/*
+ * Copyright (C) 2009-2010 Paul Bender.
+ *
+ * This file is part of eventlircd.
+ *
+ * eventlircd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * eventlircd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eventlircd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Single Unix Specification Version 3 headers.
+ */
+#include <errno.h>        /* C89 */
+#include <signal.h>       /* C89 */
+#include <spawn.h>        /* ADV */
+#include <stdbool.h>      /* C99 */
+#include <stdlib.h>       /* C89 */
+#include <string.h>       /* C89 */
+#include <sys/time.h>     /* XSI */
+#include <sys/types.h>    /* POSIX */
+#include <sys/wait.h>     /* POSIX */
+#include <syslog.h>       /* XSI */
+#include <time.h>         /* C89 */
+#include <unistd.h>       /* POSIX */
+/*
+ * Linux headers.
+ */
+#include <sys/signalfd.h> /* */
+/*
+ * eventlircd headers.
+ */
+#include "monitor.h"
+#include "sh.h"
+
+/*
+ * The monitor handler does not use all of its parameters, so we need to let
+ * gcc's -Wused know that it is ok.
+ */
+#ifdef UNUSED
+# error cannot define UNUSED because it is already defined
+#endif
+#if defined(__GNUC__)
+# define UNUSED(x) x __attribute__((unused))
+#else
+# define UNUSED(x) x
+#endif
+
+/*
+ * The most sh commands that wait for a free job slot. Further commands are
+ * dropped until the queue drains.
+ */
+#define SH_QUEUE_MAX 32
+
+extern char **environ;
+
+/*
+ * The 'sh' structure holds the sh commands run for lircrc 'sh' entries.
+ * Commands run in child processes so that a slow command does not delay key
+ * events. At most 'jobs' commands run at once, and a command that is already
+ * running or waiting is not run again in parallel: while it runs, the same
+ * command is queued at most once, and later copies (typically from key
+ * repeats) are coalesced into the queued one. Children are reaped when the
+ * SIGCHLD signalfd, which is watched by monitor, becomes readable.
+ */
+struct sh_job {
+	pid_t pid;                          /* The child's pid (0 when the slot is free). */
+	char *cmd;                          /* The command the child runs. */
+	struct timespec start;              /* When the child was started. */
+};
+
+struct {
+	int fd;                             /* The SIGCHLD signalfd. */
+	sigset_t sigmask;                   /* The signal mask before SIGCHLD was blocked. */
+	struct sh_job *job;                 /* The job slots. */
+	size_t jobs;                        /* The number of job slots. */
+	size_t running;                     /* The number of job slots in use. */
+	char *queue[SH_QUEUE_MAX];          /* The commands waiting for a job slot, oldest first. */
+	size_t queue_count;                 /* The number of commands waiting. */
+	struct {                            /* The counters. */
+		unsigned long started;      /* The number of commands started. */
+		unsigned long failed;       /* The number of commands that did not exit with status 0. */
+		unsigned long coalesced;    /* The number of commands coalesced into a waiting command. */
+		unsigned long dropped;      /* The number of commands dropped because the queue was full. */
+		unsigned long time_total;   /* The total run time of the finished commands (ms). */
+		unsigned long time_max;     /* The longest run time of a finished command (ms). */
+	} stats;
+} eventlircd_sh = {
+	.fd = -1,
+	.job = NULL,
+	.jobs = 0,
+	.running = 0,
+	.queue = { NULL },
+	.queue_count = 0
+};
+
+static int sh_start(char *cmd)
+{
+	struct sh_job *job;
+	posix_spawnattr_t attr;
+	sigset_t sigdefault;
+	sigset_t sigmask;
+	char *argv[4];
+	size_t i;
+	int rc;
+
+	job = NULL;
+	for (i = 0 ; i < eventlircd_sh.jobs ; i++) {
+		if (eventlircd_sh.job[i].pid == 0) {
+			job = &(eventlircd_sh.job[i]);
+			break;
+		}
+	}
+	if (job == NULL) {
+		errno = EBUSY;
+		return -1;
+	}
+
+	/*
+	 * The child starts with the signal mask and the SIGPIPE disposition that
+	 * a command run by the shell expects, rather than eventlircd's.
+	 */
+	if ((rc = posix_spawnattr_init(&attr)) != 0) {
+		errno = rc;
+		syslog(LOG_ERR,
+		       "failed to run sh command '%s': %s\n",
+		       cmd,
+		       strerror(errno));
+		return -1;
+	}
+	sigemptyset(&sigdefault);
+	sigaddset(&sigdefault, SIGPIPE);
+	sigaddset(&sigdefault, SIGCHLD);
+	/* SIGHUP is blocked only for eventlircd's reload signalfd. */
+	sigmask = eventlircd_sh.sigmask;
+	sigdelset(&sigmask, SIGHUP);
+	posix_spawnattr_setsigmask(&attr, &sigmask);
+	posix_spawnattr_setsigdefault(&attr, &sigdefault);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+	argv[0] = "sh";
+	argv[1] = "-c";
+	argv[2] = cmd;
+	argv[3] = NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &job->start);
+	rc = posix_spawn(&job->pid, "/bin/sh", NULL, &attr, argv, environ);
+	posix_spawnattr_destroy(&attr);
+	if (rc != 0) {
+		errno = rc;
+		syslog(LOG_ERR,
+		       "failed to run sh command '%s': %s\n",
+		       cmd,
+		       strerror(errno));
+		job->pid = 0;
+		eventlircd_sh.stats.failed++;
+		return -1;
+	}
+
+	job->cmd = cmd;
+	eventlircd_sh.running++;
+	eventlircd_sh.stats.started++;
+
+	return 0;
+}
+
+static bool sh_is_running(const char *cmd)
+{
+	size_t i;
+
+	for (i = 0 ; i < eventlircd_sh.jobs ; i++) {
+		if ((eventlircd_sh.job[i].pid != 0) && (strcmp(eventlircd_sh.job[i].cmd, cmd) == 0)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+/*
+ * Start the oldest waiting commands that can run now.
+ */
+static void sh_dequeue()
+{
+	char *cmd;
+	size_t i;
+
+	i = 0;
+	while ((i < eventlircd_sh.queue_count) && (eventlircd_sh.running < eventlircd_sh.jobs)) {
+		cmd = eventlircd_sh.queue[i];
+		if (sh_is_running(cmd) == true) {
+			i++;
+			continue;
+		}
+		eventlircd_sh.queue_count--;
+		memmove(&(eventlircd_sh.queue[i]),
+		        &(eventlircd_sh.queue[i + 1]),
+		        (eventlircd_sh.queue_count - i) * sizeof(char *));
+		if (sh_start(cmd) != 0) {
+			free(cmd);
+		}
+	}
+}
+
+static void sh_reap(struct sh_job *job, int status)
+{
+	struct timespec end;
+	unsigned long time;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	time = (unsigned long)((end.tv_sec - job->start.tv_sec) * 1000 + (end.tv_nsec - job->start.tv_nsec) / 1000000);
+
+	eventlircd_sh.stats.time_total += time;
+	if (eventlircd_sh.stats.time_max < time) {
+		eventlircd_sh.stats.time_max = time;
+	}
+
+	if (WIFEXITED(status) && (WEXITSTATUS(status) == 0)) {
+		syslog(LOG_DEBUG,
+		       "sh command '%s' finished in %lu ms\n",
+		       job->cmd,
+		       time);
+	} else {
+		eventlircd_sh.stats.failed++;
+		if (WIFEXITED(status)) {
+			syslog(LOG_WARNING,
+			       "sh command '%s' exited with status %d after %lu ms\n",
+			       job->cmd,
+			       WEXITSTATUS(status),
+			       time);
+		} else {
+			syslog(LOG_WARNING,
+			       "sh command '%s' was killed by signal %d after %lu ms\n",
+			       job->cmd,
+			       WTERMSIG(status),
+			       time);
+		}
+	}
+
+	free(job->cmd);
+	job->cmd = NULL;
+	job->pid = 0;
+	eventlircd_sh.running--;
+}
+
+static int sh_handler(void *UNUSED(id), int ready, struct timeval *UNUSED(now))
+{
+	struct signalfd_siginfo info;
+	int status;
+	size_t i;
+
+	if ((ready & MONITOR_READ) == 0) {
+		return 0;
+	}
+
+	/*
+	 * SIGCHLD signals are merged while pending, so read them all and then
+	 * check every running child.
+	 */
+	while (read(eventlircd_sh.fd, &info, sizeof info) == sizeof info);
+
+	for (i = 0 ; i < eventlircd_sh.jobs ; i++) {
+		if (eventlircd_sh.job[i].pid == 0) {
+			continue;
+		}
+		if (waitpid(eventlircd_sh.job[i].pid, &status, WNOHANG) == eventlircd_sh.job[i].pid) {
+			sh_reap(&(eventlircd_sh.job[i]), status);
+		}
+	}
+
+	sh_dequeue();
+
+	return 0;
+}
+
+static void sh_stats(void)
+{
+	unsigned long finished;
+
+	finished = eventlircd_sh.stats.started - (unsigned long)eventlircd_sh.running;
+	syslog(LOG_INFO,
+	       "sh commands: started %lu, failed %lu, coalesced %lu, dropped %lu, average %lu ms, max %lu ms, running %lu, queued %lu\n",
+	       eventlircd_sh.stats.started,
+	       eventlircd_sh.stats.failed,
+	       eventlircd_sh.stats.coalesced,
+	       eventlircd_sh.stats.dropped,
+	       (finished > 0) ? eventlircd_sh.stats.time_total / finished : 0,
+	       eventlircd_sh.stats.time_max,
+	       (unsigned long)eventlircd_sh.running,
+	       (unsigned long)eventlircd_sh.queue_count);
+}
+
+/*
+ * Run a sh command without waiting for it to finish.
+ */
+int sh_run(const char *cmd)
+{
+	char *copy;
+	size_t i;
+
+	if (cmd == NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (eventlircd_sh.fd == -1) {
+		errno = EBADF;
+		return -1;
+	}
+
+	for (i = 0 ; i < eventlircd_sh.queue_count ; i++) {
+		if (strcmp(eventlircd_sh.queue[i], cmd) == 0) {
+			eventlircd_sh.stats.coalesced++;
+			return 0;
+		}
+	}
+
+	if ((copy = strdup(cmd)) == NULL) {
+		syslog(LOG_ERR,
+		       "failed to allocate memory for sh command '%s': %s\n",
+		       cmd,
+		       strerror(errno));
+		return -1;
+	}
+
+	if ((eventlircd_sh.running < eventlircd_sh.jobs) && (sh_is_running(copy) == false)) {
+		if (sh_start(copy) != 0) {
+			free(copy);
+			return -1;
+		}
+		return 0;
+	}
+
+	if (eventlircd_sh.queue_count == SH_QUEUE_MAX) {
+		if (eventlircd_sh.stats.dropped++ == 0) {
+			syslog(LOG_WARNING,
+			       "sh command queue is full, dropping '%s'\n",
+			       copy);
+		}
+		free(copy);
+		return 0;
+	}
+	eventlircd_sh.queue[eventlircd_sh.queue_count++] = copy;
+
+	return 0;
+}
+
+int sh_exit()
+{
+	int return_code;
+	size_t i;
+
+	return_code = 0;
+
+	if (eventlircd_sh.fd != -1) {
+		if (monitor_client_remove(eventlircd_sh.fd) != 0) {
+			return_code = -1;
+		}
+		if (close(eventlircd_sh.fd) != 0) {
+			return_code = -1;
+		}
+		eventlircd_sh.fd = -1;
+		sigprocmask(SIG_SETMASK, &eventlircd_sh.sigmask, NULL);
+	}
+
+	/*
+	 * Running children are left to finish on their own.
+	 */
+	for (i = 0 ; i < eventlircd_sh.jobs ; i++) {
+		free(eventlircd_sh.job[i].cmd);
+	}
+	free(eventlircd_sh.job);
+	eventlircd_sh.job = NULL;
+	eventlircd_sh.jobs = 0;
+	eventlircd_sh.running = 0;
+
+	for (i = 0 ; i < eventlircd_sh.queue_count ; i++) {
+		free(eventlircd_sh.queue[i]);
+	}
+	eventlircd_sh.queue_count = 0;
+
+	return return_code;
+}
+
+int sh_init(size_t jobs)
+{
+	sigset_t sigmask;
+
+	if (jobs < 1) {
+		errno = EINVAL;
+		syslog(LOG_ERR,
+		       "sh jobs: %s\n",
+		       strerror(errno));
+		return -1;
+	}
+
+	if ((eventlircd_sh.job = calloc(jobs, sizeof(struct sh_job))) == NULL) {
+		syslog(LOG_ERR,
+		       "failed to allocate memory for sh jobs: %s\n",
+		       strerror(errno));
+		return -1;
+	}
+	eventlircd_sh.jobs = jobs;
+	eventlircd_sh.running = 0;
+	eventlircd_sh.queue_count = 0;
+
+	/*
+	 * SIGCHLD is blocked so that it is only delivered through the signalfd.
+	 */
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGCHLD);
+	if (sigprocmask(SIG_BLOCK, &sigmask, &eventlircd_sh.sigmask) != 0) {
+		syslog(LOG_ERR,
+		       "failed to block SIGCHLD: %s\n",
+		       strerror(errno));
+		sh_exit();
+		return -1;
+	}
+
+	if ((eventlircd_sh.fd = signalfd(-1, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1) {
+		syslog(LOG_ERR,
+		       "failed to create SIGCHLD signalfd: %s\n",
+		       strerror(errno));
+		sigprocmask(SIG_SETMASK, &eventlircd_sh.sigmask, NULL);
+		sh_exit();
+		return -1;
+	}
+
+	if (monitor_client_add(eventlircd_sh.fd, &sh_handler, NULL) != 0) {
+		syslog(LOG_ERR,
+		       "failed to monitor SIGCHLD signalfd: %s\n",
+		       strerror(errno));
+		sh_exit();
+		return -1;
+	}
+
+	if (monitor_stats_add(sh_stats) != 0) {
+		syslog(LOG_ERR,
+		       "failed to register sh statistics: %s\n",
+		       strerror(errno));
+		sh_exit();
+		return -1;
+	}
+
+	return 0;
+}
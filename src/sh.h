@@ -0,0 +1,33 @@
+/*
+ * Copyright (C) 2009-2010 Paul Bender.
+ *
+ * This file is part of eventlircd.
+ *
+ * eventlircd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * eventlircd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eventlircd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef _EVENTLIRCD_SH_H_
+#define _EVENTLIRCD_SH_H_ 1
+
+#include <stddef.h>
+
+/*
+ * The default number of sh commands that run at the same time.
+ */
+#define SH_JOBS_DEFAULT 4
+
+int sh_init(size_t jobs);
+int sh_exit();
+int sh_run(const char *cmd);
+
+#endif
@@ -9,6 +9,7 @@
 #include <errno.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/timerfd.h>  /* Linux */
 #include <sys/un.h>       /* XSI */
 #include <syslog.h>       /* XSI */
 
@@ -24,76 +25,471 @@
 # define UNUSED(x) x
 #endif
 
-static const char *txir_socket_path;
+/*
+ * The commands that are queued or waiting for their reply. When the queue is
+ * full new commands are dropped rather than blocking the event loop.
+ */
+#define TXIR_QUEUE_SIZE		32
+#define TXIR_LINE_MAX		256
+
+/*
+ * The connection is retried after 100 ms, doubling up to 30 s, and the delay
+ * starts over once it is connected again.
+ */
+#define TXIR_BACKOFF_MIN	100000
+#define TXIR_BACKOFF_MAX	30000000
+
+/*
+ * How long the oldest written command waits for its reply before it is given
+ * up, so that a lost reply does not hold up the queue until the peer
+ * disconnects. While connected the reconnect timer measures this instead.
+ */
+#define TXIR_REPLY_TIMEOUT	5000000
+
+/*
+ * The parts of an lircd reply:
+ * BEGIN, <command>, SUCCESS or ERROR, [DATA, <n>, <n lines>,] END.
+ */
+#define TXIR_RX_BEGIN		0
+#define TXIR_RX_COMMAND		1
+#define TXIR_RX_STATUS		2
+#define TXIR_RX_DATA		3
+#define TXIR_RX_COUNT		4
+#define TXIR_RX_LINES		5
+
+static char *txir_socket_path;
+static char *txir_reload_path;
 static int txir_fd = -1;
+static int txir_timerfd = -1;
+static unsigned int txir_backoff;
+
+/*
+ * The queue is a ring of commands, each ending with '\n'. The first
+ * txir_sent commands have been written and wait for their replies, and
+ * txir_offset bytes of the next one have been written.
+ */
+static char *txir_queue[TXIR_QUEUE_SIZE];
+static unsigned int txir_head, txir_count, txir_sent;
+static size_t txir_offset;
 
-void txir_init(const char *path)
+static char txir_rx[TXIR_LINE_MAX];
+static size_t txir_rx_len;
+static int txir_rx_state;
+static int txir_rx_ok;
+static unsigned int txir_rx_lines;
+static char txir_rx_command[TXIR_LINE_MAX];
+static char txir_rx_data[TXIR_LINE_MAX];
+
+static void txir_pop(void)
 {
-	txir_socket_path = path;
+	free(txir_queue[txir_head]);
+	txir_queue[txir_head] = NULL;
+	txir_head = (txir_head + 1) % TXIR_QUEUE_SIZE;
+	--txir_count;
 }
 
-int txir_exit(void)
+static void txir_set_timer(unsigned int usec)
+{
+	struct itimerspec t;
+
+	memset(&t, 0, sizeof(t));
+	t.it_value.tv_sec = usec / 1000000;
+	t.it_value.tv_nsec = (usec % 1000000) * 1000;
+	if (timerfd_settime(txir_timerfd, 0, &t, NULL) == -1)
+		syslog(LOG_ERR, "setting txir timer failed: %s\n", strerror(errno));
+}
+
+/*
+ * Close the connection and retry it later. Commands that were written but
+ * not acknowledged may or may not have been sent, and are dropped rather than
+ * sent twice; the rest stay queued for the next connection.
+ */
+static void txir_disconnect(void)
+{
+	if (txir_fd == -1)
+		return;
+
+	monitor_client_remove(txir_fd);
+	close(txir_fd);
+	txir_fd = -1;
+
+	if (txir_sent > 0 || txir_offset > 0)
+		syslog(LOG_WARNING, "txir: %u command(s) without a reply dropped\n", txir_sent + (txir_offset > 0));
+	if (txir_offset > 0)
+		++txir_sent;
+	while (txir_sent > 0) {
+		txir_pop();
+		--txir_sent;
+	}
+	txir_offset = 0;
+	txir_rx_len = 0;
+	txir_rx_state = TXIR_RX_BEGIN;
+
+	if (txir_backoff == 0)
+		txir_backoff = TXIR_BACKOFF_MIN;
+	txir_set_timer(txir_backoff);
+}
+
+/*
+ * Write as much of the queue as the socket takes, and wait for it to be
+ * writable again when it does not take everything.
+ */
+static int txir_flush(void)
+{
+	const char *cmd;
+	size_t len;
+	ssize_t n;
+
+	if (txir_fd == -1)
+		return 0;
+
+	while (txir_sent < txir_count) {
+		cmd = txir_queue[(txir_head + txir_sent) % TXIR_QUEUE_SIZE];
+		len = strlen(cmd);
+		n = write(txir_fd, cmd + txir_offset, len - txir_offset);
+		if (n == (ssize_t)-1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return monitor_client_write(txir_fd, true);
+			syslog(LOG_ERR, "write to txir socket failed: %s\n", strerror(errno));
+			txir_disconnect();
+			return 0;
+		}
+		txir_offset += (size_t)n;
+		if (txir_offset == len) {
+			txir_offset = 0;
+			if (++txir_sent == 1)
+				txir_set_timer(TXIR_REPLY_TIMEOUT);
+		}
+	}
+	return monitor_client_write(txir_fd, false);
+}
+
+/*
+ * Give up on the oldest command that waits for a reply, and time the next
+ * one, if any, from now.
+ */
+static void txir_drop_sent(const char *why)
+{
+	size_t len;
+
+	len = strlen(txir_queue[txir_head]);
+	syslog(LOG_WARNING, "txir: %.*s: %s, dropped\n", (int)(len - 1), txir_queue[txir_head], why);
+	txir_pop();
+	--txir_sent;
+	txir_set_timer((txir_sent > 0) ? TXIR_REPLY_TIMEOUT : 0);
+}
+
+/*
+ * Handle one line of an lircd reply, and match a complete reply with the
+ * commands that are waiting for one. lircd answers in order, so the commands
+ * written before the one that was answered lost their replies and are
+ * dropped. Replies that are not for a queued command, such as the SIGHUP
+ * broadcast, are ignored.
+ */
+static void txir_reply_line(const char *line)
+{
+	const char *cmd;
+	size_t len;
+	unsigned int i;
+
+	switch (txir_rx_state) {
+	case TXIR_RX_BEGIN:
+		if (strcmp(line, "BEGIN") == 0) {
+			txir_rx_state = TXIR_RX_COMMAND;
+			txir_rx_ok = 1;
+			txir_rx_data[0] = '\0';
+		}
+		return;
+	case TXIR_RX_COMMAND:
+		strcpy(txir_rx_command, line);
+		txir_rx_state = TXIR_RX_STATUS;
+		return;
+	case TXIR_RX_STATUS:
+		if (strcmp(line, "SUCCESS") == 0 || strcmp(line, "ERROR") == 0) {
+			txir_rx_ok = (line[0] == 'S');
+			txir_rx_state = TXIR_RX_DATA;
+			return;
+		}
+		/* A broadcast has no status. */
+		break;
+	case TXIR_RX_DATA:
+		if (strcmp(line, "DATA") == 0) {
+			txir_rx_state = TXIR_RX_COUNT;
+			return;
+		}
+		break;
+	case TXIR_RX_COUNT:
+		txir_rx_lines = (unsigned int)strtoul(line, NULL, 10);
+		txir_rx_state = (txir_rx_lines > 0) ? TXIR_RX_LINES : TXIR_RX_DATA;
+		return;
+	case TXIR_RX_LINES:
+		if (txir_rx_data[0] == '\0')
+			strcpy(txir_rx_data, line);
+		if (--txir_rx_lines == 0)
+			txir_rx_state = TXIR_RX_DATA;
+		return;
+	}
+
+	txir_rx_state = TXIR_RX_BEGIN;
+	if (strcmp(line, "END") != 0) {
+		syslog(LOG_WARNING, "txir: malformed reply to '%s'\n", txir_rx_command);
+		return;
+	}
+
+	len = strlen(txir_rx_command);
+	for (i = 0; i < txir_sent; ++i) {
+		cmd = txir_queue[(txir_head + i) % TXIR_QUEUE_SIZE];
+		if (strncmp(cmd, txir_rx_command, len) == 0 && cmd[len] == '\n')
+			break;
+	}
+	if (i == txir_sent)
+		return;
+	while (i-- > 0)
+		txir_drop_sent("no reply");
+
+	if (txir_rx_ok)
+		syslog(LOG_DEBUG, "txir: %s: done\n", txir_rx_command);
+	else
+		syslog(LOG_ERR, "txir: %s: %s\n", txir_rx_command, (txir_rx_data[0] != '\0') ? txir_rx_data : "failed");
+	txir_pop();
+	--txir_sent;
+	txir_set_timer((txir_sent > 0) ? TXIR_REPLY_TIMEOUT : 0);
+}
+
+static int txir_handler(void* UNUSED(id), int ready, struct timeval* UNUSED(now))
+{
+	char msg[256];
+	ssize_t n, i;
+
+	if (ready & MONITOR_READ) {
+		n = read(txir_fd, &msg, sizeof(msg));
+		if (n == (ssize_t)-1 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+			return 0;
+		if (n <= 0) {
+			if (n == 0)
+				syslog(LOG_WARNING, "txir socket %s closed by the peer\n", txir_socket_path);
+			else
+				syslog(LOG_ERR, "reading data from txir socket failed: %s\n", strerror(errno));
+			txir_disconnect();
+			return 0;
+		}
+		for (i = 0; i < n; ++i) {
+			if (msg[i] != '\n') {
+				if (txir_rx_len < sizeof(txir_rx) - 1)
+					txir_rx[txir_rx_len++] = msg[i];
+				continue;
+			}
+			txir_rx[txir_rx_len] = '\0';
+			txir_rx_len = 0;
+			txir_reply_line(txir_rx);
+		}
+	}
+
+	if (txir_fd != -1 && (ready & MONITOR_WRITE))
+		return txir_flush();
+
+	return 0;
+}
+
+static int txir_connect(void)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1)
+		return -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, txir_socket_path, sizeof(addr.sun_path) - 1);
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1 ||
+	    monitor_client_add(fd, &txir_handler, NULL) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	txir_fd = fd;
+	txir_backoff = 0;
+	txir_set_timer(0);
+	syslog(LOG_INFO, "txir socket %s connected\n", txir_socket_path);
+	return txir_flush();
+}
+
+static int txir_timer_handler(void* UNUSED(id), int ready, struct timeval* UNUSED(now))
 {
+	uint64_t expirations;
+
+	if (!(ready & MONITOR_READ) || read(txir_timerfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return 0;
 	if (txir_fd != -1) {
-		if (monitor_client_remove(txir_fd) != 0)
-			return -1;
+		if (txir_sent > 0)
+			txir_drop_sent("no reply in time");
+		return 0;
+	}
+
+	if (txir_connect() != 0) {
+		syslog(LOG_DEBUG, "could not open txir socket %s: %s\n", txir_socket_path, strerror(errno));
+		txir_backoff = (txir_backoff * 2 < TXIR_BACKOFF_MAX) ? txir_backoff * 2 : TXIR_BACKOFF_MAX;
+		txir_set_timer(txir_backoff);
+	}
+	return 0;
+}
+
+static int txir_timer_init(void)
+{
+	if (txir_timerfd != -1)
+		return 0;
+
+	if ((txir_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1) {
+		syslog(LOG_ERR, "creating txir timer failed: %s\n", strerror(errno));
+		return -1;
+	}
+	if (monitor_client_add(txir_timerfd, &txir_timer_handler, NULL) != 0) {
+		close(txir_timerfd);
+		txir_timerfd = -1;
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Connect to the transmitter's lircd socket, and keep reconnecting in the
+ * background when it is not there yet or goes away.
+ */
+int txir_init(const char *path)
+{
+	if (path == NULL)
+		return 0;
+
+	if ((txir_socket_path = strdup(path)) == NULL) {
+		syslog(LOG_ERR, "failed to allocate memory for the txir socket path: %s\n", strerror(errno));
+		return -1;
+	}
+	if (txir_timer_init() != 0)
+		return -1;
 
+	txir_backoff = TXIR_BACKOFF_MIN;
+	if (txir_connect() != 0) {
+		syslog(LOG_WARNING, "could not open txir socket %s: %s\n", path, strerror(errno));
+		txir_set_timer(txir_backoff);
+	}
+	return 0;
+}
+
+int txir_exit(void)
+{
+	if (txir_fd != -1) {
+		monitor_client_remove(txir_fd);
 		if (close(txir_fd) == -1) {
 			syslog(LOG_ERR, "closing txir socket failed: %s\n", strerror(errno));
 			return -1;
 		}
 		txir_fd = -1;
 	}
+
+	if (txir_timerfd != -1) {
+		monitor_client_remove(txir_timerfd);
+		close(txir_timerfd);
+		txir_timerfd = -1;
+	}
+
+	while (txir_count > 0)
+		txir_pop();
+	txir_sent = 0;
+	txir_offset = 0;
+
+	free(txir_socket_path);
+	txir_socket_path = NULL;
+	free(txir_reload_path);
+	txir_reload_path = NULL;
 	return 0;
 }
 
-static int txir_handler(void* UNUSED(id), int ready, struct timeval* UNUSED(now))
+/*
+ * Get ready to switch to a new transmitter socket (NULL for none) when
+ * txir_reload_finish() commits the reload.
+ */
+int txir_reload(const char *path)
 {
-	if (ready)
-	{
-		char msg[256];
-		ssize_t n = read(txir_fd, &msg, sizeof(msg) - 1);
-		if (n == (ssize_t)-1) {
-    	syslog(LOG_ERR, "reading data from txir socket failed: %s\n", strerror(errno));
-    	return -1;
-		}
+	if (path == NULL)
+		return 0;
+
+	if ((txir_reload_path = strdup(path)) == NULL) {
+		syslog(LOG_ERR, "failed to allocate memory for the txir socket path: %s\n", strerror(errno));
+		return -1;
 	}
-	return 0;
+	return txir_timer_init();
 }
 
+/*
+ * Switch to the socket given to txir_reload() if it changed. The commands
+ * that are still queued are sent to the new socket; those waiting for a
+ * reply from the old one are dropped. Without a socket the queue is dropped.
+ */
+void txir_reload_finish(int commit)
+{
+	char *path = txir_reload_path;
+
+	txir_reload_path = NULL;
+	if (!commit || (path == NULL && txir_socket_path == NULL) ||
+	    (path != NULL && txir_socket_path != NULL && strcmp(path, txir_socket_path) == 0)) {
+		free(path);
+		return;
+	}
+
+	txir_disconnect();
+	free(txir_socket_path);
+	txir_socket_path = path;
+
+	if (path == NULL) {
+		syslog(LOG_INFO, "txir socket closed, %u command(s) dropped\n", txir_count);
+		while (txir_count > 0)
+			txir_pop();
+		txir_set_timer(0);
+		return;
+	}
+
+	txir_backoff = TXIR_BACKOFF_MIN;
+	if (txir_connect() != 0) {
+		syslog(LOG_WARNING, "could not open txir socket %s: %s\n", path, strerror(errno));
+		txir_set_timer(txir_backoff);
+	}
+}
+
+/*
+ * Queue a command for the transmitter. It is written when the socket is
+ * writable, and its reply is matched with it when it arrives.
+ */
 int txir_send(const char *cmd)
 {
+	char *line;
+	size_t len;
+
 	if (txir_socket_path == NULL)
 		return 0;
 
-	if (txir_fd == -1)
-	{
-		int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
-		if (fd != -1) {
-			struct sockaddr_un addr;
-			memset(&addr, 0, sizeof(addr));
-			addr.sun_family = AF_UNIX;
-			strncpy(addr.sun_path, txir_socket_path, sizeof(addr.sun_path) - 1);
-			if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != -1)
-				txir_fd = fd;
-		}
-		if (txir_fd == -1)
-		{
-			syslog(LOG_ERR, "could not open txir socket %s: %s\n", txir_socket_path, strerror(errno));
-			close(fd);
-			return -1;
-		}
-
-		if (monitor_client_add(txir_fd, &txir_handler, NULL) != 0)
-			return -1;
+	len = strlen(cmd);
+	if (len == 0 || len >= TXIR_LINE_MAX - 1 || strchr(cmd, '\n') != NULL) {
+		syslog(LOG_ERR, "txir: invalid command '%s'\n", cmd);
+		return -1;
+	}
+	if (txir_count == TXIR_QUEUE_SIZE) {
+		syslog(LOG_ERR, "txir: queue full, '%s' dropped\n", cmd);
+		return -1;
 	}
 
-	char buf[1024];
-	ssize_t n = snprintf(buf, sizeof(buf), "%s\n", cmd);
-	if (write(txir_fd, buf, n) != n)
-	{
-		syslog(LOG_ERR, "write to txir socket failed: %s\n", strerror(errno));
+	if ((line = malloc(len + 2)) == NULL) {
+		syslog(LOG_ERR, "failed to allocate memory for the txir command: %s\n", strerror(errno));
 		return -1;
 	}
-	return 0;
+	memcpy(line, cmd, len);
+	line[len] = '\n';
+	line[len + 1] = '\0';
+	txir_queue[(txir_head + txir_count) % TXIR_QUEUE_SIZE] = line;
+	++txir_count;
+
+	return txir_flush();
 }
@@ -3,8 +3,10 @@
 
 #include <sys/time.h>
 
-void txir_init(const char *path);
+int txir_init(const char *path);
 int txir_exit(void);
 int txir_send(const char *cmd);
+int txir_reload(const char *path);
+void txir_reload_finish(int commit);
 
 #endif
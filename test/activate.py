@@ -0,0 +1,171 @@
+#!/usr/bin/env python3
+#
+# Check that eventlircd follows the socket activation protocol, the way a
+# service manager such as systemd would start it:
+#
+#   activate.py [<eventlircd>]
+#
+# The eventlircd program defaults to $EVENTLIRCD, which make check sets to the
+# one just built. It is started in the foreground on an empty event map
+# directory, so that it needs no input devices. The lircd socket is created
+# and put in the listening state here, and passed to eventlircd as file
+# descriptor 3 using LISTEN_PID and LISTEN_FDS. Readiness is expected both as a
+# newline on a pipe passed with --ready-fd=4 and as READY=1 on a NOTIFY_SOCKET
+# datagram socket. A client connects to the socket before eventlircd is ready,
+# as a LIRC consumer started in parallel would, and must then get the reply to
+# a command. Finally eventlircd must exit cleanly on SIGTERM.
+#
+# The exit status is 0 on success, 1 on failure and 77 (skipped) when
+# eventlircd cannot run here because udev is not available.
+#
+import os
+import select
+import shutil
+import signal
+import socket
+import sys
+import tempfile
+import time
+
+TIMEOUT = 10
+
+# What input_init() logs when eventlircd cannot use udev.
+UDEV_FAILURES = (
+    "failed to bind the udev monitor",
+    "failed to get udev monitor file descriptor",
+    "failed to enumerate udev devices",
+)
+
+
+def fail(message):
+    sys.stderr.write("activate.py: %s\n" % message)
+    sys.exit(1)
+
+
+def main():
+    if len(sys.argv) > 1:
+        program = sys.argv[1]
+    else:
+        program = os.environ.get("EVENTLIRCD", "")
+    if not program:
+        sys.stderr.write("usage: %s <eventlircd>\n" % sys.argv[0])
+        return 2
+
+    directory = tempfile.mkdtemp(prefix="eventlircd-activate.")
+    try:
+        return activate(program, directory)
+    finally:
+        shutil.rmtree(directory)
+
+
+def activate(program, directory):
+    path = os.path.join(directory, "lircd")
+    evmap = os.path.join(directory, "evmap")
+    notify_path = os.path.join(directory, "notify")
+    log_path = os.path.join(directory, "log")
+    os.mkdir(evmap)
+
+    listener = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    listener.bind(path)
+    listener.listen(64)
+
+    notify = socket.socket(socket.AF_UNIX, socket.SOCK_DGRAM)
+    notify.bind(notify_path)
+
+    ready_r, ready_w = os.pipe()
+    log = open(log_path, "w+")
+
+    command = [program, "-f", "--evmap=" + evmap, "--socket=" + path, "--ready-fd=4"]
+    pid = os.fork()
+    if pid == 0:
+        # Move the descriptors out of the way first, in case one of them is 3 or 4.
+        listen_fd = os.dup(listener.fileno())
+        ready_fd = os.dup(ready_w)
+        os.dup2(listen_fd, 3)
+        os.dup2(ready_fd, 4)
+        os.dup2(log.fileno(), 2)
+        os.environ["LISTEN_PID"] = str(os.getpid())
+        os.environ["LISTEN_FDS"] = "1"
+        os.environ["NOTIFY_SOCKET"] = notify_path
+        try:
+            os.execvp(command[0], command)
+        finally:
+            os._exit(127)
+
+    os.close(ready_w)
+    listener.close()
+
+    def stopped(message):
+        # Return the skip status when eventlircd could not reach udev, and
+        # fail otherwise, showing what eventlircd logged.
+        log.seek(0)
+        output = log.read()
+        sys.stderr.write(output)
+        if any(failure in output for failure in UDEV_FAILURES):
+            sys.stderr.write("activate.py: skipped, eventlircd cannot use udev here\n")
+            return 77
+        fail(message)
+
+    client = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    client.connect(path)
+
+    pipe_ready = False
+    notify_ready = False
+    deadline = time.monotonic() + TIMEOUT
+    while not (pipe_ready and notify_ready):
+        remaining = deadline - time.monotonic()
+        if remaining <= 0:
+            os.kill(pid, signal.SIGTERM)
+            os.waitpid(pid, 0)
+            fail("no readiness after %d s" % TIMEOUT)
+        waiting = [notify] if pipe_ready else [ready_r, notify]
+        ready, _, _ = select.select(waiting, [], [], min(remaining, 0.1))
+        if ready_r in ready:
+            data = os.read(ready_r, 64)
+            if data == b"":
+                os.waitpid(pid, 0)
+                return stopped("eventlircd exited before it was ready")
+            if data != b"\n":
+                fail("unexpected readiness line %r" % data)
+            pipe_ready = True
+        if notify in ready:
+            data = notify.recv(256)
+            if b"READY=1" not in data.split(b"\n"):
+                fail("unexpected readiness notification %r" % data)
+            notify_ready = True
+        done, status = os.waitpid(pid, os.WNOHANG)
+        if done != 0:
+            return stopped("eventlircd exited before it was ready")
+
+    client.sendall(b"SUBSCRIBE\n")
+    expected = b"BEGIN\nSUBSCRIBE\nSUCCESS\nEND\n"
+    reply = b""
+    client.settimeout(TIMEOUT)
+    try:
+        while len(reply) < len(expected):
+            data = client.recv(256)
+            if not data:
+                break
+            reply += data
+    except socket.timeout:
+        pass
+    client.close()
+
+    os.kill(pid, signal.SIGTERM)
+    _, status = os.waitpid(pid, 0)
+    notify.close()
+    os.close(ready_r)
+
+    if reply != expected:
+        fail("the client connected before readiness got %r" % reply)
+    if not os.WIFEXITED(status) or os.WEXITSTATUS(status) != 0:
+        log.seek(0)
+        sys.stderr.write(log.read())
+        fail("eventlircd did not exit cleanly on SIGTERM")
+    log.close()
+    print("activate.py: socket passed, readiness on the pipe and the notification socket, client served")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,506 @@
+/*
+ * This file is part of eventlircd.
+ *
+ * eventlircd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * eventlircd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eventlircd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A benchmark of the LG serial command scheduler that needs no tv.
+ *
+ * A child process plays the tv on the master side of a pseudo-terminal and
+ * answers the built-in LG protocol with a configurable latency, noise bytes in
+ * front of replies and lost replies. The parent runs lge.c on the slave side
+ * in the real monitor loop and queues batches of set commands at a fixed
+ * interval. When the queue has drained it reports the throughput, the time
+ * the commands waited in the queue and how long it took to recover from lost
+ * replies. It fails when a setting on the tv does not end up with the last
+ * value that was queued for it, or when recovering from a lost reply takes
+ * more than a tenth of the protocol's reply timeout although the tv answers
+ * fast enough for the timeouts to adapt.
+ */
+#define _GNU_SOURCE 1
+
+#include <errno.h>        /* C89 */
+#include <fcntl.h>        /* POSIX */
+#include <getopt.h>
+#include <pty.h>
+#include <signal.h>       /* C89 */
+#include <stdint.h>       /* POSIX */
+#include <stdio.h>        /* C89 */
+#include <stdlib.h>       /* C89 */
+#include <string.h>       /* C89 */
+#include <syslog.h>       /* XSI */
+#include <time.h>         /* C89 */
+#include <unistd.h>       /* POSIX */
+#include <sys/timerfd.h>  /* Linux */
+#include <sys/wait.h>     /* POSIX */
+
+#include "lge.h"
+#include "monitor.h"
+
+#if defined(__GNUC__)
+# define UNUSED(x) x __attribute__((unused))
+#else
+# define UNUSED(x) x
+#endif
+
+/* The settings that are set, KC to KJ in the built-in protocol. */
+#define SIM_CMD_FIRST	0x02
+#define SIM_CMD_COUNT	8
+#define SIM_VALUE_MAX	0x40
+
+/*
+ * The reply timeout of the built-in protocol, and the time in which a lost
+ * reply must be recovered from once the timeouts have adapted to a tv that
+ * answers well within it (ms).
+ */
+#define SIM_TIMEOUT		6000
+#define SIM_RECOVERY_MAX	(SIM_TIMEOUT / 10)
+
+/* The telegrams after which the timeouts are expected to have adapted. */
+#define SIM_WARMUP		8
+
+/* What the tv received: a set or a query, and whether its reply was lost. */
+struct sim_record {
+	double time;
+	unsigned int cmd;
+	unsigned int value;
+	int query;
+	int dropped;
+};
+
+/* A command queued by the parent. */
+struct sim_issue {
+	double time;
+	unsigned int cmd;
+	unsigned int value;
+};
+
+static struct {
+	unsigned int batches;
+	unsigned int batch_size;
+	unsigned int interval;
+	unsigned int latency;
+	unsigned int jitter;
+	unsigned int garbage;
+	unsigned int drop;
+	unsigned int seed;
+	int verbose;
+} sim = {
+	.batches = 40,
+	.batch_size = 4,
+	.interval = 50,
+	.latency = 10,
+	.jitter = 5,
+	.garbage = 5,
+	.drop = 2,
+	.seed = 1,
+	.verbose = 0
+};
+
+static struct sim_issue *sim_issues;
+static unsigned int sim_issue_count;
+static unsigned int sim_batch;
+static int sim_timerfd = -1;
+
+static double sim_now(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static int sim_chance(unsigned int percent)
+{
+	return (unsigned int)(rand() % 100) < percent;
+}
+
+/*
+ * The tv. Telegrams look like "KC 00 10\r" and are answered with
+ * "C 01 OK10x\r\n", or with the current value when the value is FF.
+ */
+static int sim_tv(int fd, FILE *log)
+{
+	unsigned int state[SIM_CMD_FIRST + SIM_CMD_COUNT] = { 0 };
+	struct sim_record record;
+	char line[64], reply[64], noise[16];
+	char name[3];
+	size_t len = 0;
+	ssize_t n;
+	unsigned int value, delay;
+	int i, count;
+	char c;
+
+	srand(sim.seed);
+	for (;;) {
+		n = read(fd, &c, 1);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		if (c != '\r') {
+			if (len < sizeof(line) - 1)
+				line[len++] = c;
+			continue;
+		}
+		line[len] = '\0';
+		len = 0;
+
+		if (sscanf(line, "%2c 00 %x", name, &value) != 2 || name[0] != 'K') {
+			fprintf(stderr, "tv: unexpected telegram '%s'\n", line);
+			continue;
+		}
+		name[2] = '\0';
+
+		memset(&record, 0, sizeof(record));
+		record.time = sim_now();
+		record.cmd = (unsigned int)(name[1] - 'C') + SIM_CMD_FIRST;
+		record.value = value;
+		record.query = (value == 0xFF);
+		record.dropped = sim_chance(sim.drop);
+		if (record.cmd < SIM_CMD_FIRST || record.cmd >= SIM_CMD_FIRST + SIM_CMD_COUNT) {
+			fprintf(stderr, "tv: unexpected command '%s'\n", line);
+			continue;
+		}
+		if (!record.query)
+			state[record.cmd] = value;
+		fwrite(&record, sizeof(record), 1, log);
+
+		delay = sim.latency;
+		if (sim.jitter > 0)
+			delay += (unsigned int)rand() % (2 * sim.jitter + 1) - sim.jitter;
+		usleep(delay * 1000);
+		if (record.dropped)
+			continue;
+
+		if (sim_chance(sim.garbage)) {
+			count = 1 + rand() % (int)sizeof(noise);
+			for (i = 0; i < count; ++i)
+				noise[i] = "abcdefxyz0123.\r\n"[rand() % 17];
+			if (write(fd, noise, count) != count)
+				break;
+		}
+		count = snprintf(reply, sizeof(reply), "%c 01 OK%02Xx\r\n", name[1], state[record.cmd]);
+		if (write(fd, reply, count) != count)
+			break;
+	}
+
+	fflush(log);
+	return 0;
+}
+
+/*
+ * Queue the next batch. Every command of batch b sets its setting to b, so
+ * consecutive batches always change the settings and a queued command can be
+ * told apart from the ones before and after it.
+ */
+static int sim_batch_handler(void* UNUSED(id), int ready, struct timeval* UNUSED(now))
+{
+	char seq[100];
+	size_t len = 0;
+	uint64_t expirations;
+	unsigned int i, cmd, value;
+
+	if (!(ready & MONITOR_READ) || read(sim_timerfd, &expirations, sizeof(expirations)) != sizeof(expirations))
+		return 0;
+	if (sim_batch == sim.batches)
+		return 0;
+
+	value = sim_batch % SIM_VALUE_MAX;
+	for (i = 0; i < sim.batch_size; ++i) {
+		cmd = SIM_CMD_FIRST + (sim_batch * sim.batch_size + i) % SIM_CMD_COUNT;
+		len += snprintf(seq + len, sizeof(seq) - len, "%s%02X%02X", (i > 0) ? " " : "", cmd, value);
+		sim_issues[sim_issue_count].time = sim_now();
+		sim_issues[sim_issue_count].cmd = cmd;
+		sim_issues[sim_issue_count].value = value;
+		++sim_issue_count;
+	}
+	++sim_batch;
+
+	/*
+	 * The port has an empty off sequence, so lge_off() stops the monitor once
+	 * the queue has drained. The monitor ignores the return value, so stop it
+	 * here on errors.
+	 */
+	if (lge_send(NULL, seq, NULL) != 0 || (sim_batch == sim.batches && lge_off() < 0)) {
+		fprintf(stderr, "lgesim: queueing batch %u failed\n", sim_batch);
+		sim_batch = 0;
+		monitor_sigterm_handler(0);
+	}
+	return 0;
+}
+
+static int sim_compare(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static double sim_percentile(const double *sorted, unsigned int count, unsigned int percent)
+{
+	if (count == 0)
+		return 0;
+	return sorted[(count - 1) * percent / 100];
+}
+
+/*
+ * Match the commands that were queued with what the tv received and print the
+ * results. Returns the number of settings that did not end up with the value
+ * that was last queued for them, plus one when the recovery was too slow.
+ */
+static int sim_report(FILE *log, double start)
+{
+	struct sim_record *records = NULL;
+	double *waits, *recoveries, *warm;
+	unsigned int expected[SIM_CMD_FIRST + SIM_CMD_COUNT] = { 0 };
+	unsigned int received[SIM_CMD_FIRST + SIM_CMD_COUNT] = { 0 };
+	unsigned int count = 0, sets = 0, queries = 0, dropped = 0, lost = 0;
+	unsigned int waits_count = 0, recoveries_count = 0, warm_count = 0, merged = 0, wrong = 0;
+	unsigned int i, j;
+	char *used;
+	double end;
+
+	rewind(log);
+	for (;;) {
+		records = realloc(records, (count + 64) * sizeof(*records));
+		if (records == NULL)
+			return -1;
+		i = fread(&records[count], sizeof(*records), 64, log);
+		count += i;
+		if (i < 64)
+			break;
+	}
+
+	waits = calloc(sim_issue_count + 1, sizeof(*waits));
+	recoveries = calloc(count + 1, sizeof(*recoveries));
+	warm = calloc(count + 1, sizeof(*warm));
+	used = calloc(count + 1, 1);
+	if (waits == NULL || recoveries == NULL || warm == NULL || used == NULL)
+		return -1;
+
+	for (i = 0; i < count; ++i) {
+		if (records[i].query) {
+			++queries;
+		} else {
+			++sets;
+			received[records[i].cmd] = records[i].value;
+		}
+		if (!records[i].dropped)
+			continue;
+		++dropped;
+		for (j = i + 1; j < count && records[j].cmd != records[i].cmd; ++j);
+		if (j < count && records[j].value == records[i].value) {
+			recoveries[recoveries_count++] = (records[j].time - records[i].time) * 1000;
+			if (i >= SIM_WARMUP)
+				warm[warm_count++] = recoveries[recoveries_count - 1];
+		} else {
+			++lost;
+		}
+	}
+
+	for (i = 0; i < sim_issue_count; ++i) {
+		expected[sim_issues[i].cmd] = sim_issues[i].value;
+		for (j = 0; j < count; ++j) {
+			if (!used[j] && !records[j].query && records[j].cmd == sim_issues[i].cmd &&
+			    records[j].value == sim_issues[i].value && records[j].time >= sim_issues[i].time)
+				break;
+		}
+		if (j == count) {
+			++merged;
+			continue;
+		}
+		used[j] = 1;
+		waits[waits_count++] = (records[j].time - sim_issues[i].time) * 1000;
+	}
+
+	for (i = SIM_CMD_FIRST; i < SIM_CMD_FIRST + SIM_CMD_COUNT; ++i) {
+		if (received[i] != expected[i]) {
+			fprintf(stderr, "setting %02X is %02X, expected %02X\n", i, received[i], expected[i]);
+			++wrong;
+		}
+	}
+
+	qsort(waits, waits_count, sizeof(*waits), sim_compare);
+	qsort(recoveries, recoveries_count, sizeof(*recoveries), sim_compare);
+	qsort(warm, warm_count, sizeof(*warm), sim_compare);
+	end = (count > 0) ? records[count - 1].time : start;
+
+	printf("commands:   %u queued, %u merged, %u sets and %u queries sent\n", sim_issue_count, merged, sets, queries);
+	printf("throughput: %.1f telegrams/s over %.3f s\n", (end > start) ? count / (end - start) : 0.0, end - start);
+	printf("queue wait: p50 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+	       sim_percentile(waits, waits_count, 50),
+	       sim_percentile(waits, waits_count, 99),
+	       sim_percentile(waits, waits_count, 100));
+	printf("timeouts:   %u replies dropped, %u recovered, %u commands given up\n", dropped, recoveries_count, lost);
+	printf("recovery:   p50 %.1f ms, max %.1f ms\n",
+	       sim_percentile(recoveries, recoveries_count, 50),
+	       sim_percentile(recoveries, recoveries_count, 100));
+
+	/*
+	 * The timeout is twice the 99th percentile of the reply times rounded up
+	 * to a power of two, so it is at most four times the slowest reply. Replies
+	 * lost before the first few replies arrived still cost the full timeout.
+	 */
+	if (warm_count > 0 && 4 * (sim.latency + sim.jitter) < SIM_RECOVERY_MAX &&
+	    sim_percentile(warm, warm_count, 50) > SIM_RECOVERY_MAX) {
+		fprintf(stderr, "recovery p50 is over %u ms, the reply timeouts did not adapt\n", SIM_RECOVERY_MAX);
+		++wrong;
+	}
+
+	free(used);
+	free(warm);
+	free(recoveries);
+	free(waits);
+	free(records);
+	return wrong;
+}
+
+static void sim_usage(const char *progname)
+{
+	fprintf(stdout, "Usage: %s [options]\n", progname);
+	fprintf(stdout, "    -h --help              print this help message and exit\n");
+	fprintf(stdout, "    -v --verbose           log lge messages to stderr\n");
+	fprintf(stdout, "    -n --batches=<n>       number of batches to queue (default %u)\n", sim.batches);
+	fprintf(stdout, "    -b --batch=<n>         commands per batch (default %u)\n", sim.batch_size);
+	fprintf(stdout, "    -i --interval=<ms>     time between batches (default %u)\n", sim.interval);
+	fprintf(stdout, "    -l --latency=<ms>      tv reply latency (default %u)\n", sim.latency);
+	fprintf(stdout, "    -j --jitter=<ms>       random variation of the latency (default %u)\n", sim.jitter);
+	fprintf(stdout, "    -g --garbage=<%%>       replies preceded by noise (default %u)\n", sim.garbage);
+	fprintf(stdout, "    -d --drop=<%%>          replies that are lost (default %u)\n", sim.drop);
+	fprintf(stdout, "    -s --seed=<n>          random seed (default %u)\n", sim.seed);
+}
+
+int main(int argc, char **argv)
+{
+	const struct option longopts[] = {
+		{"help",no_argument,NULL,'h'},
+		{"verbose",no_argument,NULL,'v'},
+		{"batches",required_argument,NULL,'n'},
+		{"batch",required_argument,NULL,'b'},
+		{"interval",required_argument,NULL,'i'},
+		{"latency",required_argument,NULL,'l'},
+		{"jitter",required_argument,NULL,'j'},
+		{"garbage",required_argument,NULL,'g'},
+		{"drop",required_argument,NULL,'d'},
+		{"seed",required_argument,NULL,'s'},
+		{0, 0, 0, 0}
+	};
+	struct itimerspec t;
+	char name[64];
+	FILE *log;
+	double start;
+	int master, slave, opt, status, rc;
+	pid_t pid;
+
+	while ((opt = getopt_long(argc, argv, "hvn:b:i:l:j:g:d:s:", longopts, NULL)) != -1) {
+		switch (opt) {
+		case 'h':
+			sim_usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		case 'v':
+			sim.verbose = 1;
+			break;
+		case 'n':
+			sim.batches = (unsigned int)atoi(optarg);
+			break;
+		case 'b':
+			sim.batch_size = (unsigned int)atoi(optarg);
+			break;
+		case 'i':
+			sim.interval = (unsigned int)atoi(optarg);
+			break;
+		case 'l':
+			sim.latency = (unsigned int)atoi(optarg);
+			break;
+		case 'j':
+			sim.jitter = (unsigned int)atoi(optarg);
+			break;
+		case 'g':
+			sim.garbage = (unsigned int)atoi(optarg);
+			break;
+		case 'd':
+			sim.drop = (unsigned int)atoi(optarg);
+			break;
+		case 's':
+			sim.seed = (unsigned int)atoi(optarg);
+			break;
+		default:
+			sim_usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (sim.batches == 0 || sim.batch_size == 0 || sim.batch_size > SIM_CMD_COUNT || sim.interval == 0 || sim.jitter > sim.latency) {
+		fprintf(stderr, "%s: a batch has 1 to %u commands and the jitter cannot exceed the latency\n", argv[0], SIM_CMD_COUNT);
+		exit(EXIT_FAILURE);
+	}
+
+	openlog("lgesim", LOG_PERROR, LOG_USER);
+	setlogmask(sim.verbose ? LOG_UPTO(LOG_DEBUG) : LOG_UPTO(LOG_CRIT));
+
+	if (openpty(&master, &slave, name, NULL, NULL) == -1 || (log = tmpfile()) == NULL) {
+		perror("lgesim");
+		exit(EXIT_FAILURE);
+	}
+
+	pid = fork();
+	if (pid == -1) {
+		perror("lgesim");
+		exit(EXIT_FAILURE);
+	}
+	if (pid == 0) {
+		close(slave);
+		exit(sim_tv(master, log));
+	}
+	close(master);
+
+	sim_issues = calloc(sim.batches * sim.batch_size, sizeof(*sim_issues));
+	if (sim_issues == NULL || monitor_init() != 0 || lge_add("sim", name, 0, 0, NULL, NULL, "") != 0) {
+		kill(pid, SIGTERM);
+		exit(EXIT_FAILURE);
+	}
+
+	sim_timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	memset(&t, 0, sizeof(t));
+	t.it_value.tv_nsec = 1000000;
+	t.it_interval.tv_sec = sim.interval / 1000;
+	t.it_interval.tv_nsec = (sim.interval % 1000) * 1000000L;
+	if (sim_timerfd == -1 || timerfd_settime(sim_timerfd, 0, &t, NULL) == -1 ||
+	    monitor_client_add(sim_timerfd, &sim_batch_handler, NULL) != 0) {
+		perror("lgesim");
+		kill(pid, SIGTERM);
+		exit(EXIT_FAILURE);
+	}
+
+	start = sim_now();
+	rc = monitor_run();
+	monitor_exit();
+	lge_exit();
+	close(slave);
+	close(sim_timerfd);
+
+	if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		rc = -1;
+	if (rc == 0 && sim_batch < sim.batches) {
+		fprintf(stderr, "lgesim: stopped after %u of %u batches\n", sim_batch, sim.batches);
+		rc = -1;
+	}
+	if (rc == 0 && sim_report(log, start) != 0)
+		rc = -1;
+
+	fclose(log);
+	free(sim_issues);
+	exit(rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
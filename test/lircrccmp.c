@@ -0,0 +1,252 @@
+/*
+ * This file is part of eventlircd.
+ *
+ * eventlircd is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * eventlircd is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with eventlircd.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A conformance test of eventlircd's lircrc engine against liblirc.
+ *
+ * The same lircrc file is read with liblirc's lirc_readconfig_only() and with
+ * lircrc_read(). Then a stream of lircd messages, one per line in the format
+ * eventlircd sends ("<code> <repeat> <button> <remote>", in hex), is played
+ * through both: each message is handed to lirc_code2charprog() until it
+ * returns no more config strings, and to lircrc_run() with the message's
+ * compiled key. The actions of both, each a prog and a config string, must be
+ * the same and come in the same order. The test fails on the first message
+ * where they are not, and prints both lists.
+ *
+ * Without arguments it reads lircrccmp.lircrc and lircrccmp.events from
+ * $srcdir, as make check runs it.
+ */
+#include <errno.h>        /* C89 */
+#include <getopt.h>
+#include <stdio.h>        /* C89 */
+#include <stdlib.h>       /* C89 */
+#include <string.h>       /* C89 */
+#include <syslog.h>       /* XSI */
+
+#include <lirc_client.h>
+
+#include "lircrc.h"
+
+#define CMP_ACTION_MAX	32
+#define CMP_LINE_MAX	256
+
+/* The actions of one message, each "<prog> <config>". */
+struct cmp_actions {
+	char action[CMP_ACTION_MAX][CMP_LINE_MAX];
+	unsigned int count;
+};
+
+static int cmp_verbose;
+
+/*
+ * lircrc_run() names the progs that eventlircd runs itself and calls the
+ * others LIRCRC_PROG_OTHER, so liblirc's prog names are folded the same way.
+ */
+static const char *cmp_prog_name(int prog)
+{
+	switch (prog) {
+	case LIRCRC_PROG_FORWARD:
+		return "forward";
+	case LIRCRC_PROG_TXIR:
+		return "txir";
+	case LIRCRC_PROG_LGE:
+		return "lge";
+	case LIRCRC_PROG_SH:
+		return "sh";
+	case LIRCRC_PROG_MACRO:
+		return "macro";
+	default:
+		return "other";
+	}
+}
+
+static void cmp_add(struct cmp_actions *actions, const char *prog, const char *target, const char *config)
+{
+	if (actions->count == CMP_ACTION_MAX)
+		return;
+	snprintf(actions->action[actions->count++], CMP_LINE_MAX, "%s%s%s %s",
+	         prog, (target != NULL) ? ":" : "", (target != NULL) ? target : "", config);
+}
+
+static int cmp_lircrc_action(int prog, const char *target, const char *config, void *arg)
+{
+	cmp_add(arg, cmp_prog_name(prog), target, config);
+	return 0;
+}
+
+static int cmp_liblirc(struct lirc_config *config, char *message, struct cmp_actions *actions)
+{
+	const char *target;
+	char *string, *prog;
+	int id;
+
+	for (;;) {
+		string = prog = NULL;
+		if (lirc_code2charprog(config, message, &string, &prog) == -1)
+			return -1;
+		if (string == NULL)
+			return 0;
+
+		target = NULL;
+		if (prog == NULL) {
+			id = LIRCRC_PROG_OTHER;
+		} else if (strcmp(prog, "forward") == 0) {
+			id = LIRCRC_PROG_FORWARD;
+		} else if (strcmp(prog, "txir") == 0) {
+			id = LIRCRC_PROG_TXIR;
+		} else if (strcmp(prog, "lge") == 0 || strncmp(prog, "lge:", 4) == 0) {
+			id = LIRCRC_PROG_LGE;
+			if (prog[3] == ':')
+				target = prog + 4;
+		} else if (strcmp(prog, "sh") == 0) {
+			id = LIRCRC_PROG_SH;
+		} else if (strcmp(prog, "macro") == 0) {
+			id = LIRCRC_PROG_MACRO;
+		} else {
+			id = LIRCRC_PROG_OTHER;
+		}
+		cmp_add(actions, cmp_prog_name(id), target, string);
+	}
+}
+
+static void cmp_print(const char *who, const struct cmp_actions *actions)
+{
+	unsigned int i;
+
+	if (actions->count == 0)
+		fprintf(stderr, "  %s: nothing\n", who);
+	for (i = 0; i < actions->count; ++i)
+		fprintf(stderr, "  %s: %s\n", who, actions->action[i]);
+}
+
+static int cmp_equal(const struct cmp_actions *a, const struct cmp_actions *b)
+{
+	unsigned int i;
+
+	if (a->count != b->count)
+		return 0;
+	for (i = 0; i < a->count; ++i) {
+		if (strcmp(a->action[i], b->action[i]) != 0)
+			return 0;
+	}
+	return 1;
+}
+
+static void cmp_usage(const char *progname)
+{
+	fprintf(stdout, "Usage: %s [options] [<lircrc> [<events>]]\n", progname);
+	fprintf(stdout, "    -h --help              print this help message and exit\n");
+	fprintf(stdout, "    -v --verbose           print the actions of every message\n");
+}
+
+int main(int argc, char **argv)
+{
+	const struct option longopts[] = {
+		{"help",no_argument,NULL,'h'},
+		{"verbose",no_argument,NULL,'v'},
+		{0, 0, 0, 0}
+	};
+	char lircrc_path[CMP_LINE_MAX], events_path[CMP_LINE_MAX];
+	char message[CMP_LINE_MAX], button[CMP_LINE_MAX], remote[CMP_LINE_MAX];
+	struct cmp_actions expected, actual;
+	struct lirc_config *config = NULL;
+	struct lircrc *lircrc;
+	struct lircrc_key *key;
+	unsigned int repeat, line = 0, messages = 0, actions = 0;
+	const char *srcdir;
+	FILE *events;
+	int opt;
+
+	while ((opt = getopt_long(argc, argv, "hv", longopts, NULL)) != -1) {
+		switch (opt) {
+		case 'h':
+			cmp_usage(argv[0]);
+			exit(EXIT_SUCCESS);
+		case 'v':
+			cmp_verbose = 1;
+			break;
+		default:
+			cmp_usage(argv[0]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if ((srcdir = getenv("srcdir")) == NULL)
+		srcdir = ".";
+	snprintf(lircrc_path, sizeof(lircrc_path), "%s/lircrccmp.lircrc", srcdir);
+	snprintf(events_path, sizeof(events_path), "%s/lircrccmp.events", srcdir);
+	if (optind < argc)
+		snprintf(lircrc_path, sizeof(lircrc_path), "%s", argv[optind++]);
+	if (optind < argc)
+		snprintf(events_path, sizeof(events_path), "%s", argv[optind++]);
+
+	openlog("lircrccmp", LOG_PERROR, LOG_USER);
+	setlogmask(LOG_UPTO(LOG_WARNING));
+
+	if (lirc_readconfig_only(lircrc_path, &config, NULL) == -1) {
+		fprintf(stderr, "lircrccmp: liblirc failed to read %s\n", lircrc_path);
+		exit(EXIT_FAILURE);
+	}
+	if ((lircrc = lircrc_read(lircrc_path)) == NULL) {
+		fprintf(stderr, "lircrccmp: eventlircd failed to read %s\n", lircrc_path);
+		exit(EXIT_FAILURE);
+	}
+	if ((events = fopen(events_path, "r")) == NULL) {
+		fprintf(stderr, "lircrccmp: %s: %s\n", events_path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	while (fgets(message, sizeof(message), events) != NULL) {
+		++line;
+		if (sscanf(message, "%*x %x %255s %255s", &repeat, button, remote) != 3) {
+			fprintf(stderr, "lircrccmp: %s:%u: not an lircd message\n", events_path, line);
+			exit(EXIT_FAILURE);
+		}
+
+		memset(&expected, 0, sizeof(expected));
+		memset(&actual, 0, sizeof(actual));
+		if (cmp_liblirc(config, message, &expected) != 0) {
+			fprintf(stderr, "lircrccmp: %s:%u: liblirc failed\n", events_path, line);
+			exit(EXIT_FAILURE);
+		}
+		if ((key = lircrc_key(lircrc, remote, button)) == NULL ||
+		    lircrc_run(lircrc, key, repeat, &cmp_lircrc_action, &actual) == -1) {
+			fprintf(stderr, "lircrccmp: %s:%u: eventlircd failed\n", events_path, line);
+			exit(EXIT_FAILURE);
+		}
+
+		if (!cmp_equal(&expected, &actual)) {
+			fprintf(stderr, "lircrccmp: %s:%u: %s", events_path, line, message);
+			cmp_print("liblirc", &expected);
+			cmp_print("eventlircd", &actual);
+			exit(EXIT_FAILURE);
+		}
+		if (cmp_verbose) {
+			fprintf(stderr, "%s", message);
+			cmp_print("both", &actual);
+		}
+		++messages;
+		actions += actual.count;
+	}
+
+	fclose(events);
+	lircrc_free(lircrc);
+	lirc_freeconfig(config);
+
+	printf("%u messages, %u actions, the same as liblirc\n", messages, actions);
+	exit(EXIT_SUCCESS);
+}